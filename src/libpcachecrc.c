@@ -0,0 +1,94 @@
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "libpcachecrc.h"
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+
+static uint32_t crc_table[8][256];
+static bool crc_hw;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t crc;
+	unsigned int i, j;
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+		crc_hw = true;
+#endif
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+	}
+}
+
+#if defined(__x86_64__)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t crc64 = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--, p++)
+		asm("crc32b %1, %k0" : "+r" (crc64) : "rm" (*p));
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		asm("crc32q %1, %0" : "+r" (crc64) : "rm" (v));
+	}
+
+	for (; len; len--, p++)
+		asm("crc32b %1, %k0" : "+r" (crc64) : "rm" (*p));
+
+	return crc64;
+}
+#endif
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	for (; len && ((uintptr_t)p & 7); len--, p++)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+
+	/* little endian only; big endian hosts take the bytewise loop */
+	for (; len >= 8 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__; len -= 8, p += 8) {
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo ^= crc;
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+		      crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+		      crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	}
+
+	for (; len; len--, p++)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+
+	return crc;
+}
+
+uint32_t pcache_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (crc_hw)
+		return ~crc32c_hw(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
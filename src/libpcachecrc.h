@@ -0,0 +1,14 @@
+#ifndef PCACHECRC_H
+#define PCACHECRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has
+ * it and slicing-by-8 tables otherwise. Pass 0 to start and the previous
+ * result to continue over the next buffer.
+ */
+uint32_t pcache_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif // PCACHECRC_H
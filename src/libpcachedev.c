@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+#include "pcache.h"
+#include "libpcachedev.h"
+#include "libpcachesys.h"
+#include "libpcachecrc.h"
+
+/* A device-DAX character device has no size ioctl, sysfs has it */
+static int dev_char_size(dev_t rdev, uint64_t *size)
+{
+	char path[PCACHE_PATH_LEN];
+	char buf[32];
+	char *end;
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/sys/dev/char/%u:%u/size", pcachesys_root(),
+		 major(rdev), minor(rdev));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? -ENOTBLK : -errno;
+
+	ret = pcachesys_read_fd(fd, buf, sizeof(buf));
+	close(fd);
+	if (ret)
+		return ret;
+
+	errno = 0;
+	*size = strtoull(buf, &end, 0);
+	if (errno || end == buf)
+		return -EINVAL;
+	return 0;
+}
+
+/* Size in bytes of a block device, device-DAX character device or regular file */
+int pcachedev_size(int fd, uint64_t *size)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb))
+		return -errno;
+
+	if (S_ISBLK(sb.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size))
+			return -errno;
+		return 0;
+	}
+
+	if (S_ISCHR(sb.st_mode))
+		return dev_char_size(sb.st_rdev, size);
+
+	if (!S_ISREG(sb.st_mode))
+		return -ENOTBLK;
+
+	*size = sb.st_size;
+	return 0;
+}
+
+/* pcache_crc32c() inverts on the way in and out, the kernel's crc32c() does not */
+uint32_t pcachedev_sb_crc(const struct pcache_sb *sb)
+{
+	return ~pcache_crc32c(~(uint32_t)PCACHE_SB_CRC_SEED, (const char *)sb + sizeof(sb->crc),
+			      sizeof(*sb) - sizeof(sb->crc));
+}
+
+/*
+ * Read the superblock of probe->path and classify the device. Block devices
+ * and regular image files are both accepted.
+ */
+void pcachedev_probe(struct pcachedev_probe *probe)
+{
+	struct pcache_sb sb;
+	ssize_t len;
+	int fd;
+
+	probe->status = PCACHEDEV_ERROR;
+	probe->err = 0;
+
+	fd = open(probe->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		probe->err = -errno;
+		return;
+	}
+
+	probe->err = pcachedev_size(fd, &probe->size);
+	if (probe->err)
+		goto out;
+
+	if (probe->size < PCACHE_SB_OFF + sizeof(sb)) {
+		probe->status = PCACHEDEV_FOREIGN;
+		goto out;
+	}
+
+	len = pread(fd, &sb, sizeof(sb), PCACHE_SB_OFF);
+	if (len != sizeof(sb)) {
+		probe->err = len < 0 ? -errno : -EIO;
+		goto out;
+	}
+
+	probe->magic = le64toh(sb.magic);
+	probe->version = le16toh(sb.version);
+	probe->flags = le16toh(sb.flags);
+	probe->segment_num = le32toh(sb.seg_num);
+
+	if (probe->magic != PCACHE_MAGIC)
+		probe->status = PCACHEDEV_FOREIGN;
+	else if (probe->version != PCACHE_SB_VERSION)
+		probe->status = PCACHEDEV_UNSUPPORTED;
+	else if (le32toh(sb.crc) != pcachedev_sb_crc(&sb))
+		probe->status = PCACHEDEV_CORRUPT;
+	else if ((uint64_t)probe->segment_num * PCACHE_SEG_SIZE > probe->size)
+		probe->status = PCACHEDEV_TRUNCATED;
+	else
+		probe->status = PCACHEDEV_VALID;
+out:
+	close(fd);
+}
+
+struct probe_worker {
+	struct pcachedev_probe	*probes;
+	unsigned int		nr;
+	unsigned int		next;
+};
+
+static void *probe_worker_fn(void *data)
+{
+	struct probe_worker *worker = data;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&worker->next, 1, __ATOMIC_RELAXED)) < worker->nr)
+		pcachedev_probe(&worker->probes[i]);
+
+	return NULL;
+}
+
+/*
+ * Probe every entry with up to nr_threads threads; on hosts with many
+ * namespaces the header reads overlap instead of queueing one by one.
+ */
+void pcachedev_probe_all(struct pcachedev_probe *probes, unsigned int nr, unsigned int nr_threads)
+{
+	struct probe_worker worker = { .probes = probes, .nr = nr };
+	pthread_t *threads;
+	unsigned int i, started = 0;
+
+	if (nr_threads > nr)
+		nr_threads = nr;
+
+	threads = nr_threads > 1 ? calloc(nr_threads, sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < nr_threads; i++) {
+			if (pthread_create(&threads[i], NULL, probe_worker_fn, &worker))
+				break;
+			started++;
+		}
+	}
+
+	/* the caller works too, which also covers thread creation failures */
+	probe_worker_fn(&worker);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+const char *pcachedev_status_str(const struct pcachedev_probe *probe)
+{
+	switch (probe->status) {
+	case PCACHEDEV_VALID:
+		return "valid";
+	case PCACHEDEV_FOREIGN:
+		return "no pcache header";
+	case PCACHEDEV_UNSUPPORTED:
+		return "unsupported version";
+	case PCACHEDEV_CORRUPT:
+		return "superblock crc mismatch";
+	case PCACHEDEV_TRUNCATED:
+		return "segment_num exceeds device size";
+	default:
+		return strerror(-probe->err);
+	}
+}
+
+/* @seg points at the start of segment @seg_id in a mapping of the device */
+bool pcachedev_seg_in_use(const void *seg, unsigned int seg_id)
+{
+	const uint64_t *info = seg;
+	unsigned int i;
+
+	if (!seg_id)
+		return true;
+
+	for (i = 0; i < PCACHE_SEG_INFO_SIZE / sizeof(*info); i++) {
+		if (info[i])
+			return true;
+	}
+
+	return false;
+}
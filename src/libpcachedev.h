@@ -0,0 +1,69 @@
+#ifndef PCACHEDEV_H
+#define PCACHEDEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pcache.h"
+
+/*
+ * On-media layout of a cache device, as far as userspace needs it.
+ *
+ * The kernel keeps the superblock at PCACHE_SB_OFF, little endian; its
+ * magic, version, flags and segment_num are what the cache's sysfs info
+ * attribute reports once registered. crc covers the rest of struct pcache_sb,
+ * computed as the kernel's crc32c() does: seeded with PCACHE_SB_CRC_SEED and
+ * without the final inversion. Segments are PCACHE_SEG_SIZE_MB each.
+ */
+#define PCACHE_MAGIC		0x65B05EFA96C596EFULL
+#define PCACHE_SB_VERSION	1
+#define PCACHE_SB_OFF		(4 * 1024)
+#define PCACHE_SB_SIZE		(4 * 1024)
+#define PCACHE_SB_CRC_SEED	0x3B15A
+
+/*
+ * Segment i covers [i * PCACHE_SEG_SIZE, (i + 1) * PCACHE_SEG_SIZE); the
+ * first one also carries the superblock and cache metadata and is always in
+ * use. Every other segment starts with an info block that the kernel writes
+ * when it hands the segment out and that format leaves zeroed, so a segment
+ * whose info block is all zeros holds nothing.
+ */
+#define PCACHE_SEG_SIZE		((uint64_t)PCACHE_SEG_SIZE_MB * 1024 * 1024)
+#define PCACHE_SEG_INFO_SIZE	(4 * 1024)
+
+struct pcache_sb {
+	uint32_t	crc;
+	uint16_t	version;
+	uint16_t	flags;
+	uint64_t	magic;
+	uint32_t	seg_num;
+} __attribute__((packed));
+
+enum pcachedev_status {
+	PCACHEDEV_VALID		= 0,
+	PCACHEDEV_FOREIGN,	/* no pcache magic */
+	PCACHEDEV_UNSUPPORTED,	/* pcache magic, but a version we do not know */
+	PCACHEDEV_CORRUPT,	/* pcache magic, but the superblock crc does not match */
+	PCACHEDEV_TRUNCATED,	/* header claims more segments than fit */
+	PCACHEDEV_ERROR,	/* open or read failed, see err */
+};
+
+struct pcachedev_probe {
+	char			path[PCACHE_PATH_LEN];
+	enum pcachedev_status	status;
+	int			err;		/* -errno for PCACHEDEV_ERROR */
+	uint64_t		size;		/* bytes */
+	uint64_t		magic;
+	int			version;
+	int			flags;
+	unsigned int		segment_num;
+};
+
+int pcachedev_size(int fd, uint64_t *size);
+uint32_t pcachedev_sb_crc(const struct pcache_sb *sb);
+void pcachedev_probe(struct pcachedev_probe *probe);
+void pcachedev_probe_all(struct pcachedev_probe *probes, unsigned int nr, unsigned int nr_threads);
+const char *pcachedev_status_str(const struct pcachedev_probe *probe);
+bool pcachedev_seg_in_use(const void *seg, unsigned int seg_id);
+
+#endif // PCACHEDEV_H
@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pcache.h"
+#include "libpcacheplan.h"
+#include "libpcachetrace.h"
+
+#define PLAN_SEG_SHIFT		(20 + __builtin_ctz(PCACHE_SEG_SIZE_MB))
+#define PLAN_POINTS_INIT	64
+
+/* PLAN_SEG_SHIFT only holds for a power of two segment size */
+typedef char plan_seg_shift_check[(1ULL << PLAN_SEG_SHIFT) == PCACHE_SEG_SIZE_MB * 1024ULL * 1024 ? 1 : -1];
+
+void pcacheplan_init(struct pcacheplan *plan, unsigned int min_segs)
+{
+	memset(plan, 0, sizeof(*plan));
+	plan->min_segs = min_segs;
+}
+
+void pcacheplan_free(struct pcacheplan *plan)
+{
+	unsigned int i;
+
+	for (i = 0; i < plan->nr_backings; i++) {
+		free(plan->backings[i].segs);
+		free(plan->backings[i].hits);
+	}
+	plan->nr_backings = 0;
+}
+
+struct pcacheplan_backing *pcacheplan_add_backing(struct pcacheplan *plan, unsigned int backing_id,
+						  unsigned int fixed_segs)
+{
+	struct pcacheplan_backing *backing;
+
+	if (plan->nr_backings == PCACHE_BACKING_HANDLERS_MAX)
+		return NULL;
+
+	backing = &plan->backings[plan->nr_backings++];
+	memset(backing, 0, sizeof(*backing));
+	backing->backing_id = backing_id;
+	backing->fixed_segs = fixed_segs;
+
+	return backing;
+}
+
+struct pcacheplan_backing *pcacheplan_find_backing(struct pcacheplan *plan, unsigned int backing_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < plan->nr_backings; i++) {
+		if (plan->backings[i].backing_id == backing_id)
+			return &plan->backings[i];
+	}
+
+	return NULL;
+}
+
+static int plan_add_point(struct pcacheplan_backing *backing, uint32_t segs, double hits)
+{
+	if (backing->nr_points == backing->cap_points) {
+		unsigned int cap = backing->cap_points ? backing->cap_points * 2 : PLAN_POINTS_INIT;
+		uint32_t *new_segs;
+		double *new_hits;
+
+		new_segs = realloc(backing->segs, sizeof(*new_segs) * cap);
+		if (!new_segs)
+			return -ENOMEM;
+		backing->segs = new_segs;
+
+		new_hits = realloc(backing->hits, sizeof(*new_hits) * cap);
+		if (!new_hits)
+			return -ENOMEM;
+		backing->hits = new_hits;
+
+		backing->cap_points = cap;
+	}
+
+	backing->segs[backing->nr_points] = segs;
+	backing->hits[backing->nr_points] = hits;
+	backing->nr_points++;
+
+	return 0;
+}
+
+/*
+ * Expected hits with @segs segments. Trace curves are step functions, MRC
+ * curves are interpolated linearly from an implicit (0, 0) origin.
+ */
+double pcacheplan_curve_eval(const struct pcacheplan_backing *backing, unsigned int segs)
+{
+	double px = 0, py = 0;
+	unsigned int i;
+
+	for (i = 0; i < backing->nr_points; i++) {
+		if (backing->segs[i] > segs) {
+			if (backing->source != PCACHEPLAN_SRC_MRC)
+				return py;
+			return py + (backing->hits[i] - py) * (segs - px) / (backing->segs[i] - px);
+		}
+		px = backing->segs[i];
+		py = backing->hits[i];
+	}
+
+	return py;
+}
+
+/*
+ * Trace loading: LRU stack distances in segments, streamed. A Fenwick tree
+ * over access times holds a 1 at each segment's last access; when the times
+ * run out the live ones are renumbered 0..n-1, so memory follows the number
+ * of distinct segments rather than the length of the trace.
+ */
+
+#define PLAN_LRU_MIN		4096
+
+struct plan_lru {
+	/* segment -> time of its last access, open addressing */
+	uint64_t	*key;
+	uint32_t	*time;		/* UINT32_MAX marks a free slot */
+	size_t		map_size;
+	size_t		nr_keys;
+
+	int32_t		*tree;
+	size_t		cap;		/* times before the next renumbering */
+	size_t		now;
+
+	uint64_t	*hist;		/* accesses by stack distance */
+	size_t		hist_size;
+	size_t		max_dist;
+	uint64_t	accesses;
+};
+
+struct plan_lru_mark {
+	uint32_t	time;
+	uint32_t	slot;
+};
+
+static void fenwick_add(int32_t *tree, size_t n, size_t pos, int32_t delta)
+{
+	for (pos++; pos <= n; pos += pos & -pos)
+		tree[pos] += delta;
+}
+
+static int64_t fenwick_sum(const int32_t *tree, size_t pos)
+{
+	int64_t sum = 0;
+
+	for (; pos > 0; pos -= pos & -pos)
+		sum += tree[pos];
+
+	return sum;
+}
+
+static inline size_t plan_hash64(uint64_t key, size_t mask)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+
+	return key & mask;
+}
+
+static void plan_lru_free(struct plan_lru *lru)
+{
+	free(lru->key);
+	free(lru->time);
+	free(lru->tree);
+	free(lru->hist);
+}
+
+static int plan_lru_init(struct plan_lru *lru)
+{
+	memset(lru, 0, sizeof(*lru));
+
+	lru->map_size = PLAN_LRU_MIN * 2;
+	lru->cap = PLAN_LRU_MIN;
+	lru->hist_size = PLAN_LRU_MIN;
+	lru->key = malloc(sizeof(*lru->key) * lru->map_size);
+	lru->time = malloc(sizeof(*lru->time) * lru->map_size);
+	lru->tree = calloc(lru->cap + 1, sizeof(*lru->tree));
+	lru->hist = calloc(lru->hist_size, sizeof(*lru->hist));
+	if (!lru->key || !lru->time || !lru->tree || !lru->hist) {
+		plan_lru_free(lru);
+		return -ENOMEM;
+	}
+	memset(lru->time, 0xff, sizeof(*lru->time) * lru->map_size);
+
+	return 0;
+}
+
+static size_t plan_lru_slot(const struct plan_lru *lru, uint64_t seg)
+{
+	size_t h = plan_hash64(seg, lru->map_size - 1);
+
+	while (lru->time[h] != UINT32_MAX && lru->key[h] != seg)
+		h = (h + 1) & (lru->map_size - 1);
+
+	return h;
+}
+
+static int plan_lru_grow(struct plan_lru *lru)
+{
+	struct plan_lru old = *lru;
+	size_t i, h;
+
+	lru->map_size *= 2;
+	lru->key = malloc(sizeof(*lru->key) * lru->map_size);
+	lru->time = malloc(sizeof(*lru->time) * lru->map_size);
+	if (!lru->key || !lru->time) {
+		free(lru->key);
+		free(lru->time);
+		*lru = old;
+		return -ENOMEM;
+	}
+	memset(lru->time, 0xff, sizeof(*lru->time) * lru->map_size);
+
+	for (i = 0; i < old.map_size; i++) {
+		if (old.time[i] == UINT32_MAX)
+			continue;
+		h = plan_lru_slot(lru, old.key[i]);
+		lru->key[h] = old.key[i];
+		lru->time[h] = old.time[i];
+	}
+	free(old.key);
+	free(old.time);
+
+	return 0;
+}
+
+static int plan_lru_mark_cmp(const void *a, const void *b)
+{
+	const struct plan_lru_mark *ma = a, *mb = b;
+
+	return ma->time < mb->time ? -1 : ma->time > mb->time;
+}
+
+/* Renumber the live times 0..nr_keys-1 in order and leave as many free */
+static int plan_lru_renumber(struct plan_lru *lru)
+{
+	struct plan_lru_mark *marks;
+	size_t cap = lru->nr_keys * 2 > PLAN_LRU_MIN ? lru->nr_keys * 2 : PLAN_LRU_MIN;
+	int32_t *tree;
+	size_t i, n = 0;
+
+	marks = malloc(sizeof(*marks) * (lru->nr_keys ? lru->nr_keys : 1));
+	tree = calloc(cap + 1, sizeof(*tree));
+	if (!marks || !tree) {
+		free(marks);
+		free(tree);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < lru->map_size; i++) {
+		if (lru->time[i] == UINT32_MAX)
+			continue;
+		marks[n].time = lru->time[i];
+		marks[n].slot = i;
+		n++;
+	}
+	qsort(marks, n, sizeof(*marks), plan_lru_mark_cmp);
+
+	for (i = 0; i < n; i++) {
+		lru->time[marks[i].slot] = i;
+		fenwick_add(tree, cap, i, 1);
+	}
+	free(marks);
+
+	free(lru->tree);
+	lru->tree = tree;
+	lru->cap = cap;
+	lru->now = n;
+
+	return 0;
+}
+
+static int plan_lru_access(struct plan_lru *lru, uint64_t seg)
+{
+	size_t h, dist;
+	uint64_t *hist;
+	int ret;
+
+	if (lru->now == lru->cap) {
+		ret = plan_lru_renumber(lru);
+		if (ret)
+			return ret;
+	}
+
+	h = plan_lru_slot(lru, seg);
+	if (lru->time[h] != UINT32_MAX) {
+		size_t last = lru->time[h];
+
+		dist = fenwick_sum(lru->tree, lru->now) - fenwick_sum(lru->tree, last + 1);
+		lru->hist[dist]++;
+		if (dist > lru->max_dist)
+			lru->max_dist = dist;
+		fenwick_add(lru->tree, lru->cap, last, -1);
+	} else {
+		if ((lru->nr_keys + 1) * 2 > lru->map_size) {
+			ret = plan_lru_grow(lru);
+			if (ret)
+				return ret;
+			h = plan_lru_slot(lru, seg);
+		}
+		/* a distance is below the number of distinct segments */
+		if (lru->nr_keys + 1 > lru->hist_size) {
+			hist = realloc(lru->hist, sizeof(*hist) * lru->hist_size * 2);
+			if (!hist)
+				return -ENOMEM;
+			memset(hist + lru->hist_size, 0, sizeof(*hist) * lru->hist_size);
+			lru->hist = hist;
+			lru->hist_size *= 2;
+		}
+		lru->key[h] = seg;
+		lru->nr_keys++;
+	}
+
+	lru->time[h] = lru->now;
+	fenwick_add(lru->tree, lru->cap, lru->now, 1);
+	lru->now++;
+	lru->accesses++;
+
+	return 0;
+}
+
+static int plan_lru_curve(struct pcacheplan_backing *backing, const struct plan_lru *lru)
+{
+	uint64_t cum = 0;
+	size_t t;
+	int ret;
+
+	backing->nr_points = 0;
+	for (t = 0; t <= lru->max_dist && lru->accesses; t++) {
+		if (!lru->hist[t])
+			continue;
+		cum += lru->hist[t];
+		ret = plan_add_point(backing, t + 1, cum);
+		if (ret)
+			return ret;
+	}
+
+	backing->source = PCACHEPLAN_SRC_TRACE;
+	backing->accesses = lru->accesses;
+
+	return 0;
+}
+
+/*
+ * Build @backing_id's curve from a block trace of the backing, blkparse text
+ * or binary (see libpcachetrace.h); every segment an I/O touches counts as
+ * one access.
+ */
+int pcacheplan_load_trace(struct pcacheplan *plan, unsigned int backing_id, const char *path)
+{
+	struct pcacheplan_backing *backing;
+	struct pcachetrace trace;
+	struct pcachetrace_io io;
+	struct plan_lru lru;
+	uint64_t seg, last;
+	int ret;
+
+	backing = pcacheplan_find_backing(plan, backing_id);
+	if (!backing) {
+		printf("backing %u not found\n", backing_id);
+		return -ENOENT;
+	}
+
+	ret = pcachetrace_open(&trace, path);
+	if (ret)
+		return ret;
+
+	ret = plan_lru_init(&lru);
+	if (ret)
+		goto close;
+
+	while ((ret = pcachetrace_next(&trace, &io)) > 0) {
+		last = (io.offset + (io.len ? io.len : 1) - 1) >> PLAN_SEG_SHIFT;
+		for (seg = io.offset >> PLAN_SEG_SHIFT; seg <= last; seg++) {
+			ret = plan_lru_access(&lru, seg);
+			if (ret)
+				goto free;
+		}
+	}
+	if (!ret)
+		ret = plan_lru_curve(backing, &lru);
+free:
+	plan_lru_free(&lru);
+close:
+	pcachetrace_close(&trace);
+	return ret;
+}
+
+static void plan_sort_points(struct pcacheplan_backing *backing)
+{
+	unsigned int i, j;
+
+	/* insertion sort, MRC files are short and usually sorted already */
+	for (i = 1; i < backing->nr_points; i++) {
+		uint32_t segs = backing->segs[i];
+		double hits = backing->hits[i];
+
+		for (j = i; j > 0 && backing->segs[j - 1] > segs; j--) {
+			backing->segs[j] = backing->segs[j - 1];
+			backing->hits[j] = backing->hits[j - 1];
+		}
+		backing->segs[j] = segs;
+		backing->hits[j] = hits;
+	}
+}
+
+/*
+ * MRC lines are "<backing_id> <segs> <miss_ratio> [<accesses>]". The access
+ * count weights the backing against the others and defaults to 1; the last
+ * one given for a backing wins.
+ */
+int pcacheplan_load_mrc(struct pcacheplan *plan, const char *path)
+{
+	unsigned int backing_id, segs, lineno = 0, i;
+	double miss_ratio, accesses;
+	char line[256];
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		printf("failed to open %s\n", path);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		struct pcacheplan_backing *backing;
+		int n;
+
+		lineno++;
+		if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+
+		n = sscanf(line, "%u %u %lf %lf", &backing_id, &segs, &miss_ratio, &accesses);
+		if (n < 3 || miss_ratio < 0 || miss_ratio > 1) {
+			printf("%s:%u: malformed mrc line\n", path, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		backing = pcacheplan_find_backing(plan, backing_id);
+		if (!backing)
+			continue;
+
+		if (backing->source != PCACHEPLAN_SRC_MRC) {
+			backing->nr_points = 0;
+			backing->source = PCACHEPLAN_SRC_MRC;
+			backing->accesses = 1;
+		}
+		if (n == 4)
+			backing->accesses = accesses;
+
+		/* store the hit ratio, scaled by accesses once the file is read */
+		ret = plan_add_point(backing, segs, 1.0 - miss_ratio);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < plan->nr_backings; i++) {
+		struct pcacheplan_backing *backing = &plan->backings[i];
+		unsigned int p;
+
+		if (backing->source != PCACHEPLAN_SRC_MRC)
+			continue;
+
+		plan_sort_points(backing);
+		for (p = 0; p < backing->nr_points; p++)
+			backing->hits[p] *= backing->accesses;
+	}
+out:
+	fclose(file);
+	return ret;
+}
+
+/* One edge of a backing's concave hull: dx more segments give dy more hits */
+struct plan_edge {
+	unsigned int	backing;
+	unsigned int	dx;
+	double		dy;
+};
+
+static int plan_edge_cmp(const void *a, const void *b)
+{
+	const struct plan_edge *ea = a, *eb = b;
+	double sa = ea->dy / ea->dx, sb = eb->dy / eb->dx;
+
+	if (sa != sb)
+		return sa > sb ? -1 : 1;
+	if (ea->backing != eb->backing)
+		return ea->backing < eb->backing ? -1 : 1;
+
+	return 0;
+}
+
+/* Append the upper concave hull of a curve, starting at its minimum size */
+static int plan_hull_edges(struct pcacheplan_backing *backing, unsigned int idx, unsigned int start,
+			   unsigned int limit, struct plan_edge *edges, unsigned int *nr_edges)
+{
+	uint32_t *hx;
+	double *hy;
+	unsigned int nr = 0, i;
+
+	hx = malloc(sizeof(*hx) * (backing->nr_points + 1));
+	hy = malloc(sizeof(*hy) * (backing->nr_points + 1));
+	if (!hx || !hy) {
+		free(hx);
+		free(hy);
+		return -ENOMEM;
+	}
+
+	hx[nr] = start;
+	hy[nr++] = pcacheplan_curve_eval(backing, start);
+
+	for (i = 0; i < backing->nr_points; i++) {
+		uint32_t x = backing->segs[i];
+		double y = backing->hits[i];
+
+		if (x <= start || x > limit || y <= hy[nr - 1])
+			continue;
+
+		/* pop points lying on or below the chord to the new point */
+		while (nr >= 2 &&
+		       (hy[nr - 1] - hy[nr - 2]) * (double)(x - hx[nr - 2]) <=
+		       (y - hy[nr - 2]) * (double)(hx[nr - 1] - hx[nr - 2]))
+			nr--;
+
+		hx[nr] = x;
+		hy[nr++] = y;
+	}
+
+	for (i = 1; i < nr; i++) {
+		edges[*nr_edges].backing = idx;
+		edges[*nr_edges].dx = hx[i] - hx[i - 1];
+		edges[*nr_edges].dy = hy[i] - hy[i - 1];
+		(*nr_edges)++;
+	}
+
+	free(hx);
+	free(hy);
+	return 0;
+}
+
+/*
+ * Distribute @total_segs segments. Every backing first gets min_segs (or its
+ * fixed size when it has no curve), the rest goes to the steepest hull edges
+ * first. Segments that would add no hits are left unassigned.
+ */
+int pcacheplan_solve(struct pcacheplan *plan, unsigned int total_segs)
+{
+	struct plan_edge *edges;
+	unsigned int nr_edges = 0, max_edges = 0, remaining, i;
+	int ret = 0;
+
+	remaining = total_segs;
+	for (i = 0; i < plan->nr_backings; i++) {
+		struct pcacheplan_backing *backing = &plan->backings[i];
+
+		if (backing->source == PCACHEPLAN_SRC_NONE)
+			backing->planned_segs = backing->fixed_segs > plan->min_segs ?
+						backing->fixed_segs : plan->min_segs;
+		else
+			backing->planned_segs = plan->min_segs;
+
+		if (backing->planned_segs > remaining) {
+			printf("cache has %u segments, not enough for %u backings\n",
+			       total_segs, plan->nr_backings);
+			return -ENOSPC;
+		}
+		remaining -= backing->planned_segs;
+		max_edges += backing->nr_points;
+	}
+
+	edges = malloc(sizeof(*edges) * (max_edges + 1));
+	if (!edges)
+		return -ENOMEM;
+
+	for (i = 0; i < plan->nr_backings; i++) {
+		struct pcacheplan_backing *backing = &plan->backings[i];
+
+		if (backing->source == PCACHEPLAN_SRC_NONE)
+			continue;
+
+		ret = plan_hull_edges(backing, i, backing->planned_segs,
+				      backing->planned_segs + remaining, edges, &nr_edges);
+		if (ret)
+			goto out;
+	}
+
+	/* hull slopes decrease along each backing, so this keeps every backing's edges in order */
+	qsort(edges, nr_edges, sizeof(*edges), plan_edge_cmp);
+
+	for (i = 0; i < nr_edges && remaining; i++) {
+		unsigned int take;
+
+		if (edges[i].dy <= 0)
+			break;
+
+		take = edges[i].dx < remaining ? edges[i].dx : remaining;
+		plan->backings[edges[i].backing].planned_segs += take;
+		remaining -= take;
+	}
+
+	for (i = 0; i < plan->nr_backings; i++) {
+		struct pcacheplan_backing *backing = &plan->backings[i];
+
+		backing->planned_hits = pcacheplan_curve_eval(backing, backing->planned_segs);
+	}
+	plan->unassigned_segs = remaining;
+out:
+	free(edges);
+	return ret;
+}
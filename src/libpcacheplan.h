@@ -0,0 +1,66 @@
+#ifndef PCACHEPLAN_H
+#define PCACHEPLAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pcache.h"
+
+/*
+ * Capacity planner: split a cache's segments across its backings so that the
+ * total expected hit count is maximised.
+ *
+ * Each backing carries a hit curve, hits(segs), built either from a miss-ratio
+ * curve (piecewise linear between the given points) or from a block trace
+ * (LRU stack distances at segment granularity, a step function). The solver
+ * takes the upper concave hull of every curve and hands out segments greedily
+ * by marginal gain per segment, which is optimal for the hulls and lands on
+ * real curve points except for the last partial step.
+ */
+
+enum pcacheplan_source {
+	PCACHEPLAN_SRC_NONE	= 0,
+	PCACHEPLAN_SRC_TRACE,
+	PCACHEPLAN_SRC_MRC,
+};
+
+struct pcacheplan_backing {
+	unsigned int		backing_id;
+	enum pcacheplan_source	source;
+
+	/* hit curve points, sorted by segs */
+	unsigned int		nr_points;
+	unsigned int		cap_points;
+	uint32_t		*segs;
+	double			*hits;
+	double			accesses;
+
+	/* backings without a curve are pinned at this size */
+	unsigned int		fixed_segs;
+
+	/* solver output */
+	unsigned int		planned_segs;
+	double			planned_hits;
+};
+
+struct pcacheplan {
+	unsigned int			nr_backings;
+	struct pcacheplan_backing	backings[PCACHE_BACKING_HANDLERS_MAX];
+	unsigned int			min_segs;
+	unsigned int			unassigned_segs;
+};
+
+void pcacheplan_init(struct pcacheplan *plan, unsigned int min_segs);
+void pcacheplan_free(struct pcacheplan *plan);
+
+struct pcacheplan_backing *pcacheplan_add_backing(struct pcacheplan *plan, unsigned int backing_id,
+						  unsigned int fixed_segs);
+struct pcacheplan_backing *pcacheplan_find_backing(struct pcacheplan *plan, unsigned int backing_id);
+
+int pcacheplan_load_trace(struct pcacheplan *plan, unsigned int backing_id, const char *path);
+int pcacheplan_load_mrc(struct pcacheplan *plan, const char *path);
+
+double pcacheplan_curve_eval(const struct pcacheplan_backing *backing, unsigned int segs);
+int pcacheplan_solve(struct pcacheplan *plan, unsigned int total_segs);
+
+#endif // PCACHEPLAN_H
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+#include "libpcachedev.h"
+#include "libpcachepmem.h"
+
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE	0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC		0x80000
+#endif
+
+/*
+ * Map all of @path. MAP_SYNC is tried first so DAX mappings skip the page
+ * cache; any other block device or file falls back to a plain shared
+ * mapping. A device-DAX character device is always mapped directly, with or
+ * without MAP_SYNC. Block devices are opened exclusively.
+ */
+int pcachepmem_map(struct pcachepmem_map *map, const char *path, bool writable)
+{
+	int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+	int flags = (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+	struct stat sb;
+	int ret;
+
+	memset(map, 0, sizeof(*map));
+
+	if (stat(path, &sb)) {
+		ret = -errno;
+		printf("failed to stat %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	/* an exclusive open fails while the kernel holds the device, and keeps it from claiming it */
+	if (S_ISBLK(sb.st_mode))
+		flags |= O_EXCL;
+
+	map->fd = open(path, flags);
+	if (map->fd < 0) {
+		ret = -errno;
+		if (ret == -EBUSY)
+			printf("%s is in use\n", path);
+		else
+			printf("failed to open %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	ret = pcachedev_size(map->fd, &map->size);
+	if (ret == -ENOTBLK && S_ISCHR(sb.st_mode)) {
+		printf("%s is a character device but not device-DAX\n", path);
+		goto err;
+	}
+	if (ret) {
+		printf("failed to get the size of %s: %s\n", path, strerror(-ret));
+		goto err;
+	}
+	if (!map->size) {
+		printf("%s is empty\n", path);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	if (writable) {
+		map->addr = mmap(NULL, map->size, prot, MAP_SHARED_VALIDATE | MAP_SYNC, map->fd, 0);
+		map->sync = map->addr != MAP_FAILED;
+	}
+	if (!map->sync)
+		map->addr = mmap(NULL, map->size, prot, MAP_SHARED, map->fd, 0);
+	if (map->addr == MAP_FAILED) {
+		ret = -errno;
+		printf("failed to map %s: %s\n", path, strerror(-ret));
+		goto err;
+	}
+	map->dax = map->sync || S_ISCHR(sb.st_mode);
+
+	return 0;
+err:
+	close(map->fd);
+	map->fd = -1;
+	map->addr = NULL;
+	return ret;
+}
+
+int pcachepmem_sync(struct pcachepmem_map *map)
+{
+	if (!map->addr || map->dax)
+		return 0;
+
+	return msync(map->addr, map->size, MS_SYNC) ? -errno : 0;
+}
+
+int pcachepmem_unmap(struct pcachepmem_map *map)
+{
+	int ret;
+
+	if (!map->addr)
+		return 0;
+
+	ret = pcachepmem_sync(map);
+	munmap(map->addr, map->size);
+	close(map->fd);
+	map->addr = NULL;
+	map->fd = -1;
+
+	return ret;
+}
+
+static int flush_type = -1;
+
+enum pcachepmem_flush pcachepmem_flush_type(void)
+{
+	int type = __atomic_load_n(&flush_type, __ATOMIC_RELAXED);
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+#endif
+
+	if (type >= 0)
+		return type;
+
+	type = PCACHEPMEM_FLUSH_NONE;
+#if defined(__x86_64__)
+	type = PCACHEPMEM_FLUSH_CLFLUSH;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (ebx & (1U << 24))
+			type = PCACHEPMEM_FLUSH_CLWB;
+		else if (ebx & (1U << 23))
+			type = PCACHEPMEM_FLUSH_CLFLUSHOPT;
+	}
+#endif
+	__atomic_store_n(&flush_type, type, __ATOMIC_RELAXED);
+
+	return type;
+}
+
+const char *pcachepmem_flush_name(void)
+{
+	switch (pcachepmem_flush_type()) {
+	case PCACHEPMEM_FLUSH_CLFLUSH:
+		return "clflush";
+	case PCACHEPMEM_FLUSH_CLFLUSHOPT:
+		return "clflushopt";
+	case PCACHEPMEM_FLUSH_CLWB:
+		return "clwb";
+	default:
+		return "none";
+	}
+}
+
+void pcachepmem_flush(const void *addr, size_t len)
+{
+#if defined(__x86_64__)
+	enum pcachepmem_flush type = pcachepmem_flush_type();
+	uintptr_t line = (uintptr_t)addr & ~(uintptr_t)(PCACHEPMEM_LINE - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+
+	/* encoded by hand so no -m flags are needed to build */
+	for (; line < end; line += PCACHEPMEM_LINE) {
+		switch (type) {
+		case PCACHEPMEM_FLUSH_CLWB:
+			asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)line));
+			break;
+		case PCACHEPMEM_FLUSH_CLFLUSHOPT:
+			asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)line));
+			break;
+		default:
+			asm volatile("clflush %0" : "+m" (*(volatile char *)line));
+			break;
+		}
+	}
+#endif
+}
+
+void pcachepmem_drain(void)
+{
+#if defined(__x86_64__)
+	_mm_sfence();
+#else
+	__sync_synchronize();
+#endif
+}
+
+void pcachepmem_memcpy_nt(void *dst, const void *src, size_t len)
+{
+#if defined(__x86_64__)
+	char *d = dst;
+	const char *s = src;
+	size_t head = -(uintptr_t)d & 15;
+
+	if (head > len)
+		head = len;
+	if (head) {
+		memcpy(d, s, head);
+		pcachepmem_flush(d, head);
+		d += head;
+		s += head;
+		len -= head;
+	}
+
+	for (; len >= 64; d += 64, s += 64, len -= 64) {
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+		_mm_stream_si128((__m128i *)(d + 16), _mm_loadu_si128((const __m128i *)(s + 16)));
+		_mm_stream_si128((__m128i *)(d + 32), _mm_loadu_si128((const __m128i *)(s + 32)));
+		_mm_stream_si128((__m128i *)(d + 48), _mm_loadu_si128((const __m128i *)(s + 48)));
+	}
+	for (; len >= 16; d += 16, s += 16, len -= 16)
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+
+	if (len) {
+		memcpy(d, s, len);
+		pcachepmem_flush(d, len);
+	}
+#else
+	memcpy(dst, src, len);
+	pcachepmem_flush(dst, len);
+#endif
+}
@@ -0,0 +1,58 @@
+#ifndef PCACHEPMEM_H
+#define PCACHEPMEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Userspace access to persistent memory: mapping a device or DAX file and
+ * the store, flush and fence primitives that make writes to it durable.
+ *
+ * On x86-64 the cache line flush is the best the CPU offers (clwb, then
+ * clflushopt, then clflush) and non-temporal copies use streaming stores.
+ * Flushes and streaming stores are only ordered by pcachepmem_drain().
+ * Mappings of anything but a device-DAX character device or a DAX file
+ * (MAP_SYNC refused) are backed by the page cache, so the primitives still
+ * work but durability comes from msync() in pcachepmem_unmap(). That
+ * includes /dev/pmemN: a block device has no DAX mmap of its own.
+ */
+
+#define PCACHEPMEM_LINE		64
+
+enum pcachepmem_flush {
+	PCACHEPMEM_FLUSH_NONE	= 0,	/* not x86-64, fences only */
+	PCACHEPMEM_FLUSH_CLFLUSH,
+	PCACHEPMEM_FLUSH_CLFLUSHOPT,
+	PCACHEPMEM_FLUSH_CLWB,
+};
+
+struct pcachepmem_map {
+	int		fd;
+	void		*addr;
+	uint64_t	size;
+	bool		sync;		/* mapped with MAP_SYNC */
+	bool		dax;		/* no page cache: MAP_SYNC or device-DAX */
+};
+
+int pcachepmem_map(struct pcachepmem_map *map, const char *path, bool writable);
+int pcachepmem_unmap(struct pcachepmem_map *map);
+/* Write back a page cache backed mapping, nothing to do for DAX */
+int pcachepmem_sync(struct pcachepmem_map *map);
+
+enum pcachepmem_flush pcachepmem_flush_type(void);
+const char *pcachepmem_flush_name(void);
+
+void pcachepmem_flush(const void *addr, size_t len);
+void pcachepmem_drain(void);
+
+static inline void pcachepmem_persist(const void *addr, size_t len)
+{
+	pcachepmem_flush(addr, len);
+	pcachepmem_drain();
+}
+
+/* Copy with streaming stores, durable after the next pcachepmem_drain() */
+void pcachepmem_memcpy_nt(void *dst, const void *src, size_t len);
+
+#endif // PCACHEPMEM_H
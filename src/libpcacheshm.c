@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcache.h"
+#include "libpcachesnap.h"
+#include "libpcacheshm.h"
+
+#define SHM_CACHE_CAP_MIN	16
+#define SHM_BACKING_CAP_MIN	64
+
+static inline struct pcacheshm_cache *shm_caches(const struct pcacheshm_header *hdr)
+{
+	return (struct pcacheshm_cache *)((char *)hdr + hdr->caches_off);
+}
+
+static inline struct pcacheshm_backing *shm_backings(const struct pcacheshm_header *hdr)
+{
+	return (struct pcacheshm_backing *)((char *)hdr + hdr->backings_off);
+}
+
+/* Path slot of cache @idx, backings follow at cache_cap + idx */
+static inline char *shm_path(const struct pcacheshm_header *hdr, unsigned int slot)
+{
+	return (char *)hdr + hdr->paths_off + (size_t)slot * PCACHESHM_PATH_MAX;
+}
+
+static inline void shm_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static size_t shm_layout(struct pcacheshm_header *hdr, unsigned int cache_cap, unsigned int backing_cap)
+{
+	hdr->header_size = sizeof(*hdr);
+	hdr->cache_cap = cache_cap;
+	hdr->backing_cap = backing_cap;
+	hdr->caches_off = sizeof(*hdr);
+	hdr->backings_off = hdr->caches_off + (uint64_t)cache_cap * sizeof(struct pcacheshm_cache);
+	hdr->paths_off = hdr->backings_off + (uint64_t)backing_cap * sizeof(struct pcacheshm_backing);
+	hdr->size = hdr->paths_off + (uint64_t)(cache_cap + backing_cap) * PCACHESHM_PATH_MAX;
+
+	return hdr->size;
+}
+
+/* Build a new segment next to @path and rename it into place */
+static int shm_create(struct pcacheshm_writer *writer, const char *path,
+		      unsigned int cache_cap, unsigned int backing_cap)
+{
+	struct pcacheshm_header layout = { 0 };
+	char tmp_path[PCACHE_PATH_LEN + 16];
+	struct pcacheshm_header *hdr;
+	size_t size;
+	int fd, ret;
+
+	size = shm_layout(&layout, cache_cap, backing_cap);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		printf("failed to create %s: %s\n", tmp_path, strerror(-ret));
+		return ret;
+	}
+
+	if (ftruncate(fd, size)) {
+		ret = -errno;
+		goto err;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		ret = -errno;
+		goto err;
+	}
+	close(fd);
+
+	memcpy(hdr, &layout, sizeof(layout));
+	hdr->version = PCACHESHM_VERSION;
+	/* magic last, so a reader never accepts a half-initialised header */
+	__atomic_store_n(&hdr->magic, PCACHESHM_MAGIC, __ATOMIC_RELEASE);
+
+	if (rename(tmp_path, path)) {
+		ret = -errno;
+		printf("failed to rename %s to %s: %s\n", tmp_path, path, strerror(errno));
+		munmap(hdr, size);
+		unlink(tmp_path);
+		return ret;
+	}
+
+	writer->hdr = hdr;
+	writer->size = size;
+	snprintf(writer->path, sizeof(writer->path), "%s", path);
+
+	return 0;
+err:
+	printf("failed to set up %s: %s\n", tmp_path, strerror(-ret));
+	close(fd);
+	unlink(tmp_path);
+	return ret;
+}
+
+static void shm_mark_stale(struct pcacheshm_header *hdr)
+{
+	__atomic_store_n(&hdr->stale, 1, __ATOMIC_RELEASE);
+}
+
+/* Mark a segment left behind by an earlier publisher as stale */
+static void shm_retire_existing(const char *path)
+{
+	struct pcacheshm_header *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*hdr)) {
+		hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (hdr != MAP_FAILED) {
+			if (hdr->magic == PCACHESHM_MAGIC)
+				shm_mark_stale(hdr);
+			munmap(hdr, sizeof(*hdr));
+		}
+	}
+	close(fd);
+}
+
+int pcacheshm_writer_open(struct pcacheshm_writer *writer, const char *path,
+			  unsigned int cache_cap, unsigned int backing_cap)
+{
+	memset(writer, 0, sizeof(*writer));
+
+	if (cache_cap < SHM_CACHE_CAP_MIN)
+		cache_cap = SHM_CACHE_CAP_MIN;
+	if (backing_cap < SHM_BACKING_CAP_MIN)
+		backing_cap = SHM_BACKING_CAP_MIN;
+
+	shm_retire_existing(path);
+
+	return shm_create(writer, path, cache_cap, backing_cap);
+}
+
+void pcacheshm_writer_close(struct pcacheshm_writer *writer, bool remove)
+{
+	if (!writer->hdr)
+		return;
+
+	if (remove) {
+		shm_mark_stale(writer->hdr);
+		unlink(writer->path);
+	}
+
+	munmap(writer->hdr, writer->size);
+	writer->hdr = NULL;
+}
+
+static void shm_copy_path(char *dst, const char *src)
+{
+	size_t len = strnlen(src, PCACHESHM_PATH_MAX - 1);
+
+	memcpy(dst, src, len);
+	memset(dst + len, 0, PCACHESHM_PATH_MAX - len);
+}
+
+/*
+ * Write @snap into the segment under the seqlock. The snapshot must be sorted,
+ * which pcachesnap_collect() and pcachesnap_collect_cached() guarantee.
+ */
+int pcacheshm_publish(struct pcacheshm_writer *writer, const struct pcachesnap *snap)
+{
+	struct pcacheshm_header *hdr = writer->hdr;
+	struct pcacheshm_cache *caches;
+	struct pcacheshm_backing *backings;
+	struct timespec now;
+	unsigned int i, b = 0;
+	uint64_t seq;
+
+	if (snap->caches.nr > hdr->cache_cap || snap->backings.nr > hdr->backing_cap) {
+		struct pcacheshm_writer grown;
+		unsigned int cache_cap = hdr->cache_cap, backing_cap = hdr->backing_cap;
+		int ret;
+
+		while (cache_cap < snap->caches.nr)
+			cache_cap *= 2;
+		while (backing_cap < snap->backings.nr)
+			backing_cap *= 2;
+
+		ret = shm_create(&grown, writer->path, cache_cap, backing_cap);
+		if (ret)
+			return ret;
+
+		/* readers of the old mapping see -ESTALE and reopen by name */
+		shm_mark_stale(hdr);
+		munmap(hdr, writer->size);
+		*writer = grown;
+		hdr = writer->hdr;
+	}
+
+	caches = shm_caches(hdr);
+	backings = shm_backings(hdr);
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	seq = hdr->seq;
+	__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = 0; i < snap->backings.nr; i++) {
+		backings[i].cache_id = snap->backings.cache_id[i];
+		backings[i].backing_id = snap->backings.backing_id[i];
+		backings[i].cache_segs = snap->backings.cache_segs[i];
+		backings[i].cache_used_segs = snap->backings.cache_used_segs[i];
+		backings[i].cache_gc_percent = snap->backings.cache_gc_percent[i];
+		backings[i].logic_dev_id = snap->backings.logic_dev_id[i];
+		shm_copy_path(shm_path(hdr, hdr->cache_cap + i),
+			      pcachesnap_str(snap, snap->backings.backing_path[i]));
+	}
+
+	for (i = 0; i < snap->caches.nr; i++) {
+		caches[i].magic = snap->caches.magic[i];
+		caches[i].cache_id = snap->caches.cache_id[i];
+		caches[i].version = snap->caches.version[i];
+		caches[i].flags = snap->caches.flags[i];
+		caches[i].segment_num = snap->caches.segment_num[i];
+		shm_copy_path(shm_path(hdr, i), pcachesnap_str(snap, snap->caches.path[i]));
+
+		/* both tables are sorted by cache_id, so a cache's backings are contiguous */
+		while (b < snap->backings.nr && snap->backings.cache_id[b] < caches[i].cache_id)
+			b++;
+		caches[i].first_backing = b;
+		while (b < snap->backings.nr && snap->backings.cache_id[b] == caches[i].cache_id)
+			b++;
+		caches[i].nr_backings = b - caches[i].first_backing;
+	}
+
+	hdr->nr_caches = snap->caches.nr;
+	hdr->nr_backings = snap->backings.nr;
+	hdr->update_time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	__atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int pcacheshm_open(struct pcacheshm_reader *reader, const char *path)
+{
+	struct pcacheshm_header *hdr;
+	struct stat st;
+	int fd, ret;
+
+	memset(reader, 0, sizeof(*reader));
+	snprintf(reader->path, sizeof(reader->path), "%s", path ? path : PCACHESHM_PATH_DEFAULT);
+
+	fd = open(reader->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = -EINVAL;
+	if ((size_t)st.st_size < sizeof(*hdr))
+		goto out;
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != PCACHESHM_MAGIC ||
+	    hdr->version != PCACHESHM_VERSION || hdr->header_size != sizeof(*hdr) ||
+	    hdr->size > (uint64_t)st.st_size) {
+		munmap(hdr, st.st_size);
+		goto out;
+	}
+
+	reader->hdr = hdr;
+	reader->size = st.st_size;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+void pcacheshm_close(struct pcacheshm_reader *reader)
+{
+	if (reader->hdr)
+		munmap((void *)reader->hdr, reader->size);
+	reader->hdr = NULL;
+}
+
+/*
+ * Seqlock read side. shm_read_begin() spins while an update is in flight;
+ * shm_read_retry() tells whether the copy taken since then may be torn.
+ *
+ * A publisher killed mid-update leaves seq odd for good, so the spin is
+ * bounded: -ESTALE once a new publisher has marked the segment stale,
+ * -EAGAIN after SHM_READ_SPIN_MAX tries, for the caller to reopen later.
+ */
+#define SHM_READ_SPIN_MAX	(1U << 20)
+
+static inline int shm_read_begin(const struct pcacheshm_header *hdr, uint64_t *seq)
+{
+	unsigned int spins = 0;
+
+	while (true) {
+		if (__atomic_load_n(&hdr->stale, __ATOMIC_ACQUIRE))
+			return -ESTALE;
+
+		*seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (!(*seq & 1))
+			return 0;
+
+		if (++spins == SHM_READ_SPIN_MAX)
+			return -EAGAIN;
+		shm_cpu_relax();
+	}
+}
+
+static inline bool shm_read_retry(const struct pcacheshm_header *hdr, uint64_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Binary search on possibly torn data: only ever returns an in-bounds index */
+static int shm_find_cache(const struct pcacheshm_header *hdr, unsigned int cache_id)
+{
+	const struct pcacheshm_cache *caches = shm_caches(hdr);
+	int lo = 0, hi = (int)(hdr->nr_caches < hdr->cache_cap ? hdr->nr_caches : hdr->cache_cap) - 1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		unsigned int id = caches[mid].cache_id;
+
+		if (id == cache_id)
+			return mid;
+		if (id < cache_id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+static int shm_find_backing(const struct pcacheshm_header *hdr, unsigned int cache_id, unsigned int backing_id)
+{
+	const struct pcacheshm_cache *caches = shm_caches(hdr);
+	const struct pcacheshm_backing *backings = shm_backings(hdr);
+	int c, lo, hi;
+
+	c = shm_find_cache(hdr, cache_id);
+	if (c < 0)
+		return -1;
+
+	lo = caches[c].first_backing;
+	hi = lo + (int)caches[c].nr_backings - 1;
+	if (lo < 0 || hi >= (int)hdr->backing_cap)
+		return -1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		unsigned int id = backings[mid].backing_id;
+
+		if (id == backing_id)
+			return mid;
+		if (id < backing_id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+int pcacheshm_read_backing(const struct pcacheshm_reader *reader, unsigned int cache_id,
+			   unsigned int backing_id, struct pcacheshm_backing *out, char *path)
+{
+	const struct pcacheshm_header *hdr = reader->hdr;
+	uint64_t seq;
+	int ret;
+	int idx;
+
+	do {
+		ret = shm_read_begin(hdr, &seq);
+		if (ret)
+			return ret;
+		idx = shm_find_backing(hdr, cache_id, backing_id);
+		if (idx >= 0) {
+			*out = shm_backings(hdr)[idx];
+			if (path)
+				memcpy(path, shm_path(hdr, hdr->cache_cap + idx), PCACHESHM_PATH_MAX);
+		}
+	} while (shm_read_retry(hdr, seq));
+
+	if (idx < 0)
+		return -ENOENT;
+	if (path)
+		path[PCACHESHM_PATH_MAX - 1] = '\0';
+
+	return 0;
+}
+
+/* Linear in the number of backings, for readers that only know /dev/pcacheN */
+int pcacheshm_read_logic_dev(const struct pcacheshm_reader *reader, unsigned int logic_dev_id,
+			     struct pcacheshm_backing *out, char *path)
+{
+	const struct pcacheshm_header *hdr = reader->hdr;
+	const struct pcacheshm_backing *backings = shm_backings(hdr);
+	unsigned int i, nr;
+	uint64_t seq;
+	int ret;
+	int idx;
+
+	do {
+		ret = shm_read_begin(hdr, &seq);
+		if (ret)
+			return ret;
+		nr = hdr->nr_backings < hdr->backing_cap ? hdr->nr_backings : hdr->backing_cap;
+		idx = -1;
+		for (i = 0; i < nr; i++) {
+			if (backings[i].logic_dev_id == logic_dev_id) {
+				idx = i;
+				*out = backings[i];
+				if (path)
+					memcpy(path, shm_path(hdr, hdr->cache_cap + i), PCACHESHM_PATH_MAX);
+				break;
+			}
+		}
+	} while (shm_read_retry(hdr, seq));
+
+	if (idx < 0)
+		return -ENOENT;
+	if (path)
+		path[PCACHESHM_PATH_MAX - 1] = '\0';
+
+	return 0;
+}
+
+int pcacheshm_read_cache(const struct pcacheshm_reader *reader, unsigned int cache_id,
+			 struct pcacheshm_cache *out, char *path)
+{
+	const struct pcacheshm_header *hdr = reader->hdr;
+	uint64_t seq;
+	int ret;
+	int idx;
+
+	do {
+		ret = shm_read_begin(hdr, &seq);
+		if (ret)
+			return ret;
+		idx = shm_find_cache(hdr, cache_id);
+		if (idx >= 0) {
+			*out = shm_caches(hdr)[idx];
+			if (path)
+				memcpy(path, shm_path(hdr, idx), PCACHESHM_PATH_MAX);
+		}
+	} while (shm_read_retry(hdr, seq));
+
+	if (idx < 0)
+		return -ENOENT;
+	if (path)
+		path[PCACHESHM_PATH_MAX - 1] = '\0';
+
+	return 0;
+}
+
+/*
+ * Copy every record. *nr_caches and *nr_backings hold the array capacities on
+ * entry and the record counts on return; -ENOSPC means an array was too small
+ * and the counts say how big it needs to be.
+ */
+int pcacheshm_read_all(const struct pcacheshm_reader *reader, struct pcacheshm_cache *caches,
+		       unsigned int *nr_caches, struct pcacheshm_backing *backings,
+		       unsigned int *nr_backings, uint64_t *update_time)
+{
+	const struct pcacheshm_header *hdr = reader->hdr;
+	unsigned int nc, nb;
+	uint64_t seq;
+	int ret;
+
+	do {
+		ret = shm_read_begin(hdr, &seq);
+		if (ret)
+			return ret;
+		nc = hdr->nr_caches < hdr->cache_cap ? hdr->nr_caches : hdr->cache_cap;
+		nb = hdr->nr_backings < hdr->backing_cap ? hdr->nr_backings : hdr->backing_cap;
+		ret = 0;
+		if (nc > *nr_caches || nb > *nr_backings) {
+			ret = -ENOSPC;
+		} else {
+			memcpy(caches, shm_caches(hdr), sizeof(*caches) * nc);
+			memcpy(backings, shm_backings(hdr), sizeof(*backings) * nb);
+			if (update_time)
+				*update_time = hdr->update_time;
+		}
+	} while (shm_read_retry(hdr, seq));
+
+	*nr_caches = nc;
+	*nr_backings = nb;
+
+	return ret;
+}
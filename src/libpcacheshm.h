@@ -0,0 +1,114 @@
+#ifndef PCACHESHM_H
+#define PCACHESHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pcache.h"
+#include "libpcachesnap.h"
+
+/*
+ * Shared-memory stats segment.
+ *
+ * One publisher (pcache shm-publish) writes the inventory into a file under
+ * /dev/shm; any number of readers map it once and then take consistent
+ * snapshots with plain loads, no syscalls and no locks.
+ *
+ * Consistency comes from a seqlock: the publisher makes seq odd, updates the
+ * records, then makes it even again. A reader copies what it needs between
+ * two reads of seq and retries if seq was odd or changed. Every record is one
+ * cache line, so a read of a single backing touches two lines (header and
+ * record) however many readers there are.
+ *
+ * The segment has a fixed capacity. When the inventory outgrows it the
+ * publisher writes a bigger segment under a new name, renames it over the old
+ * one and marks the old one stale; readers then get -ESTALE and reopen. A
+ * reader that finds an update in flight for too long, its publisher killed
+ * halfway through, gets -EAGAIN.
+ */
+
+#define PCACHESHM_PATH_DEFAULT	"/dev/shm/pcache-stats"
+#define PCACHESHM_MAGIC		0x70636163686573ULL	/* "pcaches" */
+#define PCACHESHM_VERSION	1
+#define PCACHESHM_CACHELINE	64
+#define PCACHESHM_PATH_MAX	(PCACHESHM_CACHELINE * 2)
+
+struct pcacheshm_header {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	header_size;
+	uint32_t	cache_cap;
+	uint32_t	backing_cap;
+	uint32_t	stale;
+	uint32_t	pad0;
+	uint64_t	size;
+	uint64_t	caches_off;
+	uint64_t	backings_off;
+	uint64_t	paths_off;
+
+	/* written by the publisher on every update, its own cache line */
+	uint64_t	seq __attribute__((aligned(PCACHESHM_CACHELINE)));
+	uint64_t	update_time;		/* CLOCK_REALTIME, ns */
+	uint32_t	nr_caches;
+	uint32_t	nr_backings;
+} __attribute__((aligned(PCACHESHM_CACHELINE)));
+
+struct pcacheshm_cache {
+	uint64_t	magic;
+	uint32_t	cache_id;
+	int32_t		version;
+	int32_t		flags;
+	uint32_t	segment_num;
+	uint32_t	nr_backings;
+	uint32_t	first_backing;
+} __attribute__((aligned(PCACHESHM_CACHELINE)));
+
+struct pcacheshm_backing {
+	uint32_t	cache_id;
+	uint32_t	backing_id;
+	uint32_t	cache_segs;
+	uint32_t	cache_used_segs;
+	uint32_t	cache_gc_percent;
+	uint32_t	logic_dev_id;
+} __attribute__((aligned(PCACHESHM_CACHELINE)));
+
+/*
+ * Paths are kept apart from the counters, one PCACHESHM_PATH_MAX slot per
+ * record, caches first. Longer paths are truncated.
+ */
+
+struct pcacheshm_reader {
+	const struct pcacheshm_header	*hdr;
+	size_t				size;
+	char				path[PCACHE_PATH_LEN];
+};
+
+/* publisher */
+struct pcacheshm_writer {
+	struct pcacheshm_header	*hdr;
+	size_t			size;
+	char			path[PCACHE_PATH_LEN];
+};
+
+int pcacheshm_writer_open(struct pcacheshm_writer *writer, const char *path,
+			  unsigned int cache_cap, unsigned int backing_cap);
+int pcacheshm_publish(struct pcacheshm_writer *writer, const struct pcachesnap *snap);
+void pcacheshm_writer_close(struct pcacheshm_writer *writer, bool remove);
+
+/* reader */
+int pcacheshm_open(struct pcacheshm_reader *reader, const char *path);
+void pcacheshm_close(struct pcacheshm_reader *reader);
+
+/* @path, when not NULL, receives up to PCACHESHM_PATH_MAX bytes */
+int pcacheshm_read_backing(const struct pcacheshm_reader *reader, unsigned int cache_id,
+			   unsigned int backing_id, struct pcacheshm_backing *out, char *path);
+int pcacheshm_read_logic_dev(const struct pcacheshm_reader *reader, unsigned int logic_dev_id,
+			     struct pcacheshm_backing *out, char *path);
+int pcacheshm_read_cache(const struct pcacheshm_reader *reader, unsigned int cache_id,
+			 struct pcacheshm_cache *out, char *path);
+int pcacheshm_read_all(const struct pcacheshm_reader *reader, struct pcacheshm_cache *caches,
+		       unsigned int *nr_caches, struct pcacheshm_backing *backings,
+		       unsigned int *nr_backings, uint64_t *update_time);
+
+#endif // PCACHESHM_H
@@ -0,0 +1,1381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "pcache.h"
+#include "libpcachesys.h"
+#include "libpcachesnap.h"
+#include "libpcacheuring.h"
+
+#define SNAP_ARENA_INIT		4096
+#define SNAP_INTERN_INIT	256
+#define SNAP_TABLE_INIT		64
+
+struct snap_col {
+	void	**ptr;
+	size_t	size;
+};
+
+/* Columns are listed widest first so every column in the block stays aligned */
+static int snap_cache_cols(struct pcachesnap_caches *c, struct snap_col *cols)
+{
+	cols[0] = (struct snap_col){ (void **)&c->magic, sizeof(*c->magic) };
+	cols[1] = (struct snap_col){ (void **)&c->cache_id, sizeof(*c->cache_id) };
+	cols[2] = (struct snap_col){ (void **)&c->version, sizeof(*c->version) };
+	cols[3] = (struct snap_col){ (void **)&c->flags, sizeof(*c->flags) };
+	cols[4] = (struct snap_col){ (void **)&c->segment_num, sizeof(*c->segment_num) };
+	cols[5] = (struct snap_col){ (void **)&c->path, sizeof(*c->path) };
+
+	return 6;
+}
+
+static int snap_backing_cols(struct pcachesnap_backings *b, struct snap_col *cols)
+{
+	cols[0] = (struct snap_col){ (void **)&b->cache_id, sizeof(*b->cache_id) };
+	cols[1] = (struct snap_col){ (void **)&b->backing_id, sizeof(*b->backing_id) };
+	cols[2] = (struct snap_col){ (void **)&b->cache_segs, sizeof(*b->cache_segs) };
+	cols[3] = (struct snap_col){ (void **)&b->cache_gc_percent, sizeof(*b->cache_gc_percent) };
+	cols[4] = (struct snap_col){ (void **)&b->cache_used_segs, sizeof(*b->cache_used_segs) };
+	cols[5] = (struct snap_col){ (void **)&b->logic_dev_id, sizeof(*b->logic_dev_id) };
+	cols[6] = (struct snap_col){ (void **)&b->backing_path, sizeof(*b->backing_path) };
+
+	return 7;
+}
+
+#define SNAP_COLS_MAX	8
+
+static size_t snap_row_size(struct snap_col *cols, int nr_cols)
+{
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < nr_cols; i++)
+		size += cols[i].size;
+
+	return size;
+}
+
+/* Grow a struct-of-arrays table, keeping all of its columns in one block */
+static int snap_table_grow(void **block, unsigned int *cap, unsigned int nr,
+			   struct snap_col *cols, int nr_cols)
+{
+	unsigned int new_cap = *cap ? *cap * 2 : SNAP_TABLE_INIT;
+	char *new_block;
+	size_t off = 0;
+	int i;
+
+	new_block = malloc(snap_row_size(cols, nr_cols) * new_cap);
+	if (!new_block)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_cols; i++) {
+		if (nr)
+			memcpy(new_block + off, *cols[i].ptr, cols[i].size * nr);
+		*cols[i].ptr = new_block + off;
+		off += cols[i].size * new_cap;
+	}
+
+	free(*block);
+	*block = new_block;
+	*cap = new_cap;
+
+	return 0;
+}
+
+struct snap_sort_key {
+	uint64_t	key;
+	unsigned int	idx;
+};
+
+static int snap_sort_key_cmp(const void *a, const void *b)
+{
+	const struct snap_sort_key *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+
+	return 0;
+}
+
+/* Reorder every column of a table by the sorted keys */
+static int snap_table_permute(struct snap_sort_key *keys, unsigned int nr,
+			      struct snap_col *cols, int nr_cols)
+{
+	char *scratch;
+	unsigned int i;
+	int c;
+
+	scratch = malloc(sizeof(uint64_t) * nr);
+	if (!scratch)
+		return -ENOMEM;
+
+	for (c = 0; c < nr_cols; c++) {
+		char *col = *cols[c].ptr;
+		size_t size = cols[c].size;
+
+		for (i = 0; i < nr; i++)
+			memcpy(scratch + i * size, col + keys[i].idx * size, size);
+		memcpy(col, scratch, size * nr);
+	}
+
+	free(scratch);
+	return 0;
+}
+
+static inline uint64_t snap_backing_key(const struct pcachesnap *snap, int idx)
+{
+	return ((uint64_t)snap->backings.cache_id[idx] << 32) | snap->backings.backing_id[idx];
+}
+
+static uint32_t snap_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static int snap_intern_grow(struct pcachesnap *snap)
+{
+	unsigned int new_size = snap->intern_size ? snap->intern_size * 2 : SNAP_INTERN_INIT;
+	pcachesnap_str_t *table;
+	unsigned int i, h;
+
+	table = calloc(new_size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < snap->intern_size; i++) {
+		pcachesnap_str_t str = snap->intern[i];
+
+		if (!str)
+			continue;
+
+		h = snap_hash(pcachesnap_str(snap, str), pcachesnap_strlen(snap, str)) & (new_size - 1);
+		while (table[h])
+			h = (h + 1) & (new_size - 1);
+		table[h] = str;
+	}
+
+	free(snap->intern);
+	snap->intern = table;
+	snap->intern_size = new_size;
+
+	return 0;
+}
+
+static int snap_arena_reserve(struct pcachesnap *snap, size_t need)
+{
+	size_t new_cap = snap->arena_cap ? snap->arena_cap : SNAP_ARENA_INIT;
+	char *arena;
+
+	if (need <= snap->arena_cap)
+		return 0;
+
+	/* offsets are 32-bit */
+	if (need > UINT32_MAX)
+		return -E2BIG;
+
+	while (new_cap < need)
+		new_cap *= 2;
+
+	arena = realloc(snap->arena, new_cap);
+	if (!arena)
+		return -ENOMEM;
+
+	snap->arena = arena;
+	snap->arena_cap = new_cap;
+
+	return 0;
+}
+
+int pcachesnap_init(struct pcachesnap *snap)
+{
+	memset(snap, 0, sizeof(*snap));
+	snap->lock_timeout = -1;
+	snap->engine = PCACHESNAP_ENGINE_SYNC;
+
+	if (snap_arena_reserve(snap, SNAP_ARENA_INIT))
+		return -ENOMEM;
+
+	pcachesnap_reset(snap);
+
+	return 0;
+}
+
+/* Drop all records but keep the allocations for the next collection */
+void pcachesnap_reset(struct pcachesnap *snap)
+{
+	uint16_t empty = 0;
+
+	/* offset 0 is the empty string */
+	memcpy(snap->arena, &empty, sizeof(empty));
+	snap->arena[sizeof(empty)] = '\0';
+	snap->arena_len = sizeof(empty) + 1;
+
+	if (snap->intern)
+		memset(snap->intern, 0, sizeof(*snap->intern) * snap->intern_size);
+	snap->intern_nr = 0;
+
+	snap->caches.nr = 0;
+	snap->backings.nr = 0;
+}
+
+void pcachesnap_free(struct pcachesnap *snap)
+{
+	free(snap->arena);
+	free(snap->intern);
+	free(snap->caches.block);
+	free(snap->backings.block);
+	memset(snap, 0, sizeof(*snap));
+}
+
+/*
+ * Intern @len bytes of @str and store its arena offset in @out. The empty
+ * string is always offset 0.
+ */
+int pcachesnap_intern(struct pcachesnap *snap, const char *str, size_t len, pcachesnap_str_t *out)
+{
+	pcachesnap_str_t off;
+	uint16_t len16;
+	unsigned int h;
+	int ret;
+
+	*out = 0;
+	if (len == 0)
+		return 0;
+
+	if (len > UINT16_MAX)
+		len = UINT16_MAX;
+
+	if ((snap->intern_nr + 1) * 4 > snap->intern_size * 3) {
+		ret = snap_intern_grow(snap);
+		if (ret)
+			return ret;
+	}
+
+	h = snap_hash(str, len) & (snap->intern_size - 1);
+	while ((off = snap->intern[h]) != 0) {
+		if (pcachesnap_strlen(snap, off) == len &&
+		    memcmp(pcachesnap_str(snap, off), str, len) == 0) {
+			*out = off;
+			return 0;
+		}
+		h = (h + 1) & (snap->intern_size - 1);
+	}
+
+	/* keep the length prefix 2-byte aligned */
+	off = (snap->arena_len + 1) & ~(size_t)1;
+	ret = snap_arena_reserve(snap, off + sizeof(len16) + len + 1);
+	if (ret)
+		return ret;
+
+	len16 = len;
+	memcpy(snap->arena + off, &len16, sizeof(len16));
+	memcpy(snap->arena + off + sizeof(len16), str, len);
+	snap->arena[off + sizeof(len16) + len] = '\0';
+	snap->arena_len = off + sizeof(len16) + len + 1;
+
+	snap->intern[h] = off;
+	snap->intern_nr++;
+	*out = off;
+
+	return 0;
+}
+
+int pcachesnap_add_cache(struct pcachesnap *snap, const struct pcache_cache *cache)
+{
+	struct pcachesnap_caches *c = &snap->caches;
+	struct snap_col cols[SNAP_COLS_MAX];
+	pcachesnap_str_t path;
+	int nr_cols;
+	int ret;
+
+	if (c->nr == c->cap) {
+		nr_cols = snap_cache_cols(c, cols);
+		ret = snap_table_grow(&c->block, &c->cap, c->nr, cols, nr_cols);
+		if (ret)
+			return ret;
+	}
+
+	/* sysfs path attribute carries a trailing newline */
+	ret = pcachesnap_intern(snap, cache->path, strcspn(cache->path, "\n"), &path);
+	if (ret)
+		return ret;
+
+	c->magic[c->nr] = cache->magic;
+	c->cache_id[c->nr] = cache->cache_id;
+	c->version[c->nr] = cache->version;
+	c->flags[c->nr] = cache->flags;
+	c->segment_num[c->nr] = cache->segment_num;
+	c->path[c->nr] = path;
+	c->nr++;
+
+	return 0;
+}
+
+int pcachesnap_add_backing(struct pcachesnap *snap, unsigned int cache_id,
+			   const struct pcache_backing *backing)
+{
+	struct pcachesnap_backings *b = &snap->backings;
+	struct snap_col cols[SNAP_COLS_MAX];
+	pcachesnap_str_t path;
+	int nr_cols;
+	int ret;
+
+	if (b->nr == b->cap) {
+		nr_cols = snap_backing_cols(b, cols);
+		ret = snap_table_grow(&b->block, &b->cap, b->nr, cols, nr_cols);
+		if (ret)
+			return ret;
+	}
+
+	ret = pcachesnap_intern(snap, backing->backing_path, strlen(backing->backing_path), &path);
+	if (ret)
+		return ret;
+
+	b->cache_id[b->nr] = cache_id;
+	b->backing_id[b->nr] = backing->backing_id;
+	b->cache_segs[b->nr] = backing->cache_segs;
+	b->cache_gc_percent[b->nr] = backing->cache_gc_percent;
+	b->cache_used_segs[b->nr] = backing->cache_used_segs;
+	b->logic_dev_id[b->nr] = backing->logic_dev_id;
+	b->backing_path[b->nr] = path;
+	b->nr++;
+
+	return 0;
+}
+
+/* Sort caches by cache_id and backings by (cache_id, backing_id) */
+int pcachesnap_sort(struct pcachesnap *snap)
+{
+	struct snap_col cols[SNAP_COLS_MAX];
+	struct snap_sort_key *keys;
+	unsigned int nr, i;
+	int nr_cols;
+	int ret = 0;
+
+	nr = snap->caches.nr > snap->backings.nr ? snap->caches.nr : snap->backings.nr;
+	if (!nr)
+		return 0;
+
+	keys = malloc(sizeof(*keys) * nr);
+	if (!keys)
+		return -ENOMEM;
+
+	for (i = 0; i < snap->caches.nr; i++) {
+		keys[i].key = snap->caches.cache_id[i];
+		keys[i].idx = i;
+	}
+	qsort(keys, snap->caches.nr, sizeof(*keys), snap_sort_key_cmp);
+	nr_cols = snap_cache_cols(&snap->caches, cols);
+	ret = snap_table_permute(keys, snap->caches.nr, cols, nr_cols);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < snap->backings.nr; i++) {
+		keys[i].key = snap_backing_key(snap, i);
+		keys[i].idx = i;
+	}
+	qsort(keys, snap->backings.nr, sizeof(*keys), snap_sort_key_cmp);
+	nr_cols = snap_backing_cols(&snap->backings, cols);
+	ret = snap_table_permute(keys, snap->backings.nr, cols, nr_cols);
+out:
+	free(keys);
+	return ret;
+}
+
+struct snap_collect_ctx {
+	struct pcachesnap	*snap;
+	struct pcache_cache	cache;
+};
+
+static int snap_backing_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+{
+	struct snap_collect_ctx *ctx = walk_ctx->data;
+	struct pcache_backing backing;
+	unsigned int backing_dev_id;
+	int ret;
+
+	backing_dev_id = strtoul(entry->d_name + strlen("backing_dev"), NULL, 10);
+	ret = pcachesys_backing_init(&ctx->cache, &backing, backing_dev_id);
+	if (ret < 0) {
+		printf("failed to init backing_dev%u\n", backing_dev_id);
+		return ret;
+	}
+
+	return pcachesnap_add_backing(ctx->snap, ctx->cache.cache_id, &backing);
+}
+
+static int snap_collect_cache(struct pcachesnap *snap, unsigned int cache_id)
+{
+	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	struct snap_collect_ctx ctx = { 0 };
+	struct pcachesys_lock lock = { .fd = -1 };
+	int ret;
+
+	if (snap->lock_timeout >= 0) {
+		ret = pcachesys_lock_cache(&lock, cache_id, false, snap->lock_timeout);
+		if (ret)
+			return ret;
+	}
+
+	ret = pcachesys_cache_init(&ctx.cache, cache_id);
+	if (ret)
+		goto unlock;
+
+	ret = pcachesnap_add_cache(snap, &ctx.cache);
+	if (ret)
+		goto unlock;
+
+	ctx.snap = snap;
+	walk_ctx.cb = snap_backing_cb;
+	walk_ctx.data = &ctx;
+	cache_dir_path(cache_id, walk_ctx.path, sizeof(walk_ctx.path));
+
+	ret = walk_backing_devs(&walk_ctx);
+unlock:
+	pcachesys_unlock(&lock);
+	return ret;
+}
+
+static int snap_cache_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+{
+	unsigned int cache_dev_id;
+
+	cache_dev_id = strtoul(entry->d_name + strlen("cache_dev"), NULL, 10);
+
+	return snap_collect_cache(walk_ctx->data, cache_dev_id);
+}
+
+/*
+ * io_uring collection.
+ *
+ * The directories are walked as usual to lay out one placeholder record per
+ * cache and backing, then every attribute is read with an open-read-close
+ * chain into a fixed file slot, SNAP_URING_CHAINS chains per io_uring_enter().
+ * A full inventory costs a few syscalls per batch instead of three per
+ * attribute, and results are parsed straight into the snapshot columns.
+ */
+#define SNAP_URING_CHAINS	256
+#define SNAP_URING_ENTRIES	1024	/* 3 SQEs per chain */
+
+enum snap_uring_op {
+	SNAP_URING_OPEN		= 0,
+	SNAP_URING_READ,
+	SNAP_URING_CLOSE,
+};
+
+/* Cache attributes come first, then backing attributes */
+enum snap_attr {
+	SNAP_ATTR_CACHE_INFO	= 0,
+	SNAP_ATTR_CACHE_PATH,
+	SNAP_ATTR_BACKING_PATH,
+	SNAP_ATTR_BACKING_SEGS,
+	SNAP_ATTR_BACKING_GC_PERCENT,
+	SNAP_ATTR_BACKING_USED_SEGS,
+	SNAP_ATTR_BACKING_MAPPED_ID,
+	SNAP_ATTR_MAX,
+};
+
+#define SNAP_CACHE_ATTRS	(SNAP_ATTR_BACKING_PATH - SNAP_ATTR_CACHE_INFO)
+#define SNAP_BACKING_ATTRS	(SNAP_ATTR_MAX - SNAP_ATTR_BACKING_PATH)
+
+struct snap_uring_slot {
+	unsigned int	row;
+	enum snap_attr	attr;
+	char		path[PCACHE_PATH_LEN];
+	char		buf[PCACHESYS_INFO_LEN];
+};
+
+struct snap_uring_ctx {
+	struct pcachesnap	*snap;
+	struct pcachesys_lock	*locks;
+	unsigned int		nr_locks;
+	unsigned int		cap_locks;
+	unsigned int		cache_id;
+};
+
+static int snap_uring_backing_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+{
+	struct snap_uring_ctx *ctx = walk_ctx->data;
+	struct pcache_backing backing = { 0 };
+
+	backing.backing_id = strtoul(entry->d_name + strlen("backing_dev"), NULL, 10);
+
+	return pcachesnap_add_backing(ctx->snap, ctx->cache_id, &backing);
+}
+
+static int snap_uring_scan_cache(struct snap_uring_ctx *ctx, unsigned int cache_id)
+{
+	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	struct pcache_cache cache = { 0 };
+	struct pcachesys_lock *locks;
+	int ret;
+
+	/* locks are held until every attribute has been read */
+	if (ctx->snap->lock_timeout >= 0) {
+		if (ctx->nr_locks == ctx->cap_locks) {
+			ctx->cap_locks = ctx->cap_locks ? ctx->cap_locks * 2 : SNAP_TABLE_INIT;
+			locks = realloc(ctx->locks, sizeof(*locks) * ctx->cap_locks);
+			if (!locks)
+				return -ENOMEM;
+			ctx->locks = locks;
+		}
+
+		ret = pcachesys_lock_cache(&ctx->locks[ctx->nr_locks], cache_id, false,
+					   ctx->snap->lock_timeout);
+		if (ret)
+			return ret;
+		ctx->nr_locks++;
+	}
+
+	cache.cache_id = cache_id;
+	ret = pcachesnap_add_cache(ctx->snap, &cache);
+	if (ret)
+		return ret;
+
+	ctx->cache_id = cache_id;
+	walk_ctx.cb = snap_uring_backing_cb;
+	walk_ctx.data = ctx;
+	cache_dir_path(cache_id, walk_ctx.path, sizeof(walk_ctx.path));
+
+	return walk_backing_devs(&walk_ctx);
+}
+
+static int snap_uring_cache_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+{
+	unsigned int cache_dev_id;
+
+	cache_dev_id = strtoul(entry->d_name + strlen("cache_dev"), NULL, 10);
+
+	return snap_uring_scan_cache(walk_ctx->data, cache_dev_id);
+}
+
+static void snap_uring_slot_init(const struct pcachesnap *snap, struct snap_uring_slot *slot,
+				 unsigned long idx)
+{
+	unsigned long cache_reads = (unsigned long)snap->caches.nr * SNAP_CACHE_ATTRS;
+	unsigned int cache_id, backing_id;
+
+	if (idx < cache_reads) {
+		slot->row = idx / SNAP_CACHE_ATTRS;
+		slot->attr = SNAP_ATTR_CACHE_INFO + idx % SNAP_CACHE_ATTRS;
+		cache_id = snap->caches.cache_id[slot->row];
+
+		if (slot->attr == SNAP_ATTR_CACHE_INFO)
+			cache_info_path(cache_id, slot->path, sizeof(slot->path));
+		else
+			cache_path_path(cache_id, slot->path, sizeof(slot->path));
+		return;
+	}
+
+	idx -= cache_reads;
+	slot->row = idx / SNAP_BACKING_ATTRS;
+	slot->attr = SNAP_ATTR_BACKING_PATH + idx % SNAP_BACKING_ATTRS;
+	cache_id = snap->backings.cache_id[slot->row];
+	backing_id = snap->backings.backing_id[slot->row];
+
+	switch (slot->attr) {
+	case SNAP_ATTR_BACKING_PATH:
+		backing_dev_path_path(cache_id, backing_id, slot->path, sizeof(slot->path));
+		break;
+	case SNAP_ATTR_BACKING_SEGS:
+		backing_dev_cache_segs_path(cache_id, backing_id, slot->path, sizeof(slot->path));
+		break;
+	case SNAP_ATTR_BACKING_GC_PERCENT:
+		backing_dev_cache_gc_percent_path(cache_id, backing_id, slot->path, sizeof(slot->path));
+		break;
+	case SNAP_ATTR_BACKING_USED_SEGS:
+		backing_dev_cache_used_segs_path(cache_id, backing_id, slot->path, sizeof(slot->path));
+		break;
+	default:
+		backing_dev_mapped_id_path(cache_id, backing_id, slot->path, sizeof(slot->path));
+		break;
+	}
+}
+
+static int snap_uring_slot_parse(struct pcachesnap *snap, struct snap_uring_slot *slot, int len)
+{
+	struct pcache_cache cache = { 0 };
+	unsigned int row = slot->row;
+
+	slot->buf[len] = '\0';
+
+	switch (slot->attr) {
+	case SNAP_ATTR_CACHE_INFO:
+		pcachesys_parse_cache_info(&cache, slot->buf);
+		snap->caches.magic[row] = cache.magic;
+		snap->caches.version[row] = cache.version;
+		snap->caches.flags[row] = cache.flags;
+		snap->caches.segment_num[row] = cache.segment_num;
+		return 0;
+	case SNAP_ATTR_CACHE_PATH:
+		return pcachesnap_intern(snap, slot->buf, strcspn(slot->buf, "\n"),
+					 &snap->caches.path[row]);
+	case SNAP_ATTR_BACKING_PATH:
+		return pcachesnap_intern(snap, slot->buf, strcspn(slot->buf, "\n"),
+					 &snap->backings.backing_path[row]);
+	case SNAP_ATTR_BACKING_SEGS:
+		snap->backings.cache_segs[row] = atoi(slot->buf);
+		return 0;
+	case SNAP_ATTR_BACKING_GC_PERCENT:
+		snap->backings.cache_gc_percent[row] = atoi(slot->buf);
+		return 0;
+	case SNAP_ATTR_BACKING_USED_SEGS:
+		snap->backings.cache_used_segs[row] = atoi(slot->buf);
+		return 0;
+	default:
+		snap->backings.logic_dev_id[row] = atoi(slot->buf);
+		return 0;
+	}
+}
+
+static void snap_uring_prep_chain(struct pcache_uring *ring, struct snap_uring_slot *slot,
+				  unsigned int k)
+{
+	struct io_uring_sqe *sqe;
+
+	/* open straight into fixed slot k; direct opens cannot take O_CLOEXEC */
+	sqe = pcache_uring_get_sqe(ring);
+	pcache_uring_prep_rw(sqe, IORING_OP_OPENAT, AT_FDCWD, slot->path, 0, 0);
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = k + 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = (uint64_t)k << 2 | SNAP_URING_OPEN;
+
+	/* hard link so the slot is closed even if the read fails */
+	sqe = pcache_uring_get_sqe(ring);
+	pcache_uring_prep_rw(sqe, IORING_OP_READ, k, slot->buf, sizeof(slot->buf) - 1, 0);
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe->user_data = (uint64_t)k << 2 | SNAP_URING_READ;
+
+	sqe = pcache_uring_get_sqe(ring);
+	pcache_uring_prep_rw(sqe, IORING_OP_CLOSE, 0, NULL, 0, 0);
+	sqe->file_index = k + 1;
+	sqe->user_data = (uint64_t)k << 2 | SNAP_URING_CLOSE;
+}
+
+static int snap_uring_read_all(struct pcachesnap *snap)
+{
+	unsigned long total, next = 0;
+	struct snap_uring_slot *slots;
+	struct pcache_uring ring;
+	struct io_uring_cqe *cqe;
+	unsigned int n, k, i;
+	int ret, err = 0;
+
+	total = (unsigned long)snap->caches.nr * SNAP_CACHE_ATTRS +
+		(unsigned long)snap->backings.nr * SNAP_BACKING_ATTRS;
+	if (!total)
+		return 0;
+
+	ret = pcache_uring_init(&ring, SNAP_URING_ENTRIES, 0);
+	if (ret)
+		return -EOPNOTSUPP;
+
+	ret = pcache_uring_register_files(&ring, SNAP_URING_CHAINS);
+	if (ret) {
+		pcache_uring_exit(&ring);
+		return -EOPNOTSUPP;
+	}
+
+	slots = malloc(sizeof(*slots) * SNAP_URING_CHAINS);
+	if (!slots) {
+		pcache_uring_exit(&ring);
+		return -ENOMEM;
+	}
+
+	while (next < total && !err) {
+		n = total - next < SNAP_URING_CHAINS ? total - next : SNAP_URING_CHAINS;
+
+		for (k = 0; k < n; k++) {
+			snap_uring_slot_init(snap, &slots[k], next + k);
+			snap_uring_prep_chain(&ring, &slots[k], k);
+		}
+		next += n;
+
+		/* a short submit means an SQE was rejected, i.e. a pre-5.15 kernel */
+		ret = pcache_uring_submit(&ring, n * 3);
+		if (ret != (int)n * 3) {
+			err = ret < 0 && ret != -EINVAL ? ret : -EOPNOTSUPP;
+			break;
+		}
+
+		for (i = 0; i < n * 3; i++) {
+			ret = pcache_uring_wait_cqe(&ring, &cqe);
+			if (ret) {
+				err = ret;
+				break;
+			}
+
+			k = cqe->user_data >> 2;
+			ret = cqe->res;
+
+			switch (cqe->user_data & 3) {
+			case SNAP_URING_OPEN:
+				if (ret == -EINVAL) {
+					err = -EOPNOTSUPP;
+				} else if (ret < 0 && !err) {
+					printf("failed to open %s: %s\n", slots[k].path, strerror(-ret));
+					err = ret;
+				}
+				break;
+			case SNAP_URING_READ:
+				if (ret == -ECANCELED)
+					break;
+				if (ret < 0 && !err) {
+					printf("failed to read %s: %s\n", slots[k].path, strerror(-ret));
+					err = ret;
+				} else if (ret >= 0 && !err) {
+					err = snap_uring_slot_parse(snap, &slots[k], ret);
+				}
+				break;
+			default:
+				break;
+			}
+			pcache_uring_cqe_seen(&ring);
+		}
+	}
+
+	free(slots);
+	pcache_uring_exit(&ring);
+	return err;
+}
+
+static int snap_collect_uring(struct pcachesnap *snap, unsigned int cache_id)
+{
+	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	struct snap_uring_ctx ctx = { 0 };
+	unsigned int i;
+	int ret;
+
+	ctx.snap = snap;
+	if (cache_id == PCACHESNAP_ALL_CACHES) {
+		walk_ctx.cb = snap_uring_cache_cb;
+		walk_ctx.data = &ctx;
+		sysfs_pcache_path(SYSFS_PCACHE_DEVICES_PATH, walk_ctx.path, sizeof(walk_ctx.path));
+		ret = walk_cache_devs(&walk_ctx);
+	} else {
+		ret = snap_uring_scan_cache(&ctx, cache_id);
+	}
+
+	if (!ret)
+		ret = snap_uring_read_all(snap);
+
+	for (i = 0; i < ctx.nr_locks; i++)
+		pcachesys_unlock(&ctx.locks[i]);
+	free(ctx.locks);
+
+	return ret;
+}
+
+/*
+ * Replace the contents of @snap with the current inventory of one cache, or of
+ * every cache when @cache_id is PCACHESNAP_ALL_CACHES.
+ */
+int pcachesnap_collect(struct pcachesnap *snap, unsigned int cache_id)
+{
+	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	int ret;
+
+	pcachesnap_reset(snap);
+
+	if (snap->engine != PCACHESNAP_ENGINE_SYNC) {
+		ret = snap_collect_uring(snap, cache_id);
+		if (ret == -EOPNOTSUPP && snap->engine == PCACHESNAP_ENGINE_URING)
+			printf("io_uring engine is not supported by this kernel\n");
+		if (ret != -EOPNOTSUPP || snap->engine == PCACHESNAP_ENGINE_URING)
+			goto out;
+
+		/* auto: fall back to plain reads */
+		pcachesnap_reset(snap);
+	}
+
+	if (cache_id == PCACHESNAP_ALL_CACHES) {
+		walk_ctx.cb = snap_cache_cb;
+		walk_ctx.data = snap;
+		sysfs_pcache_path(SYSFS_PCACHE_DEVICES_PATH, walk_ctx.path, sizeof(walk_ctx.path));
+		ret = walk_cache_devs(&walk_ctx);
+	} else {
+		ret = snap_collect_cache(snap, cache_id);
+	}
+out:
+	if (ret)
+		return ret;
+
+	return pcachesnap_sort(snap);
+}
+
+/* Cached-handle collection */
+
+#define SNAP_HANDLE_CACHE(key)		((unsigned int)((key) >> 32))
+#define SNAP_HANDLE_IS_CACHE(key)	(((key) & UINT32_MAX) == 0)
+
+/* Slots of struct pcachesnap_handle's fd[] */
+enum snap_handle_fd {
+	SNAP_FD_PATH		= 0,
+	SNAP_FD_INFO,			/* caches */
+	SNAP_FD_CACHE_SEGS	= 1,	/* backings */
+	SNAP_FD_MAPPED_ID,
+	SNAP_FD_GC_PERCENT,
+	SNAP_FD_USED_SEGS,
+};
+
+struct snap_scan_ctx {
+	struct pcachesnap_handles	*handles;
+	uint64_t			*keys;
+	size_t				nr;
+	size_t				cap;
+	unsigned int			cache_id;
+};
+
+static int snap_scan_add(struct snap_scan_ctx *ctx, uint64_t key)
+{
+	if (ctx->nr == ctx->cap) {
+		size_t cap = ctx->cap ? ctx->cap * 2 : SNAP_TABLE_INIT;
+		uint64_t *keys = realloc(ctx->keys, sizeof(*keys) * cap);
+
+		if (!keys)
+			return -ENOMEM;
+		ctx->keys = keys;
+		ctx->cap = cap;
+	}
+	ctx->keys[ctx->nr++] = key;
+
+	return 0;
+}
+
+static int snap_scan_backing_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+{
+	struct snap_scan_ctx *ctx = walk_ctx->data;
+	unsigned int backing_dev_id;
+
+	backing_dev_id = strtoul(entry->d_name + strlen("backing_dev"), NULL, 10);
+
+	return snap_scan_add(ctx, ((uint64_t)ctx->cache_id << 32) | ((uint64_t)backing_dev_id + 1));
+}
+
+static int snap_scan_cache(struct snap_scan_ctx *ctx, unsigned int cache_id)
+{
+	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	int ret;
+
+	ctx->cache_id = cache_id;
+	ret = snap_scan_add(ctx, (uint64_t)cache_id << 32);
+	if (ret)
+		return ret;
+
+	walk_ctx.cb = snap_scan_backing_cb;
+	walk_ctx.data = ctx;
+	cache_dir_path(cache_id, walk_ctx.path, sizeof(walk_ctx.path));
+
+	/* a cache going away under us is not fatal, it drops out next time */
+	if (walk_backing_devs(&walk_ctx))
+		ctx->handles->errors++;
+
+	return 0;
+}
+
+static int snap_scan_cache_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+{
+	unsigned int cache_dev_id;
+
+	cache_dev_id = strtoul(entry->d_name + strlen("cache_dev"), NULL, 10);
+
+	return snap_scan_cache(walk_ctx->data, cache_dev_id);
+}
+
+static int snap_key_cmp(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+static void snap_handle_close(struct pcachesnap_handle *h)
+{
+	int i;
+
+	for (i = 0; i < PCACHESNAP_HANDLE_FD_MAX; i++) {
+		if (h->fd[i] >= 0)
+			close(h->fd[i]);
+		h->fd[i] = -1;
+	}
+	free(h->path);
+	h->path = NULL;
+}
+
+/* Keep @attr open in fd slot @slot, -errno when it cannot be opened */
+static int snap_handle_open_attr(struct pcachesnap_handle *h, int slot, const char *attr)
+{
+	h->fd[slot] = pcachesys_open_attr(attr);
+
+	return h->fd[slot] < 0 ? h->fd[slot] : 0;
+}
+
+static int snap_handle_read_uint(struct pcachesnap_handle *h, int slot, unsigned int *val)
+{
+	char buf[64];
+	int ret;
+
+	ret = pcachesys_read_fd(h->fd[slot], buf, sizeof(buf));
+	if (ret)
+		return ret;
+
+	*val = (unsigned int)atoi(buf);
+	return 0;
+}
+
+static int snap_handle_open(struct pcachesnap_handle *h, uint64_t key)
+{
+	struct pcache_cache cache = { 0 };
+	struct pcache_backing backing;
+	char path[PCACHE_PATH_LEN];
+	unsigned int backing_id;
+	int ret, i;
+
+	memset(h, 0, sizeof(*h));
+	h->key = key;
+	for (i = 0; i < PCACHESNAP_HANDLE_FD_MAX; i++)
+		h->fd[i] = -1;
+
+	if (SNAP_HANDLE_IS_CACHE(key)) {
+		ret = pcachesys_cache_init(&cache, SNAP_HANDLE_CACHE(key));
+		if (ret)
+			return ret;
+
+		h->magic = cache.magic;
+		h->version = cache.version;
+		h->flags = cache.flags;
+		h->segment_num = cache.segment_num;
+		h->path = strndup(cache.path, strcspn(cache.path, "\n"));
+		if (!h->path)
+			return -ENOMEM;
+
+		cache_path_path(cache.cache_id, path, sizeof(path));
+		ret = snap_handle_open_attr(h, SNAP_FD_PATH, path);
+		if (!ret) {
+			cache_info_path(cache.cache_id, path, sizeof(path));
+			ret = snap_handle_open_attr(h, SNAP_FD_INFO, path);
+		}
+		goto out;
+	}
+
+	backing_id = (key & UINT32_MAX) - 1;
+	cache.cache_id = SNAP_HANDLE_CACHE(key);
+	ret = pcachesys_backing_init(&cache, &backing, backing_id);
+	if (ret)
+		return ret;
+
+	h->cache_segs = backing.cache_segs;
+	h->logic_dev_id = backing.logic_dev_id;
+	h->path = strdup(backing.backing_path);
+	if (!h->path)
+		return -ENOMEM;
+
+	backing_dev_path_path(cache.cache_id, backing_id, path, sizeof(path));
+	ret = snap_handle_open_attr(h, SNAP_FD_PATH, path);
+	if (!ret) {
+		backing_dev_cache_segs_path(cache.cache_id, backing_id, path, sizeof(path));
+		ret = snap_handle_open_attr(h, SNAP_FD_CACHE_SEGS, path);
+	}
+	if (!ret) {
+		backing_dev_mapped_id_path(cache.cache_id, backing_id, path, sizeof(path));
+		ret = snap_handle_open_attr(h, SNAP_FD_MAPPED_ID, path);
+	}
+	if (!ret) {
+		backing_dev_cache_gc_percent_path(cache.cache_id, backing_id, path, sizeof(path));
+		ret = snap_handle_open_attr(h, SNAP_FD_GC_PERCENT, path);
+	}
+	if (!ret) {
+		backing_dev_cache_used_segs_path(cache.cache_id, backing_id, path, sizeof(path));
+		ret = snap_handle_open_attr(h, SNAP_FD_USED_SEGS, path);
+	}
+out:
+	if (ret)
+		snap_handle_close(h);
+	return ret;
+}
+
+/*
+ * Re-read the static attributes and compare them with the handle's. -ESTALE
+ * when the cache or backing behind the ID is not the one the handle was
+ * opened on, or the read error.
+ */
+static int snap_handle_check(struct pcachesnap_handle *h)
+{
+	struct pcache_cache cache = { 0 };
+	char buf[PCACHESYS_INFO_LEN];
+	unsigned int cache_segs, logic_dev_id;
+	ssize_t len;
+	int ret;
+
+	if (!h->path)
+		return -ENOENT;
+
+	ret = pcachesys_read_fd(h->fd[SNAP_FD_PATH], buf, sizeof(buf));
+	if (ret)
+		return ret;
+	if (strcmp(buf, h->path))
+		return -ESTALE;
+
+	if (SNAP_HANDLE_IS_CACHE(h->key)) {
+		/* info is several lines, pcachesys_read_fd() keeps only the first */
+		len = pread(h->fd[SNAP_FD_INFO], buf, sizeof(buf) - 1, 0);
+		if (len < 0)
+			return -errno;
+		buf[len] = '\0';
+		pcachesys_parse_cache_info(&cache, buf);
+
+		if (cache.magic != h->magic || cache.version != h->version ||
+		    cache.flags != h->flags || cache.segment_num != h->segment_num)
+			return -ESTALE;
+		return 0;
+	}
+
+	ret = snap_handle_read_uint(h, SNAP_FD_CACHE_SEGS, &cache_segs);
+	if (!ret)
+		ret = snap_handle_read_uint(h, SNAP_FD_MAPPED_ID, &logic_dev_id);
+	if (ret)
+		return ret;
+
+	if (cache_segs != h->cache_segs || logic_dev_id != h->logic_dev_id)
+		return -ESTALE;
+	return 0;
+}
+
+static int snap_handle_read(struct pcachesnap_handle *h, struct pcache_backing *backing)
+{
+	int ret;
+
+	if (!h->path)
+		return -ENOENT;
+
+	backing->backing_id = (h->key & UINT32_MAX) - 1;
+	backing->cache_segs = h->cache_segs;
+	backing->logic_dev_id = h->logic_dev_id;
+	snprintf(backing->backing_path, sizeof(backing->backing_path), "%s", h->path);
+
+	ret = snap_handle_read_uint(h, SNAP_FD_GC_PERCENT, &backing->cache_gc_percent);
+	if (ret)
+		return ret;
+
+	return snap_handle_read_uint(h, SNAP_FD_USED_SEGS, &backing->cache_used_segs);
+}
+
+void pcachesnap_handles_init(struct pcachesnap_handles *handles)
+{
+	memset(handles, 0, sizeof(*handles));
+}
+
+void pcachesnap_handles_free(struct pcachesnap_handles *handles)
+{
+	unsigned int i;
+
+	for (i = 0; i < handles->nr; i++)
+		snap_handle_close(&handles->entries[i]);
+	free(handles->entries);
+	memset(handles, 0, sizeof(*handles));
+}
+
+/* Bring the handle set in line with the directories currently in sysfs */
+static int snap_handles_sync(struct pcachesnap_handles *handles, unsigned int cache_id)
+{
+	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	struct snap_scan_ctx ctx = { 0 };
+	struct pcachesnap_handle *entries, *old = handles->entries;
+	unsigned int i = 0, n = 0, old_nr = handles->nr, old_end = handles->nr;
+	size_t j = 0;
+	int ret;
+
+	ctx.handles = handles;
+	if (cache_id == PCACHESNAP_ALL_CACHES) {
+		walk_ctx.cb = snap_scan_cache_cb;
+		walk_ctx.data = &ctx;
+		sysfs_pcache_path(SYSFS_PCACHE_DEVICES_PATH, walk_ctx.path, sizeof(walk_ctx.path));
+		ret = walk_cache_devs(&walk_ctx);
+	} else {
+		ret = snap_scan_cache(&ctx, cache_id);
+	}
+	if (ret)
+		goto out;
+
+	qsort(ctx.keys, ctx.nr, sizeof(*ctx.keys), snap_key_cmp);
+
+	entries = malloc(sizeof(*entries) * (ctx.nr + old_nr + 1));
+	if (!entries) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Handles of other caches are carried over when only one is scanned:
+	 * those sorting before it, the merged cache, then those after it.
+	 */
+	if (cache_id != PCACHESNAP_ALL_CACHES) {
+		while (i < old_nr && SNAP_HANDLE_CACHE(old[i].key) < cache_id)
+			entries[n++] = old[i++];
+		old_end = i;
+		while (old_end < old_nr && SNAP_HANDLE_CACHE(old[old_end].key) == cache_id)
+			old_end++;
+	}
+
+	while (i < old_end || j < ctx.nr) {
+		if (j >= ctx.nr || (i < old_end && old[i].key < ctx.keys[j])) {
+			snap_handle_close(&old[i++]);
+		} else if (i >= old_end || ctx.keys[j] < old[i].key) {
+			if (snap_handle_open(&entries[n], ctx.keys[j]) == 0)
+				n++;
+			else
+				handles->errors++;
+			j++;
+		} else {
+			entries[n++] = old[i++];
+			j++;
+		}
+	}
+
+	while (i < old_nr)
+		entries[n++] = old[i++];
+
+	free(old);
+	handles->entries = entries;
+	handles->nr = n;
+out:
+	free(ctx.keys);
+	return ret;
+}
+
+/*
+ * Like pcachesnap_collect(), but through a set of kept-open handles. Records
+ * that fail to read are left out and counted in handles->errors.
+ */
+int pcachesnap_collect_cached(struct pcachesnap *snap, struct pcachesnap_handles *handles,
+			      unsigned int cache_id)
+{
+	struct pcache_cache cache;
+	struct pcache_backing backing;
+	unsigned int i;
+	int ret;
+
+	ret = snap_handles_sync(handles, cache_id);
+	if (ret)
+		return ret;
+
+	pcachesnap_reset(snap);
+
+	for (i = 0; i < handles->nr; i++) {
+		struct pcachesnap_handle *h = &handles->entries[i];
+
+		if (cache_id != PCACHESNAP_ALL_CACHES && SNAP_HANDLE_CACHE(h->key) != cache_id)
+			continue;
+
+		/* gone, failed before, or re-created under the same ID */
+		if (snap_handle_check(h)) {
+			snap_handle_close(h);
+			if (snap_handle_open(h, h->key)) {
+				handles->errors++;
+				continue;
+			}
+		}
+
+		if (SNAP_HANDLE_IS_CACHE(h->key)) {
+			cache.cache_id = SNAP_HANDLE_CACHE(h->key);
+			cache.magic = h->magic;
+			cache.version = h->version;
+			cache.flags = h->flags;
+			cache.segment_num = h->segment_num;
+			snprintf(cache.path, sizeof(cache.path), "%s", h->path);
+			ret = pcachesnap_add_cache(snap, &cache);
+		} else {
+			if (snap_handle_read(h, &backing)) {
+				handles->errors++;
+				continue;
+			}
+			ret = pcachesnap_add_backing(snap, SNAP_HANDLE_CACHE(h->key), &backing);
+		}
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int pcachesnap_find_cache(const struct pcachesnap *snap, unsigned int cache_id)
+{
+	int lo = 0, hi = (int)snap->caches.nr - 1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (snap->caches.cache_id[mid] == cache_id)
+			return mid;
+		if (snap->caches.cache_id[mid] < cache_id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+/* Index of the cache on @path, comparing canonical paths, or -1 */
+int pcachesnap_find_cache_path(const struct pcachesnap *snap, const char *path)
+{
+	char real[PATH_MAX], cache_real[PATH_MAX];
+	unsigned int i;
+
+	if (!realpath(path, real))
+		return -1;
+
+	for (i = 0; i < snap->caches.nr; i++) {
+		if (realpath(pcachesnap_str(snap, snap->caches.path[i]), cache_real) &&
+		    strcmp(real, cache_real) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Index of the first backing whose key is not below @key */
+static int snap_backing_lower_bound(const struct pcachesnap *snap, uint64_t key)
+{
+	int lo = 0, hi = (int)snap->backings.nr;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (snap_backing_key(snap, mid) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int pcachesnap_find_backing(const struct pcachesnap *snap, unsigned int cache_id, unsigned int backing_id)
+{
+	uint64_t key = ((uint64_t)cache_id << 32) | backing_id;
+	int idx;
+
+	idx = snap_backing_lower_bound(snap, key);
+	if (idx < (int)snap->backings.nr && snap_backing_key(snap, idx) == key)
+		return idx;
+
+	return -1;
+}
+
+/* Returns the number of backings of @cache_id, the first one at *first */
+int pcachesnap_cache_backings(const struct pcachesnap *snap, unsigned int cache_id, int *first)
+{
+	int start, end;
+
+	start = snap_backing_lower_bound(snap, (uint64_t)cache_id << 32);
+	end = snap_backing_lower_bound(snap, ((uint64_t)cache_id + 1) << 32);
+	*first = start;
+
+	return end - start;
+}
+
+static bool snap_str_equal(const struct pcachesnap *a, pcachesnap_str_t sa,
+			   const struct pcachesnap *b, pcachesnap_str_t sb)
+{
+	size_t len = pcachesnap_strlen(a, sa);
+
+	return len == pcachesnap_strlen(b, sb) &&
+		memcmp(pcachesnap_str(a, sa), pcachesnap_str(b, sb), len) == 0;
+}
+
+static bool snap_cache_changed(const struct pcachesnap *a, int i, const struct pcachesnap *b, int j)
+{
+	return a->caches.magic[i] != b->caches.magic[j] ||
+		a->caches.version[i] != b->caches.version[j] ||
+		a->caches.flags[i] != b->caches.flags[j] ||
+		a->caches.segment_num[i] != b->caches.segment_num[j] ||
+		!snap_str_equal(a, a->caches.path[i], b, b->caches.path[j]);
+}
+
+static bool snap_backing_changed(const struct pcachesnap *a, int i, const struct pcachesnap *b, int j)
+{
+	return a->backings.cache_segs[i] != b->backings.cache_segs[j] ||
+		a->backings.cache_gc_percent[i] != b->backings.cache_gc_percent[j] ||
+		a->backings.cache_used_segs[i] != b->backings.cache_used_segs[j] ||
+		a->backings.logic_dev_id[i] != b->backings.logic_dev_id[j] ||
+		!snap_str_equal(a, a->backings.backing_path[i], b, b->backings.backing_path[j]);
+}
+
+int pcachesnap_diff_caches(const struct pcachesnap *old_snap, const struct pcachesnap *new_snap,
+			   pcachesnap_diff_cb_t cb, void *data)
+{
+	int i = 0, j = 0;
+	int old_nr = old_snap->caches.nr, new_nr = new_snap->caches.nr;
+	int ret = 0;
+
+	while (!ret && (i < old_nr || j < new_nr)) {
+		if (j >= new_nr || (i < old_nr && old_snap->caches.cache_id[i] < new_snap->caches.cache_id[j])) {
+			ret = cb(old_snap, i++, new_snap, -1, PCACHESNAP_REMOVED, data);
+		} else if (i >= old_nr || new_snap->caches.cache_id[j] < old_snap->caches.cache_id[i]) {
+			ret = cb(old_snap, -1, new_snap, j++, PCACHESNAP_ADDED, data);
+		} else {
+			if (snap_cache_changed(old_snap, i, new_snap, j))
+				ret = cb(old_snap, i, new_snap, j, PCACHESNAP_CHANGED, data);
+			i++;
+			j++;
+		}
+	}
+
+	return ret;
+}
+
+int pcachesnap_diff_backings(const struct pcachesnap *old_snap, const struct pcachesnap *new_snap,
+			     pcachesnap_diff_cb_t cb, void *data)
+{
+	int i = 0, j = 0;
+	int old_nr = old_snap->backings.nr, new_nr = new_snap->backings.nr;
+	int ret = 0;
+
+	while (!ret && (i < old_nr || j < new_nr)) {
+		if (j >= new_nr || (i < old_nr && snap_backing_key(old_snap, i) < snap_backing_key(new_snap, j))) {
+			ret = cb(old_snap, i++, new_snap, -1, PCACHESNAP_REMOVED, data);
+		} else if (i >= old_nr || snap_backing_key(new_snap, j) < snap_backing_key(old_snap, i)) {
+			ret = cb(old_snap, -1, new_snap, j++, PCACHESNAP_ADDED, data);
+		} else {
+			if (snap_backing_changed(old_snap, i, new_snap, j))
+				ret = cb(old_snap, i, new_snap, j, PCACHESNAP_CHANGED, data);
+			i++;
+			j++;
+		}
+	}
+
+	return ret;
+}
+
+/* Bytes held by the snapshot, including spare capacity */
+size_t pcachesnap_footprint(const struct pcachesnap *snap)
+{
+	struct pcachesnap tmp = *snap;
+	struct snap_col cols[SNAP_COLS_MAX];
+	size_t size;
+	int nr_cols;
+
+	size = sizeof(*snap) + snap->arena_cap + sizeof(*snap->intern) * snap->intern_size;
+
+	nr_cols = snap_cache_cols(&tmp.caches, cols);
+	size += snap_row_size(cols, nr_cols) * snap->caches.cap;
+	nr_cols = snap_backing_cols(&tmp.backings, cols);
+	size += snap_row_size(cols, nr_cols) * snap->backings.cap;
+
+	return size;
+}
@@ -0,0 +1,172 @@
+#ifndef PCACHESNAP_H
+#define PCACHESNAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#include "pcache.h"
+
+/*
+ * Compact inventory snapshot.
+ *
+ * Strings are interned into one arena as length-prefixed, NUL-terminated
+ * records and referenced by their 32-bit arena offset. Offset 0 is always
+ * the empty string. Cache and backing records are stored as struct-of-arrays,
+ * each table in a single allocation, and are kept sorted by
+ * (cache_id, backing_id) so two snapshots can be diffed with a merge walk.
+ *
+ * A snapshot of 1024 caches with 128 backings each is a handful of
+ * allocations and roughly 28 bytes per backing plus its path string.
+ */
+
+#define PCACHESNAP_ALL_CACHES	UINT_MAX
+
+typedef uint32_t pcachesnap_str_t;
+
+struct pcachesnap_caches {
+	unsigned int		nr;
+	unsigned int		cap;
+	void			*block;
+	uint64_t		*magic;
+	uint32_t		*cache_id;
+	int32_t			*version;
+	int32_t			*flags;
+	uint32_t		*segment_num;
+	pcachesnap_str_t	*path;
+};
+
+struct pcachesnap_backings {
+	unsigned int		nr;
+	unsigned int		cap;
+	void			*block;
+	uint32_t		*cache_id;
+	uint32_t		*backing_id;
+	uint32_t		*cache_segs;
+	uint32_t		*cache_gc_percent;
+	uint32_t		*cache_used_segs;
+	uint32_t		*logic_dev_id;
+	pcachesnap_str_t	*backing_path;
+};
+
+/* How pcachesnap_collect() reads sysfs */
+enum pcachesnap_engine {
+	PCACHESNAP_ENGINE_SYNC	= 0,	/* open/read/close per attribute */
+	PCACHESNAP_ENGINE_AUTO,		/* io_uring when the kernel supports it, else sync */
+	PCACHESNAP_ENGINE_URING,	/* io_uring or fail with -EOPNOTSUPP */
+};
+
+struct pcachesnap {
+	char			*arena;
+	size_t			arena_len;
+	size_t			arena_cap;
+
+	/* open addressing table of arena offsets, 0 marks a free slot */
+	pcachesnap_str_t	*intern;
+	unsigned int		intern_size;
+	unsigned int		intern_nr;
+
+	struct pcachesnap_caches	caches;
+	struct pcachesnap_backings	backings;
+
+	/* ms to wait for each cache's shared lock while collecting, -1 to not lock */
+	int			lock_timeout;
+
+	enum pcachesnap_engine	engine;
+};
+
+/*
+ * Sysfs handles kept open across collections, for long-running users. Every
+ * attribute a record needs keeps an open fd and costs one pread() per
+ * collection. The static ones (a cache's path and info, a backing's path,
+ * cache_segs and mapped_id) are checked against what the handle was opened
+ * with, and the handle is reopened when they differ: a cache or backing
+ * re-created under the same ID is not reported with the old one's values.
+ */
+#define PCACHESNAP_HANDLE_FD_MAX	5
+
+struct pcachesnap_handle {
+	uint64_t	key;		/* cache_id << 32, plus backing_id + 1 for backings */
+	char		*path;
+	int		fd[PCACHESNAP_HANDLE_FD_MAX];
+	uint64_t	magic;
+	int32_t		version;
+	int32_t		flags;
+	uint32_t	segment_num;
+	uint32_t	cache_segs;
+	uint32_t	logic_dev_id;
+};
+
+struct pcachesnap_handles {
+	unsigned int		nr;
+	struct pcachesnap_handle	*entries;
+	unsigned long		errors;		/* attributes that failed to open or read */
+};
+
+enum pcachesnap_change {
+	PCACHESNAP_ADDED	= 0,
+	PCACHESNAP_REMOVED,
+	PCACHESNAP_CHANGED,
+};
+
+/*
+ * Called once per differing record. @old_idx is -1 for PCACHESNAP_ADDED and
+ * @new_idx is -1 for PCACHESNAP_REMOVED. A non-zero return stops the walk and
+ * is returned by the diff function.
+ */
+typedef int (*pcachesnap_diff_cb_t)(const struct pcachesnap *old_snap, int old_idx,
+				    const struct pcachesnap *new_snap, int new_idx,
+				    enum pcachesnap_change change, void *data);
+
+int pcachesnap_init(struct pcachesnap *snap);
+void pcachesnap_reset(struct pcachesnap *snap);
+void pcachesnap_free(struct pcachesnap *snap);
+
+int pcachesnap_intern(struct pcachesnap *snap, const char *str, size_t len, pcachesnap_str_t *out);
+
+int pcachesnap_add_cache(struct pcachesnap *snap, const struct pcache_cache *cache);
+int pcachesnap_add_backing(struct pcachesnap *snap, unsigned int cache_id,
+			   const struct pcache_backing *backing);
+int pcachesnap_sort(struct pcachesnap *snap);
+
+int pcachesnap_collect(struct pcachesnap *snap, unsigned int cache_id);
+
+void pcachesnap_handles_init(struct pcachesnap_handles *handles);
+void pcachesnap_handles_free(struct pcachesnap_handles *handles);
+int pcachesnap_collect_cached(struct pcachesnap *snap, struct pcachesnap_handles *handles,
+			      unsigned int cache_id);
+
+int pcachesnap_find_cache(const struct pcachesnap *snap, unsigned int cache_id);
+int pcachesnap_find_cache_path(const struct pcachesnap *snap, const char *path);
+int pcachesnap_find_backing(const struct pcachesnap *snap, unsigned int cache_id, unsigned int backing_id);
+int pcachesnap_cache_backings(const struct pcachesnap *snap, unsigned int cache_id, int *first);
+
+int pcachesnap_diff_caches(const struct pcachesnap *old_snap, const struct pcachesnap *new_snap,
+			   pcachesnap_diff_cb_t cb, void *data);
+int pcachesnap_diff_backings(const struct pcachesnap *old_snap, const struct pcachesnap *new_snap,
+			     pcachesnap_diff_cb_t cb, void *data);
+
+size_t pcachesnap_footprint(const struct pcachesnap *snap);
+
+static inline const char *pcachesnap_str(const struct pcachesnap *snap, pcachesnap_str_t str)
+{
+	return snap->arena + str + sizeof(uint16_t);
+}
+
+static inline size_t pcachesnap_strlen(const struct pcachesnap *snap, pcachesnap_str_t str)
+{
+	uint16_t len;
+
+	memcpy(&len, snap->arena + str, sizeof(len));
+	return len;
+}
+
+static inline void pcachesnap_logic_dev_path(const struct pcachesnap *snap, int idx,
+					     char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "/dev/pcache%u", snap->backings.logic_dev_id[idx]);
+}
+
+#endif // PCACHESNAP_H
@@ -6,32 +6,50 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sysfs/libsysfs.h>
 
 #include "pcache.h"
 #include "libpcachesys.h"
 
-int pcachesys_cache_init(struct pcache_cache *pcachet, int cache_id) {
+const char *pcachesys_root(void)
+{
+	static const char *root;
+
+	if (!root) {
+		root = getenv(PCACHE_SYSFS_ROOT_ENV);
+		if (!root)
+			root = "";
+	}
+
+	return root;
+}
+
+/* Whether the pcache bus is in sysfs at all, i.e. the module is loaded */
+bool pcachesys_present(void)
+{
 	char path[PCACHE_PATH_LEN];
-	FILE *file;
+
+	sysfs_pcache_path(SYSFS_PCACHE_BUS_PATH, path, sizeof(path));
+	return !access(path, F_OK);
+}
+
+/* Parse the "attribute: value" lines of a cache's info attribute */
+void pcachesys_parse_cache_info(struct pcache_cache *pcachet, const char *buf)
+{
 	char attribute[64];
-	char value_str[64];;
+	char value_str[64];
 	uint64_t value;
-	int ret;
+	int len;
 
-	pcachet->cache_id = cache_id;
-	/* Construct the file path */
-	cache_info_path(cache_id, path, PCACHE_PATH_LEN);
-
-	/* Open the file */
-	file = fopen(path, "r");
-	if (!file) {
-		printf("failed to open %s\n", path);
-		return -errno;  // Return error code
-	}
+	while (sscanf(buf, "%63[^:]: %63s\n%n", attribute, value_str, &len) == 2) {
+		buf += len;
 
-	/* Read and parse each line */
-	while (fscanf(file, "%63[^:]: %63s\n", attribute, value_str) == 2) {
 		/* Check if the value is in hexadecimal by looking for "0x" prefix */
 		if (strncmp(value_str, "0x", 2) == 0) {
 			sscanf(value_str, "%lx", &value);
@@ -51,6 +69,29 @@ int pcachesys_cache_init(struct pcache_cache *pcachet, int cache_id) {
 			/* Unrecognized attribute, ignore */
 		}
 	}
+}
+
+int pcachesys_cache_init(struct pcache_cache *pcachet, int cache_id) {
+	char path[PCACHE_PATH_LEN];
+	char info[PCACHESYS_INFO_LEN];
+	FILE *file;
+	size_t len;
+
+	pcachet->cache_id = cache_id;
+	/* Construct the file path */
+	cache_info_path(cache_id, path, PCACHE_PATH_LEN);
+
+	/* Open the file */
+	file = fopen(path, "r");
+	if (!file) {
+		printf("failed to open %s\n", path);
+		return -errno;  // Return error code
+	}
+
+	len = fread(info, 1, sizeof(info) - 1, file);
+	info[len] = '\0';
+	pcachesys_parse_cache_info(pcachet, info);
+
 	/* Close the file */
 	fclose(file);
 
@@ -97,6 +138,31 @@ int read_sysfs_value(const char *path, char *buf, size_t buf_len)
 	return 0;
 }
 
+/* Open a sysfs attribute to be re-read later with pcachesys_read_fd() */
+int pcachesys_open_attr(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	return fd < 0 ? -errno : fd;
+}
+
+/*
+ * Re-read an open sysfs attribute. sysfs regenerates the value on every read
+ * at offset 0, so a kept fd costs one pread() instead of open-read-close.
+ */
+int pcachesys_read_fd(int fd, char *buf, size_t buf_len)
+{
+	ssize_t len;
+
+	len = pread(fd, buf, buf_len - 1, 0);
+	if (len < 0)
+		return -errno;
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
 int pcachesys_backing_init(struct pcache_cache *pcachet, struct pcache_backing *backing, unsigned int backing_id)
 {
 	char path[PCACHE_PATH_LEN];
@@ -230,3 +296,174 @@ close_dir:
 err:
 	return ret;
 }
+
+static const char *lock_dir(void)
+{
+	const char *dir = getenv(PCACHE_LOCK_DIR_ENV);
+
+	return (dir && *dir) ? dir : PCACHE_LOCK_DIR;
+}
+
+static void lock_file_path(unsigned int cache_id, char *buffer, size_t buffer_size)
+{
+	if (cache_id == PCACHESYS_LOCK_REGISTER)
+		snprintf(buffer, buffer_size, "%s/register.lock", lock_dir());
+	else
+		snprintf(buffer, buffer_size, "%s/cache%u.lock", lock_dir(), cache_id);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Poll flock() with a capped backoff until it succeeds or timeout_ms passes */
+static int flock_timed(int fd, int op, int timeout_ms)
+{
+	useconds_t delay = 1000;
+	struct timespec start;
+	long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (flock(fd, op | LOCK_NB)) {
+		if (errno == EINTR)
+			continue;
+		if (errno != EWOULDBLOCK)
+			return -errno;
+
+		left = timeout_ms - elapsed_ms(&start);
+		if (left <= 0)
+			return -ETIMEDOUT;
+
+		usleep(delay < left * 1000 ? delay : left * 1000);
+		if (delay < 50000)
+			delay *= 2;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the advisory lock for cache_id, or the registration lock when cache_id
+ * is PCACHESYS_LOCK_REGISTER, waiting at most timeout_ms.
+ *
+ * A shared lock is best effort: if the lock file cannot be created (e.g. an
+ * unprivileged cache-list) the caller proceeds unlocked.
+ */
+int pcachesys_lock_cache(struct pcachesys_lock *lock, unsigned int cache_id, bool exclusive, int timeout_ms)
+{
+	char path[PCACHE_PATH_LEN];
+	int ret;
+
+	lock->fd = -1;
+
+	if (mkdir(lock_dir(), 0755) && errno != EEXIST && exclusive) {
+		ret = -errno;
+		printf("failed to create lock dir %s: %s\n", lock_dir(), strerror(-ret));
+		return ret;
+	}
+
+	lock_file_path(cache_id, path, sizeof(path));
+	lock->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock->fd < 0 && !exclusive)
+		lock->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (lock->fd < 0) {
+		if (!exclusive)
+			return 0;
+		ret = -errno;
+		printf("failed to open lock file %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	ret = flock_timed(lock->fd, exclusive ? LOCK_EX : LOCK_SH, timeout_ms);
+	if (ret) {
+		if (ret == -ETIMEDOUT)
+			printf("timed out after %d ms waiting for %s lock on %s\n",
+			       timeout_ms, exclusive ? "exclusive" : "shared", path);
+		else
+			printf("failed to lock %s: %s\n", path, strerror(-ret));
+		close(lock->fd);
+		lock->fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+void pcachesys_unlock(struct pcachesys_lock *lock)
+{
+	if (lock->fd < 0)
+		return;
+
+	flock(lock->fd, LOCK_UN);
+	close(lock->fd);
+	lock->fd = -1;
+}
+
+/*
+ * Listen on the unix socket @path, with @mask added to the umask for the
+ * socket file. A socket file left behind by a server that is gone is
+ * replaced; anything else at @path, or a socket a server still accepts
+ * on, is left alone. Returns the listening fd or -errno.
+ */
+int pcachesys_listen_unix(const char *path, int type, mode_t mask, int backlog)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	char dir[PCACHE_PATH_LEN];
+	struct stat st;
+	mode_t old;
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(sun.sun_path) || strlen(path) >= sizeof(dir)) {
+		printf("unix socket path too long: %s\n", path);
+		return -EINVAL;
+	}
+	strcpy(sun.sun_path, path);
+
+	/* the default sockets live in the lock directory, which may not exist yet */
+	mkdir(dirname(strcpy(dir, path)), 0755);
+
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			printf("%s exists and is not a socket\n", path);
+			return -EEXIST;
+		}
+
+		/* only a refused connection tells the socket is stale */
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+		ret = connect(fd, (struct sockaddr *)&sun, sizeof(sun)) ? errno : 0;
+		close(fd);
+		if (ret != ECONNREFUSED) {
+			printf("%s is in use by another server\n", path);
+			return -EADDRINUSE;
+		}
+		if (unlink(path) && errno != ENOENT) {
+			ret = -errno;
+			printf("failed to remove stale socket %s: %s\n", path, strerror(-ret));
+			return ret;
+		}
+	}
+
+	fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	old = umask(0);
+	umask(old | mask);
+	ret = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+	umask(old);
+	if (ret || listen(fd, backlog)) {
+		ret = -errno;
+		printf("failed to listen on %s: %s\n", path, strerror(-ret));
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
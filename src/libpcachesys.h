@@ -2,34 +2,63 @@
 #define PCACHESYS_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/types.h>
 
 #include "pcache.h"
 
+#define SYSFS_PCACHE_BUS_PATH "/sys/bus/pcache"
 #define SYSFS_PCACHE_CACHE_REGISTER "/sys/bus/pcache/cache_dev_register"
 #define SYSFS_PCACHE_CACHE_UNREGISTER "/sys/bus/pcache/cache_dev_unregister"
 #define SYSFS_PCACHE_DEVICES_PATH "/sys/bus/pcache/devices/"
 #define SYSFS_CACHE_BASE_PATH "/sys/bus/pcache/devices/cache_dev"
 
+/* Prefix for every sysfs path above, e.g. a fake tree on tmpfs for testing */
+#define PCACHE_SYSFS_ROOT_ENV "PCACHE_SYSFS_ROOT"
+
+/* Upper bound on the size of a cache's info attribute */
+#define PCACHESYS_INFO_LEN 1024
+
+/* Advisory lock files, one per cache plus one for cache registration */
+#define PCACHE_LOCK_DIR "/run/pcache"
+#define PCACHE_LOCK_DIR_ENV "PCACHE_LOCK_DIR"
+#define PCACHE_LOCK_TIMEOUT_DEFAULT 30	/* seconds */
+#define PCACHE_LOCK_TIMEOUT_MAX (INT_MAX / 1000)	/* seconds, the wait is an int of ms */
+
+const char *pcachesys_root(void);
+bool pcachesys_present(void);
+
+static inline void sysfs_pcache_path(const char *sysfs_path, char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s%s", pcachesys_root(), sysfs_path);
+}
+
+static inline void cache_dir_path(unsigned int cache_id, char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s%s%u", pcachesys_root(), SYSFS_CACHE_BASE_PATH, cache_id);
+}
+
 static inline void cache_info_path(int cache_id, char *buffer, size_t buffer_size)
 {
-	snprintf(buffer, buffer_size, "%s%u/info", SYSFS_CACHE_BASE_PATH, cache_id);
+	snprintf(buffer, buffer_size, "%s%s%u/info", pcachesys_root(), SYSFS_CACHE_BASE_PATH, cache_id);
 }
 
 static inline void cache_path_path(int cache_id, char *buffer, size_t buffer_size)
 {
-	snprintf(buffer, buffer_size, "%s%u/path", SYSFS_CACHE_BASE_PATH, cache_id);
+	snprintf(buffer, buffer_size, "%s%s%u/path", pcachesys_root(), SYSFS_CACHE_BASE_PATH, cache_id);
 }
 
 static inline void cache_adm_path(int cache_id, char *buffer, size_t buffer_size)
 {
 	/* Generate the path with cache_id */
-	snprintf(buffer, buffer_size, "%s%u/adm", SYSFS_CACHE_BASE_PATH, cache_id);
+	snprintf(buffer, buffer_size, "%s%s%u/adm", pcachesys_root(), SYSFS_CACHE_BASE_PATH, cache_id);
 }
 
 #define PCACHESYS_PATH(OBJ, MEMBER)                                                                            \
 static inline void OBJ##_##MEMBER##_path(unsigned int cache_id, unsigned int obj_id, char *buffer, size_t buffer_size) \
 {                                                                                                           \
-        snprintf(buffer, buffer_size, "%s%u/" #OBJ "%u/" #MEMBER, SYSFS_CACHE_BASE_PATH, cache_id, obj_id); \
+        snprintf(buffer, buffer_size, "%s%s%u/" #OBJ "%u/" #MEMBER, pcachesys_root(), SYSFS_CACHE_BASE_PATH, cache_id, obj_id); \
 }
 
 PCACHESYS_PATH(backing_dev, path)
@@ -39,10 +68,13 @@ PCACHESYS_PATH(backing_dev, cache_gc_percent)
 PCACHESYS_PATH(backing_dev, cache_used_segs)
 
 
+void pcachesys_parse_cache_info(struct pcache_cache *pcachet, const char *buf);
 int pcachesys_cache_init(struct pcache_cache *pcachet, int cache_id);
 int pcachesys_backing_init(struct pcache_cache *pcachet, struct pcache_backing *backing, unsigned int backing_id);
 int pcachesys_find_backing_id_from_path(struct pcache_cache *pcachet, char *path, unsigned int *backing_id);
 int pcachesys_write_value(const char *path, const char *value);
+int pcachesys_open_attr(const char *path);
+int pcachesys_read_fd(int fd, char *buf, size_t buf_len);
 
 struct pcachesys_walk_ctx;
 typedef int (*pcachesys_cb_t)(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx);
@@ -55,4 +87,20 @@ struct pcachesys_walk_ctx {
 int walk_cache_devs(struct pcachesys_walk_ctx *walk_ctx);
 int walk_backing_devs(struct pcachesys_walk_ctx *walk_ctx);
 
+/*
+ * flock(2) based advisory lock. List commands take a shared lock on the cache,
+ * mutations an exclusive one, so commands on different caches never contend.
+ * fd is -1 when no lock is held.
+ */
+struct pcachesys_lock {
+	int	fd;
+};
+
+#define PCACHESYS_LOCK_REGISTER	UINT_MAX
+
+int pcachesys_lock_cache(struct pcachesys_lock *lock, unsigned int cache_id, bool exclusive, int timeout_ms);
+void pcachesys_unlock(struct pcachesys_lock *lock);
+
+int pcachesys_listen_unix(const char *path, int type, mode_t mask, int backlog);
+
 #endif // PCACHESYS_H
@@ -0,0 +1,244 @@
+/* pipe2 */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libpcachetrace.h"
+
+#define NSEC_PER_SEC	1000000000ULL
+
+static int trace_detect(struct pcachetrace *trace)
+{
+	struct pcachetrace_header hdr;
+
+	setvbuf(trace->file, NULL, _IOFBF, 1 << 20);
+
+	if (trace->pipe)
+		return 0;
+
+	if (fread(&hdr, sizeof(hdr), 1, trace->file) == 1 &&
+	    memcmp(hdr.magic, PCACHETRACE_MAGIC, sizeof(hdr.magic)) == 0) {
+		if (le32toh(hdr.version) != PCACHETRACE_VERSION ||
+		    le32toh(hdr.record_size) != sizeof(struct pcachetrace_io)) {
+			printf("unsupported binary trace version %u, record size %u\n",
+			       le32toh(hdr.version), le32toh(hdr.record_size));
+			return -EINVAL;
+		}
+		trace->binary = true;
+		return 0;
+	}
+
+	rewind(trace->file);
+	return 0;
+}
+
+int pcachetrace_open(struct pcachetrace *trace, const char *path)
+{
+	int ret;
+
+	memset(trace, 0, sizeof(*trace));
+
+	trace->file = fopen(path, "r");
+	if (!trace->file) {
+		ret = -errno;
+		printf("failed to open trace %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	ret = trace_detect(trace);
+	if (ret)
+		pcachetrace_close(trace);
+	return ret;
+}
+
+/* Fork @argv with stdin/stdout on @in/@out and stderr discarded; the pipes are O_CLOEXEC */
+static pid_t trace_spawn(char *const argv[], int in, int out)
+{
+	pid_t pid;
+	int null_fd;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd >= 0)
+		dup2(null_fd, STDERR_FILENO);
+	if (in >= 0)
+		dup2(in, STDIN_FILENO);
+	dup2(out, STDOUT_FILENO);
+
+	execvp(argv[0], argv);
+	_exit(127);
+}
+
+/*
+ * blktrace -d @dev -w @seconds -o - | blkparse -q -i -, run without a shell
+ * so the device path is passed through as is.
+ */
+int pcachetrace_blktrace(struct pcachetrace *trace, const char *dev, unsigned int seconds)
+{
+	char secs[16];
+	char *const blktrace[] = { "blktrace", "-d", (char *)dev, "-w", secs, "-o", "-", NULL };
+	char *const blkparse[] = { "blkparse", "-q", "-i", "-", NULL };
+	int raw[2], text[2];
+	int ret;
+
+	memset(trace, 0, sizeof(*trace));
+	trace->pids[0] = trace->pids[1] = -1;
+	snprintf(secs, sizeof(secs), "%u", seconds);
+
+	if (pipe2(raw, O_CLOEXEC)) {
+		ret = -errno;
+		printf("failed to create pipe: %s\n", strerror(-ret));
+		return ret;
+	}
+	if (pipe2(text, O_CLOEXEC)) {
+		ret = -errno;
+		printf("failed to create pipe: %s\n", strerror(-ret));
+		goto close_raw;
+	}
+
+	trace->pids[0] = trace_spawn(blktrace, -1, raw[1]);
+	if (trace->pids[0] < 0)
+		goto err_fork;
+	trace->pids[1] = trace_spawn(blkparse, raw[0], text[1]);
+	if (trace->pids[1] < 0)
+		goto err_fork;
+
+	close(raw[0]);
+	close(raw[1]);
+	close(text[1]);
+
+	trace->file = fdopen(text[0], "r");
+	if (!trace->file) {
+		ret = -errno;
+		close(text[0]);
+		pcachetrace_close(trace);
+		return ret;
+	}
+	trace->pipe = true;
+
+	return trace_detect(trace);
+
+err_fork:
+	ret = -errno;
+	printf("failed to run blktrace: %s\n", strerror(-ret));
+	close(text[0]);
+	close(text[1]);
+	close(raw[0]);
+	close(raw[1]);
+	pcachetrace_close(trace);
+	return ret;
+close_raw:
+	close(raw[0]);
+	close(raw[1]);
+	return ret;
+}
+
+/* For blktrace, fails unless both commands exited with status 0 */
+int pcachetrace_close(struct pcachetrace *trace)
+{
+	int status, ret = 0;
+	int i;
+
+	if (trace->file) {
+		fclose(trace->file);
+		trace->file = NULL;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (trace->pids[i] <= 0)
+			continue;
+		if (waitpid(trace->pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = -EIO;
+		trace->pids[i] = 0;
+	}
+	trace->pipe = false;
+
+	return ret;
+}
+
+/*
+ * Parse one blkparse line, e.g.
+ *   8,0    3        1     0.000000000   697  Q   W 223490 + 8 [kjournald]
+ */
+static bool trace_parse_line(const char *line, struct pcachetrace_io *io)
+{
+	char action[4], rwbs[8];
+	unsigned long long sector;
+	unsigned int nr_sectors;
+	unsigned long sec, nsec;
+
+	if (sscanf(line, "%*s %*s %*s %lu.%lu %*s %3s %7s %llu + %u",
+		   &sec, &nsec, action, rwbs, &sector, &nr_sectors) != 6)
+		return false;
+
+	if (strcmp(action, "Q") || !nr_sectors || strchr(rwbs, 'D'))
+		return false;
+
+	if (strchr(rwbs, 'W'))
+		io->flags = PCACHETRACE_F_WRITE;
+	else if (strchr(rwbs, 'R'))
+		io->flags = 0;
+	else
+		return false;
+
+	io->time_ns = sec * NSEC_PER_SEC + nsec;
+	io->offset = sector << 9;
+	io->len = nr_sectors << 9;
+	return true;
+}
+
+int pcachetrace_next(struct pcachetrace *trace, struct pcachetrace_io *io)
+{
+	char line[512];
+
+	if (trace->binary) {
+		if (fread(io, sizeof(*io), 1, trace->file) != 1)
+			return ferror(trace->file) ? -EIO : 0;
+		io->time_ns = le64toh(io->time_ns);
+		io->offset = le64toh(io->offset);
+		io->len = le32toh(io->len);
+		io->flags = le32toh(io->flags);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), trace->file)) {
+		if (trace_parse_line(line, io))
+			return 1;
+		trace->skipped++;
+	}
+
+	return ferror(trace->file) ? -EIO : 0;
+}
+
+int pcachetrace_write_header(FILE *out)
+{
+	struct pcachetrace_header hdr;
+
+	memcpy(hdr.magic, PCACHETRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(PCACHETRACE_VERSION);
+	hdr.record_size = htole32(sizeof(struct pcachetrace_io));
+
+	return fwrite(&hdr, sizeof(hdr), 1, out) == 1 ? 0 : -EIO;
+}
+
+int pcachetrace_write(FILE *out, const struct pcachetrace_io *io)
+{
+	struct pcachetrace_io le;
+
+	le.time_ns = htole64(io->time_ns);
+	le.offset = htole64(io->offset);
+	le.len = htole32(io->len);
+	le.flags = htole32(io->flags);
+
+	return fwrite(&le, sizeof(le), 1, out) == 1 ? 0 : -EIO;
+}
@@ -0,0 +1,56 @@
+#ifndef PCACHETRACE_H
+#define PCACHETRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Block trace input, streamed one I/O at a time.
+ *
+ * Two formats are read: blkparse text output, of which only queue ("Q")
+ * events with a read or write payload are kept, and a compact binary format
+ * of fixed little endian records after a small header, which
+ * pcachetrace_write_header()/pcachetrace_write() produce.
+ */
+
+#define PCACHETRACE_MAGIC	"PCREPLAY"
+#define PCACHETRACE_VERSION	1
+
+#define PCACHETRACE_F_WRITE	1
+
+struct pcachetrace_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	record_size;
+};
+
+/* also the binary record layout */
+struct pcachetrace_io {
+	uint64_t	time_ns;
+	uint64_t	offset;		/* bytes */
+	uint32_t	len;		/* bytes */
+	uint32_t	flags;
+};
+
+struct pcachetrace {
+	FILE		*file;
+	bool		binary;
+	bool		pipe;
+	pid_t		pids[2];	/* blktrace, blkparse */
+	unsigned long	skipped;	/* lines that are not replayable events */
+};
+
+int pcachetrace_open(struct pcachetrace *trace, const char *path);
+/* read a live blktrace window of @dev through blkparse */
+int pcachetrace_blktrace(struct pcachetrace *trace, const char *dev, unsigned int seconds);
+int pcachetrace_close(struct pcachetrace *trace);
+
+/* 1 with the next I/O in @io, 0 at the end of the trace, -errno on error */
+int pcachetrace_next(struct pcachetrace *trace, struct pcachetrace_io *io);
+
+int pcachetrace_write_header(FILE *out);
+int pcachetrace_write(FILE *out, const struct pcachetrace_io *io);
+
+#endif // PCACHETRACE_H
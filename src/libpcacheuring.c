@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "libpcacheuring.h"
+
+/* Same numbers on every architecture using the generic syscall table */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register	427
+#endif
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			      unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_enter_arg(int fd, unsigned int min_complete, unsigned int flags,
+				  const void *arg, size_t arg_sz)
+{
+	return syscall(__NR_io_uring_enter, fd, 0, min_complete, flags, arg, arg_sz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(struct pcache_uring *ring)
+{
+	if (ring->sq.sqes && ring->sq.sqes != MAP_FAILED)
+		munmap(ring->sq.sqes, ring->sq.sqes_sz);
+	if (ring->cq.ring && ring->cq.ring != MAP_FAILED && ring->cq.ring != ring->sq.ring)
+		munmap(ring->cq.ring, ring->cq.ring_sz);
+	if (ring->sq.ring && ring->sq.ring != MAP_FAILED)
+		munmap(ring->sq.ring, ring->sq.ring_sz);
+}
+
+int pcache_uring_init(struct pcache_uring *ring, unsigned int entries, unsigned int flags)
+{
+	struct io_uring_params p;
+	struct pcache_uring_sq *sq = &ring->sq;
+	struct pcache_uring_cq *cq = &ring->cq;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->features = p.features;
+	sq->ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq->ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* 5.4+ kernels map both rings with a single mmap */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq->ring_sz > sq->ring_sz)
+			sq->ring_sz = cq->ring_sz;
+		cq->ring_sz = sq->ring_sz;
+	}
+
+	sq->ring = mmap(NULL, sq->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+	if (sq->ring == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq->ring = sq->ring;
+	} else {
+		cq->ring = mmap(NULL, cq->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring->fd, IORING_OFF_CQ_RING);
+		if (cq->ring == MAP_FAILED)
+			goto err;
+	}
+
+	sq->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq->sqes = mmap(NULL, sq->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+	if (sq->sqes == MAP_FAILED)
+		goto err;
+
+	sq->head = (unsigned int *)((char *)sq->ring + p.sq_off.head);
+	sq->tail = (unsigned int *)((char *)sq->ring + p.sq_off.tail);
+	sq->mask = (unsigned int *)((char *)sq->ring + p.sq_off.ring_mask);
+	sq->entries = (unsigned int *)((char *)sq->ring + p.sq_off.ring_entries);
+	sq->array = (unsigned int *)((char *)sq->ring + p.sq_off.array);
+	sq->sqe_head = sq->sqe_tail = *sq->tail;
+
+	cq->head = (unsigned int *)((char *)cq->ring + p.cq_off.head);
+	cq->tail = (unsigned int *)((char *)cq->ring + p.cq_off.tail);
+	cq->mask = (unsigned int *)((char *)cq->ring + p.cq_off.ring_mask);
+	cq->cqes = (struct io_uring_cqe *)((char *)cq->ring + p.cq_off.cqes);
+
+	return 0;
+err:
+	ret = -errno;
+	uring_unmap(ring);
+	close(ring->fd);
+	ring->fd = -1;
+	return ret;
+}
+
+void pcache_uring_exit(struct pcache_uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	uring_unmap(ring);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *pcache_uring_get_sqe(struct pcache_uring *ring)
+{
+	struct pcache_uring_sq *sq = &ring->sq;
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(sq->head, __ATOMIC_ACQUIRE);
+	if (sq->sqe_tail - head >= *sq->entries)
+		return NULL;
+
+	sqe = &sq->sqes[sq->sqe_tail & *sq->mask];
+	sq->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+int pcache_uring_submit(struct pcache_uring *ring, unsigned int wait_nr)
+{
+	struct pcache_uring_sq *sq = &ring->sq;
+	unsigned int tail = *sq->tail;
+	unsigned int to_submit = sq->sqe_tail - sq->sqe_head;
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	while (sq->sqe_head != sq->sqe_tail) {
+		sq->array[tail & *sq->mask] = sq->sqe_head & *sq->mask;
+		sq->sqe_head++;
+		tail++;
+	}
+	__atomic_store_n(sq->tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+int pcache_uring_peek_cqe(struct pcache_uring *ring, struct io_uring_cqe **cqe)
+{
+	struct pcache_uring_cq *cq = &ring->cq;
+	unsigned int head = *cq->head;
+
+	if (head == __atomic_load_n(cq->tail, __ATOMIC_ACQUIRE))
+		return -EAGAIN;
+
+	*cqe = &cq->cqes[head & *cq->mask];
+	return 0;
+}
+
+int pcache_uring_wait_cqe(struct pcache_uring *ring, struct io_uring_cqe **cqe)
+{
+	int ret;
+
+	while ((ret = pcache_uring_peek_cqe(ring, cqe)) == -EAGAIN) {
+		ret = sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return ret;
+}
+
+/*
+ * Like pcache_uring_wait_cqe() but give up after @timeout_ns with -ETIME.
+ * Kernels without IORING_FEAT_EXT_ARG (before 5.11) sleep in short slices.
+ */
+int pcache_uring_wait_cqe_timeout(struct pcache_uring *ring, struct io_uring_cqe **cqe,
+				  uint64_t timeout_ns)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct timespec slice;
+	int ret;
+
+	ret = pcache_uring_peek_cqe(ring, cqe);
+	if (ret != -EAGAIN)
+		return ret;
+
+	if (!(ring->features & IORING_FEAT_EXT_ARG)) {
+		slice.tv_sec = 0;
+		slice.tv_nsec = timeout_ns < 50000 ? timeout_ns : 50000;
+		nanosleep(&slice, NULL);
+		ret = pcache_uring_peek_cqe(ring, cqe);
+		return ret == -EAGAIN ? -ETIME : ret;
+	}
+
+	ts.tv_sec = timeout_ns / 1000000000ULL;
+	ts.tv_nsec = timeout_ns % 1000000000ULL;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+
+	ret = sys_io_uring_enter_arg(ring->fd, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				     &arg, sizeof(arg));
+	if (ret < 0 && errno != EINTR && errno != ETIME)
+		return -errno;
+
+	ret = pcache_uring_peek_cqe(ring, cqe);
+	return ret == -EAGAIN ? -ETIME : ret;
+}
+
+int pcache_uring_register_files(struct pcache_uring *ring, unsigned int nr)
+{
+	int *fds;
+	int ret;
+
+	fds = malloc(sizeof(*fds) * nr);
+	if (!fds)
+		return -ENOMEM;
+	memset(fds, -1, sizeof(*fds) * nr);
+
+	ret = sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, nr);
+	if (ret < 0)
+		ret = -errno;
+
+	free(fds);
+	return ret;
+}
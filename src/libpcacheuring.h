@@ -0,0 +1,79 @@
+#ifndef PCACHEURING_H
+#define PCACHEURING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on the raw syscalls, so pcache does not depend on
+ * liburing. It covers what pcache needs: one ring per thread, SQEs prepared
+ * by the caller, batched submit-and-wait, CQE peek/wait and a sparse fixed
+ * file table.
+ */
+
+struct pcache_uring_sq {
+	unsigned int		*head;
+	unsigned int		*tail;
+	unsigned int		*mask;
+	unsigned int		*entries;
+	unsigned int		*array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		sqe_head;	/* first SQE not yet handed to the kernel */
+	unsigned int		sqe_tail;	/* next SQE to hand out */
+	void			*ring;
+	size_t			ring_sz;
+	size_t			sqes_sz;
+};
+
+struct pcache_uring_cq {
+	unsigned int		*head;
+	unsigned int		*tail;
+	unsigned int		*mask;
+	struct io_uring_cqe	*cqes;
+	void			*ring;
+	size_t			ring_sz;
+};
+
+struct pcache_uring {
+	int			fd;
+	unsigned int		features;
+	struct pcache_uring_sq	sq;
+	struct pcache_uring_cq	cq;
+};
+
+int pcache_uring_init(struct pcache_uring *ring, unsigned int entries, unsigned int flags);
+void pcache_uring_exit(struct pcache_uring *ring);
+
+/* NULL when the SQ ring is full, submit and reap first */
+struct io_uring_sqe *pcache_uring_get_sqe(struct pcache_uring *ring);
+
+/* Submit every prepared SQE and wait for at least @wait_nr completions */
+int pcache_uring_submit(struct pcache_uring *ring, unsigned int wait_nr);
+
+/* -EAGAIN when no completion is pending */
+int pcache_uring_peek_cqe(struct pcache_uring *ring, struct io_uring_cqe **cqe);
+int pcache_uring_wait_cqe(struct pcache_uring *ring, struct io_uring_cqe **cqe);
+int pcache_uring_wait_cqe_timeout(struct pcache_uring *ring, struct io_uring_cqe **cqe,
+				  uint64_t timeout_ns);
+
+static inline void pcache_uring_cqe_seen(struct pcache_uring *ring)
+{
+	__atomic_store_n(ring->cq.head, *ring->cq.head + 1, __ATOMIC_RELEASE);
+}
+
+/* Register @nr empty fixed file slots, filled later by direct opens */
+int pcache_uring_register_files(struct pcache_uring *ring, unsigned int nr);
+
+static inline void pcache_uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+					const void *addr, unsigned int len, uint64_t off)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = off;
+}
+
+#endif // PCACHEURING_H
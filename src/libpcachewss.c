@@ -0,0 +1,127 @@
+#include <string.h>
+#include <math.h>
+
+#include "libpcachewss.h"
+
+/* Curves whose knee sits closer than this to the chord have none */
+#define WSS_KNEE_MIN	0.05
+
+void pcachewss_init(struct pcachewss *wss)
+{
+	memset(wss, 0, sizeof(*wss));
+	wss->sum = PCACHEWSS_REGS;
+	wss->zeros = PCACHEWSS_REGS;
+	wss->stride = PCACHEWSS_STRIDE_INIT;
+}
+
+/* splitmix64 finaliser, block numbers are far from random */
+static inline uint64_t wss_hash(uint64_t key)
+{
+	key += 0x9e3779b97f4a7c15ULL;
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+
+	return key ^ (key >> 31);
+}
+
+static void wss_add_point(struct pcachewss *wss)
+{
+	unsigned int i;
+
+	if (wss->nr_points == PCACHEWSS_POINTS_MAX) {
+		for (i = 0; i < PCACHEWSS_POINTS_MAX / 2; i++)
+			wss->points[i] = wss->points[i * 2 + 1];
+		wss->nr_points = PCACHEWSS_POINTS_MAX / 2;
+		wss->stride *= 2;
+		/* the kept points are the odd ones, at multiples of the new stride */
+		if (wss->accesses % wss->stride)
+			return;
+	}
+
+	wss->points[wss->nr_points].accesses = wss->accesses;
+	wss->points[wss->nr_points].blocks = pcachewss_estimate(wss);
+	wss->nr_points++;
+}
+
+static void wss_add_block(struct pcachewss *wss, uint64_t block)
+{
+	uint64_t hash = wss_hash(block);
+	unsigned int idx = hash >> (64 - PCACHEWSS_P);
+	uint64_t rest = hash << PCACHEWSS_P;
+	uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - PCACHEWSS_P + 1;
+	uint8_t old = wss->regs[idx];
+
+	if (rank > old) {
+		wss->sum += ldexp(1.0, -rank) - ldexp(1.0, -old);
+		if (!old)
+			wss->zeros--;
+		wss->regs[idx] = rank;
+	}
+
+	wss->accesses++;
+	if (wss->accesses % wss->stride == 0)
+		wss_add_point(wss);
+}
+
+void pcachewss_add(struct pcachewss *wss, uint64_t offset, uint32_t len)
+{
+	uint64_t block = offset >> PCACHEWSS_BLOCK_SHIFT;
+	uint64_t last = (offset + (len ? len : 1) - 1) >> PCACHEWSS_BLOCK_SHIFT;
+
+	for (; block <= last; block++)
+		wss_add_block(wss, block);
+}
+
+double pcachewss_estimate(const struct pcachewss *wss)
+{
+	double m = PCACHEWSS_REGS;
+	double alpha = 0.7213 / (1 + 1.079 / m);
+	double estimate = alpha * m * m / wss->sum;
+
+	/* small range correction, linear counting on the empty registers */
+	if (estimate <= 2.5 * m && wss->zeros)
+		estimate = m * log(m / wss->zeros);
+
+	return estimate;
+}
+
+bool pcachewss_knee(struct pcachewss *wss, struct pcachewss_point *knee)
+{
+	struct pcachewss_point *last;
+	double best = 0, x, y;
+	unsigned int i;
+	int knee_idx = -1;
+
+	memset(knee, 0, sizeof(*knee));
+	if (!wss->accesses)
+		return false;
+
+	/* close the curve at the final access count */
+	if (!wss->nr_points || wss->points[wss->nr_points - 1].accesses != wss->accesses) {
+		if (wss->nr_points == PCACHEWSS_POINTS_MAX)
+			wss->nr_points--;
+		wss->points[wss->nr_points].accesses = wss->accesses;
+		wss->points[wss->nr_points].blocks = pcachewss_estimate(wss);
+		wss->nr_points++;
+	}
+
+	last = &wss->points[wss->nr_points - 1];
+	*knee = *last;
+	if (last->blocks <= 0)
+		return false;
+
+	for (i = 0; i < wss->nr_points; i++) {
+		x = (double)wss->points[i].accesses / last->accesses;
+		y = wss->points[i].blocks / last->blocks;
+		if (y - x > best) {
+			best = y - x;
+			knee_idx = i;
+		}
+	}
+
+	if (knee_idx < 0 || best < WSS_KNEE_MIN)
+		return false;
+
+	*knee = wss->points[knee_idx];
+	return true;
+}
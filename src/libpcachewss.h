@@ -0,0 +1,54 @@
+#ifndef PCACHEWSS_H
+#define PCACHEWSS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Working-set estimation for sizing a backing's cache.
+ *
+ * Every 4 KiB block an I/O touches is fed to a HyperLogLog sketch, so the
+ * memory used is fixed however long the sample is. The sketch keeps its
+ * harmonic sum up to date on every register change, which makes an estimate
+ * O(1) and lets the working-set curve, distinct blocks against accesses, be
+ * sampled as the trace streams by. The curve is kept at no more than
+ * PCACHEWSS_POINTS_MAX points by dropping every other one and doubling the
+ * sampling stride when it fills up.
+ */
+
+#define PCACHEWSS_BLOCK_SHIFT	12
+#define PCACHEWSS_P		14		/* 2^14 registers, ~0.8% standard error */
+#define PCACHEWSS_REGS		(1U << PCACHEWSS_P)
+#define PCACHEWSS_POINTS_MAX	1024
+#define PCACHEWSS_STRIDE_INIT	64
+
+struct pcachewss_point {
+	uint64_t	accesses;
+	double		blocks;
+};
+
+struct pcachewss {
+	uint8_t			regs[PCACHEWSS_REGS];
+	double			sum;		/* sum of 2^-reg over all registers */
+	unsigned int		zeros;		/* registers still at 0 */
+
+	uint64_t		accesses;
+	uint64_t		stride;
+	unsigned int		nr_points;
+	struct pcachewss_point	points[PCACHEWSS_POINTS_MAX];
+};
+
+void pcachewss_init(struct pcachewss *wss);
+/* Count every block of the byte range [offset, offset + len) */
+void pcachewss_add(struct pcachewss *wss, uint64_t offset, uint32_t len);
+double pcachewss_estimate(const struct pcachewss *wss);
+
+/*
+ * Find the knee of the working-set curve, where new blocks stop arriving at
+ * the rate of accesses: the point furthest above the chord from the origin to
+ * the end of the normalised curve. Returns false, with the last point in
+ * @knee, when the curve is too close to a straight line to have one.
+ */
+bool pcachewss_knee(struct pcachewss *wss, struct pcachewss_point *knee);
+
+#endif // PCACHEWSS_H
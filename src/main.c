@@ -19,12 +19,25 @@ static int load_module(const char *module_name)
 	return system(command);
 }
 
+/* Commands that work on plain devices and files, without the pcache module */
+static bool cmd_needs_module(enum PCACHE_CMD_TYPE cmd)
+{
+	switch (cmd) {
+	case CCT_REPLAY:
+	case CCT_PMEM_BENCH:
+	case CCT_CACHE_MIGRATE:
+		return false;
+	default:
+		return true;
+	}
+}
+
 static int pcache_run(pcache_opt_t *options)
 {
 	int ret = 0;
 
 	/* Check if 'pcache' module is loaded */
-	if (!is_module_loaded("pcache")) {
+	if (cmd_needs_module(options->co_cmd) && !is_module_loaded("pcache")) {
 		if (load_module("pcache") != 0) {
 			fprintf(stderr, "Failed to load 'pcache' module. Exiting.\n");
 			return -1; /* Return an error if module cannot be loaded */
@@ -50,6 +63,27 @@ static int pcache_run(pcache_opt_t *options)
 		case CCT_BACKING_LIST:
 			ret = pcache_backing_list(options);
 			break;
+		case CCT_PLAN:
+			ret = pcache_plan(options);
+			break;
+		case CCT_EXPORTER:
+			ret = pcache_exporter(options);
+			break;
+		case CCT_SHM_PUBLISH:
+			ret = pcache_shm_publish(options);
+			break;
+		case CCT_REPLAY:
+			ret = pcache_replay(options);
+			break;
+		case CCT_PMEM_BENCH:
+			ret = pcache_pmem_bench(options);
+			break;
+		case CCT_CACHE_MIGRATE:
+			ret = pcache_cache_migrate(options);
+			break;
+		case CCT_SERVE:
+			ret = pcache_serve(options);
+			break;
 		default:
 			printf("Unknown command: %u\n", options->co_cmd);
 			ret = -1;
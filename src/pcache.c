@@ -5,10 +5,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <ctype.h>
+#include <glob.h>
+#include <math.h>
 #include <jansson.h>
 
 #include "pcache.h"
 #include "libpcachesys.h"
+#include "libpcachesnap.h"
+#include "libpcacheplan.h"
+#include "libpcacheshm.h"
+#include "libpcachedev.h"
+#include "libpcachetrace.h"
+#include "libpcachewss.h"
 
 #define PCACHE_PROGRAM_NAME "pcache"
 
@@ -22,13 +33,24 @@ static void usage ()
 
 	fprintf(stdout, "These are common pcache commands used in various situations:\n\n");
 
+	fprintf(stdout, "Common options:\n");
+	fprintf(stdout, "   -w, --wait <seconds>         Max time to wait for the per-cache lock (default: %u)\n",
+		PCACHE_LOCK_TIMEOUT_DEFAULT);
+	fprintf(stdout, "   -e, --engine <engine>        sysfs reads for list and plan: auto, uring or sync (default: sync)\n\n");
+
 	fprintf(stdout, "Managing cache device:\n");
 	fprintf(stdout, "   cache-start     Register a new cache device\n");
 	fprintf(stdout, "                   -p, --path <path>            Specify cache device path\n");
 	fprintf(stdout, "                   -f, --format                 Format path (default: false)\n");
 	fprintf(stdout, "                   -F, --force                  Force format path (default: false)\n");
+	fprintf(stdout, "                   --bench                      With --format, run pmem-bench first and refuse a slow device\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s cache-start -p /path -F -f\n\n", PCACHE_PROGRAM_NAME);
+	fprintf(stdout, "                   --assemble                   Register every existing cache found on PMem devices, never format\n");
+	fprintf(stdout, "                   -p, --path <pattern>         With --assemble, devices or image files to probe (default: %s)\n",
+		PCACHE_ASSEMBLE_DEVICES);
+	fprintf(stdout, "                   --dry-run                    With --assemble, only report what would be registered\n");
+	fprintf(stdout, "                   Example: %s cache-start --assemble\n\n", PCACHE_PROGRAM_NAME);
 
 	fprintf(stdout, "   cache-stop      Unregister a cache\n");
 	fprintf(stdout, "                   -c, --cache <cid>            Specify cache ID\n");
@@ -39,12 +61,25 @@ static void usage ()
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s cache-list\n\n", PCACHE_PROGRAM_NAME);
 
+	fprintf(stdout, "   cache-migrate   Copy an unregistered cache to another device, keeping it warm\n");
+	fprintf(stdout, "                   --from <path>                Source cache device or image\n");
+	fprintf(stdout, "                   --to <path>                  Destination device or image\n");
+	fprintf(stdout, "                   -q, --queues <n>             Copy threads (default: 1)\n");
+	fprintf(stdout, "                   --journal <file>             Progress journal, for resuming (default: %s/migrate-<to>.journal)\n",
+		PCACHE_MIGRATE_JOURNAL_DIR);
+	fprintf(stdout, "                   -F, --force                  Overwrite a destination that holds a cache\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s cache-migrate --from /dev/pmem0 --to /dev/pmem1 -q 8\n\n", PCACHE_PROGRAM_NAME);
+
 	fprintf(stdout, "Managing backings:\n");
 	fprintf(stdout, "   backing-start   Start a backing\n");
 	fprintf(stdout, "                   -c, --cache <cid>        Specify cache ID\n");
 	fprintf(stdout, "                   -p, --path <path>            Specify backing path\n");
 	fprintf(stdout, "                   -q, --queues <queues>        number of queues\n");
 	fprintf(stdout, "                   -s, --cache-size <size>      Set cache size (units: K, M, G)\n");
+	fprintf(stdout, "                   -s, --cache-size auto[:<f>]  Size to the working set, within fraction f of free segments (f needed without a sample)\n");
+	fprintf(stdout, "                   -t, --trace <file>           With auto, blkparse or binary trace of the backing\n");
+	fprintf(stdout, "                   --sample <seconds>           With auto, sample the backing with blktrace instead\n");
 	fprintf(stdout, "                   -x, --data-crc               Enable data CRC protection\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s backing-start -p /path -s 512M \n\n", PCACHE_PROGRAM_NAME);
@@ -59,6 +94,69 @@ static void usage ()
 	fprintf(stdout, "                   -c, --cache <cid>        Specify cache ID\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s backing-list\n\n", PCACHE_PROGRAM_NAME);
+
+	fprintf(stdout, "Capacity planning:\n");
+	fprintf(stdout, "   plan            Split a cache's segments across its backings by expected hit rate\n");
+	fprintf(stdout, "                   -c, --cache <cid>            Specify cache ID\n");
+	fprintf(stdout, "                   -t, --trace <bid>=<file>     blkparse or binary trace of a backing, repeatable\n");
+	fprintf(stdout, "                   -m, --mrc <file>             Miss-ratio curves, lines of \"<bid> <segs> <miss_ratio> [<accesses>]\"\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s plan -c 0 -t 0=/var/tmp/b0.trace -t 1=/var/tmp/b1.trace\n\n", PCACHE_PROGRAM_NAME);
+
+	fprintf(stdout, "Monitoring:\n");
+	fprintf(stdout, "   exporter        Serve counters in Prometheus text format\n");
+	fprintf(stdout, "                   -l, --listen <addr>          unix:<path>, <port> or <127.x.y.z>:<port> (default: %s)\n",
+		PCACHE_EXPORTER_LISTEN_DEFAULT);
+	fprintf(stdout, "                   -i, --interval <seconds>     sysfs refresh interval (default: %u)\n",
+		PCACHE_EXPORTER_INTERVAL_DEFAULT);
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s exporter -l 9436 -i 5\n\n", PCACHE_PROGRAM_NAME);
+
+	fprintf(stdout, "   shm-publish     Publish counters to a shared memory segment for lock-free readers\n");
+	fprintf(stdout, "                   -p, --path <path>            Segment path (default: %s)\n", PCACHESHM_PATH_DEFAULT);
+	fprintf(stdout, "                   -i, --interval <seconds>     sysfs refresh interval (default: %u)\n",
+		PCACHE_EXPORTER_INTERVAL_DEFAULT);
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s shm-publish -i 1\n\n", PCACHE_PROGRAM_NAME);
+
+	fprintf(stdout, "Load generation:\n");
+	fprintf(stdout, "   replay          Replay a blkparse or binary block trace with io_uring\n");
+	fprintf(stdout, "                   -t, --trace <file>           blkparse text output or binary trace\n");
+	fprintf(stdout, "                   -d, --dev <id>               Target /dev/pcache<id>\n");
+	fprintf(stdout, "                   -p, --path <path>            Target device or stand-in file\n");
+	fprintf(stdout, "                   --speed <factor|max>         Timing relative to the trace (default: 1)\n");
+	fprintf(stdout, "                   -q, --queues <n>             Submission threads, each an LBA shard (default: 1)\n");
+	fprintf(stdout, "                   --depth <n>                  Queue depth per thread (default: %u)\n",
+		PCACHE_REPLAY_DEPTH_DEFAULT);
+	fprintf(stdout, "                   -i, --interval <seconds>     Report interval (default: %u)\n",
+		PCACHE_EXPORTER_INTERVAL_DEFAULT);
+	fprintf(stdout, "                   -F, --force                  Allow replaying onto a block device\n");
+	fprintf(stdout, "                   -o, --output <file>          Convert the trace to binary instead of replaying\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s replay -t sda.blkparse -d 0 -q 4 --speed 2 -F\n\n", PCACHE_PROGRAM_NAME);
+
+	fprintf(stdout, "Device qualification:\n");
+	fprintf(stdout, "   pmem-bench      Measure PMem bandwidth and persist latency per NUMA node, overwrites the device\n");
+	fprintf(stdout, "                   -p, --path <path>            PMem device, DAX file or regular file\n");
+	fprintf(stdout, "                   -q, --queues <n>             Threads per NUMA node (default: 1)\n");
+	fprintf(stdout, "                   --threshold <name>=<value>   Override limits: seq_read, rand_read, nt_write, flush_write (MB/s),\n");
+	fprintf(stdout, "                                                persist_64b, persist_4k (p99 us), comma separated\n");
+	fprintf(stdout, "                   --warn                       Only warn when a limit is missed (default: fail)\n");
+	fprintf(stdout, "                   -F, --force                  Allow block devices and existing caches\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s pmem-bench -p /dev/dax0.0 -q 4 -F\n\n", PCACHE_PROGRAM_NAME);
+
+	fprintf(stdout, "Automation:\n");
+	fprintf(stdout, "   serve           Answer newline-delimited JSON requests: start, stop, list, find\n");
+	fprintf(stdout, "                   --stdio                      Read requests from stdin, reply on stdout\n");
+	fprintf(stdout, "                   -l, --listen <addr>          unix:<path> (default: %s)\n",
+		PCACHE_SERVE_LISTEN_DEFAULT);
+	fprintf(stdout, "                   -q, --queues <n>             Worker threads (default: %u)\n",
+		PCACHE_SERVE_WORKERS_DEFAULT);
+	fprintf(stdout, "                   -i, --interval <seconds>     Max age of the cached inventory (default: %u)\n",
+		PCACHE_EXPORTER_INTERVAL_DEFAULT);
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s serve --stdio\n\n", PCACHE_PROGRAM_NAME);
 }
 
 static void pcache_options_init(pcache_opt_t* options)
@@ -95,6 +193,26 @@ static struct option long_options[] =
 	{"cache-size", required_argument,0, 's'},
 	{"force", no_argument, 0, 'F'},
 	{"data-crc", no_argument, 0, 'x'},
+	{"wait", required_argument, 0, 'w'},
+	{"trace", required_argument, 0, 't'},
+	{"mrc", required_argument, 0, 'm'},
+	{"listen", required_argument, 0, 'l'},
+	{"interval", required_argument, 0, 'i'},
+	{"engine", required_argument, 0, 'e'},
+	{"assemble", no_argument, 0, 'A'},
+	{"dry-run", no_argument, 0, 'r'},
+	{"dev", required_argument, 0, 'd'},
+	{"speed", required_argument, 0, 'S'},
+	{"depth", required_argument, 0, 'Q'},
+	{"output", required_argument, 0, 'o'},
+	{"sample", required_argument, 0, 'T'},
+	{"bench", no_argument, 0, 'B'},
+	{"warn", no_argument, 0, 'W'},
+	{"threshold", required_argument, 0, 'K'},
+	{"from", required_argument, 0, 'I'},
+	{"to", required_argument, 0, 'O'},
+	{"journal", required_argument, 0, 'J'},
+	{"stdio", no_argument, 0, 'Z'},
 	{0, 0, 0, 0},
 };
 
@@ -129,6 +247,7 @@ unsigned int opt_to_MB(const char *input)
 void pcache_options_parser(int argc, char* argv[], pcache_opt_t* options)
 {
 	int arg; /* Current option */
+	unsigned long ul;
 
 	if (argc < 2) {
 		usage();
@@ -139,7 +258,14 @@ void pcache_options_parser(int argc, char* argv[], pcache_opt_t* options)
 	options->co_backing_id = UINT_MAX;
 	options->co_dev_id = UINT_MAX;
 	options->co_cache_id = 0;
-	options->co_queues = 1;
+	options->co_queues = options->co_cmd == CCT_SERVE ? PCACHE_SERVE_WORKERS_DEFAULT : 1;
+	options->co_lock_timeout = PCACHE_LOCK_TIMEOUT_DEFAULT;
+	options->co_interval = PCACHE_EXPORTER_INTERVAL_DEFAULT;
+	strcpy(options->co_listen, options->co_cmd == CCT_SERVE ? PCACHE_SERVE_LISTEN_DEFAULT :
+	       PCACHE_EXPORTER_LISTEN_DEFAULT);
+	options->co_engine = PCACHESNAP_ENGINE_SYNC;
+	options->co_speed = 1.0;
+	options->co_depth = PCACHE_REPLAY_DEPTH_DEFAULT;
 
 	if (options->co_cmd == CCT_INVALID) {
 		usage();
@@ -149,7 +275,7 @@ void pcache_options_parser(int argc, char* argv[], pcache_opt_t* options)
 	while (true) {
 		int option_index = 0;
 
-		arg = getopt_long(argc, argv, "a:h:c:H:b:d:p:q:f:s:n:D:F", long_options, &option_index);
+		arg = getopt_long(argc, argv, "a:h:c:H:b:d:p:q:f:s:n:D:Fw:t:m:l:i:e:o:", long_options, &option_index);
 		/* End of the options? */
 		if (arg == -1) {
 			break;
@@ -191,8 +317,110 @@ void pcache_options_parser(int argc, char* argv[], pcache_opt_t* options)
 			options->co_queues = strtoul(optarg, NULL, 10);
 			break;
 		case 's':
+			if (strncmp(optarg, "auto", 4) == 0 && (optarg[4] == '\0' || optarg[4] == ':')) {
+				char *endptr = NULL;
+
+				options->co_cache_size_auto = true;
+				options->co_cache_fraction = 0;	/* not given */
+				if (optarg[4] == ':')
+					options->co_cache_fraction = strtod(optarg + 5, &endptr);
+				if (endptr && (*endptr || options->co_cache_fraction <= 0 ||
+					       options->co_cache_fraction > 1)) {
+					printf("invalid cache size fraction: %s\n", optarg);
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
 			options->co_cache_size = opt_to_MB(optarg);
 			break;
+		case 'T':
+			options->co_sample = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			options->co_bench = true;
+			break;
+		case 'W':
+			options->co_warn = true;
+			break;
+		case 'K':
+			strncpy(options->co_thresholds, optarg, sizeof(options->co_thresholds) - 1);
+			break;
+		case 'I':
+			strncpy(options->co_from, optarg, sizeof(options->co_from) - 1);
+			break;
+		case 'O':
+			strncpy(options->co_to, optarg, sizeof(options->co_to) - 1);
+			break;
+		case 'J':
+			strncpy(options->co_journal, optarg, sizeof(options->co_journal) - 1);
+			break;
+		case 'Z':
+			options->co_stdio = true;
+			break;
+		case 'w':
+			/* saturate, the lock functions take an int of milliseconds */
+			ul = strtoul(optarg, NULL, 10);
+			options->co_lock_timeout = ul > PCACHE_LOCK_TIMEOUT_MAX ? PCACHE_LOCK_TIMEOUT_MAX : ul;
+			break;
+		case 't':
+			/* plan takes one trace per backing */
+			if (options->co_cmd == CCT_PLAN) {
+				if (options->co_nr_plan_traces == PCACHE_BACKING_HANDLERS_MAX) {
+					printf("at most %d --trace\n", PCACHE_BACKING_HANDLERS_MAX);
+					exit(EXIT_FAILURE);
+				}
+				options->co_plan_traces[options->co_nr_plan_traces++] = optarg;
+				break;
+			}
+			strncpy(options->co_trace_path, optarg, sizeof(options->co_trace_path) - 1);
+			break;
+		case 'm':
+			strncpy(options->co_mrc_path, optarg, sizeof(options->co_mrc_path) - 1);
+			break;
+		case 'l':
+			strncpy(options->co_listen, optarg, sizeof(options->co_listen) - 1);
+			break;
+		case 'i':
+			options->co_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			if (strcmp(optarg, "max") == 0) {
+				options->co_speed = 0;
+			} else {
+				options->co_speed = strtod(optarg, NULL);
+				if (options->co_speed <= 0) {
+					printf("invalid speed: %s\n", optarg);
+					usage();
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case 'Q':
+			options->co_depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			strncpy(options->co_output, optarg, sizeof(options->co_output) - 1);
+			break;
+		case 'A':
+			options->co_assemble = true;
+			break;
+		case 'r':
+			options->co_dry_run = true;
+			break;
+		case 'e':
+			if (strcmp(optarg, "auto") == 0) {
+				options->co_engine = PCACHESNAP_ENGINE_AUTO;
+			} else if (strcmp(optarg, "uring") == 0) {
+				options->co_engine = PCACHESNAP_ENGINE_URING;
+			} else if (strcmp(optarg, "sync") == 0) {
+				options->co_engine = PCACHESNAP_ENGINE_SYNC;
+			} else {
+				printf("invalid engine: %s\n", optarg);
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case '?':
 			usage();
 			exit(EXIT_FAILURE);
@@ -204,102 +432,281 @@ void pcache_options_parser(int argc, char* argv[], pcache_opt_t* options)
 	}
 }
 
-void trim_newline(char *str) {
-	size_t len = strlen(str);
-	if (len > 0 && str[len - 1] == '\n') {
-		str[len - 1] = '\0';
-	}
-}
-
-json_t *pcache_cache_to_json(struct pcache_cache *pcache_cache) {
+json_t *pcache_cache_to_json(const struct pcachesnap *snap, int idx)
+{
 	/* Create a new JSON object */
 	json_t *json_obj = json_object();
 
-	/* Remove trailing newline from path */
-	trim_newline(pcache_cache->path);
-
 	/* Format magic as a hexadecimal string */
 	char magic_str[19]; // 16 digits + "0x" prefix + null terminator
-	snprintf(magic_str, sizeof(magic_str), "0x%016lx", pcache_cache->magic);
+	snprintf(magic_str, sizeof(magic_str), "0x%016lx", snap->caches.magic[idx]);
 
 	char flags_str[11]; // 8 digits + "0x" prefix + null terminator
-	snprintf(flags_str, sizeof(flags_str), "0x%08x", pcache_cache->flags);
+	snprintf(flags_str, sizeof(flags_str), "0x%08x", snap->caches.flags[idx]);
 
 	/* Add each field to the JSON object */
 	json_object_set_new(json_obj, "magic", json_string(magic_str));
 
-	json_object_set_new(json_obj, "version", json_integer(pcache_cache->version));
+	json_object_set_new(json_obj, "version", json_integer(snap->caches.version[idx]));
 	json_object_set_new(json_obj, "flags", json_string(flags_str));
-	json_object_set_new(json_obj, "segment_num", json_integer(pcache_cache->segment_num));
-	json_object_set_new(json_obj, "cache_id", json_integer(pcache_cache->cache_id));
+	json_object_set_new(json_obj, "segment_num", json_integer(snap->caches.segment_num[idx]));
+	json_object_set_new(json_obj, "cache_id", json_integer(snap->caches.cache_id[idx]));
 
 	/* Add path as a JSON string */
-	json_object_set_new(json_obj, "path", json_string(pcache_cache->path));
+	json_object_set_new(json_obj, "path", json_string(pcachesnap_str(snap, snap->caches.path[idx])));
 
 	return json_obj;
 }
 
+json_t *pcache_backing_to_json(const struct pcachesnap *snap, int idx)
+{
+	char logic_dev_path[PCACHE_PATH_LEN];
+	json_t *json_backing = json_object();
+
+	pcachesnap_logic_dev_path(snap, idx, logic_dev_path, sizeof(logic_dev_path));
+
+	json_object_set_new(json_backing, "backing_id", json_integer(snap->backings.backing_id[idx]));
+	json_object_set_new(json_backing, "backing_path", json_string(pcachesnap_str(snap, snap->backings.backing_path[idx])));
+	json_object_set_new(json_backing, "cache_segs", json_integer(snap->backings.cache_segs[idx]));
+	json_object_set_new(json_backing, "cache_gc_percent", json_integer(snap->backings.cache_gc_percent[idx]));
+	json_object_set_new(json_backing, "cache_used_segs", json_integer(snap->backings.cache_used_segs[idx]));
+	json_object_set_new(json_backing, "logic_dev", json_string(logic_dev_path));
+
+	return json_backing;
+}
+
+int pcache_cache_register(const char *path, bool force, bool format)
+{
+	char tr_buff[PCACHE_PATH_LEN*3] = {0};
+	char sysfs_path[PCACHE_PATH_LEN];
+
+	sprintf(tr_buff, "path=%s,force=%d,format=%d", path, force, format);
+
+	sysfs_pcache_path(SYSFS_PCACHE_CACHE_REGISTER, sysfs_path, sizeof(sysfs_path));
+	return pcachesys_write_value(sysfs_path, tr_buff);
+}
+
+/* Compare paths with digit runs as numbers, so pmem2 sorts before pmem10 */
+static int natural_cmp(const char *a, const char *b)
+{
+	size_t la, lb;
+
+	while (*a && *b) {
+		if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+			while (*a == '0')
+				a++;
+			while (*b == '0')
+				b++;
+			la = strspn(a, "0123456789");
+			lb = strspn(b, "0123456789");
+			if (la != lb)
+				return la < lb ? -1 : 1;
+			if (strncmp(a, b, la))
+				return strncmp(a, b, la);
+			a += la;
+			b += lb;
+			continue;
+		}
+		if (*a != *b)
+			return (unsigned char)*a - (unsigned char)*b;
+		a++;
+		b++;
+	}
+
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+static int probe_path_cmp(const void *a, const void *b)
+{
+	return natural_cmp(((const struct pcachedev_probe *)a)->path,
+			   ((const struct pcachedev_probe *)b)->path);
+}
+
+/*
+ * Register every cache found on the devices matching opt->co_path (default
+ * PCACHE_ASSEMBLE_DEVICES), never formatting. Headers are probed in parallel,
+ * registration happens in natural path order under the registration lock.
+ */
+static int pcache_cache_assemble(pcache_opt_t *opt)
+{
+	const char *pattern = strlen(opt->co_path) ? opt->co_path : PCACHE_ASSEMBLE_DEVICES;
+	struct pcachedev_probe *probes = NULL;
+	struct pcachesys_lock lock = { .fd = -1 };
+	struct pcachesnap snap;
+	const char *status;
+	json_t *array, *obj;
+	unsigned int nr = 0, i;
+	int ret, err, idx;
+	glob_t g;
+
+	ret = pcachesnap_init(&snap);
+	if (ret)
+		return ret;
+
+	array = json_array();
+
+	ret = glob(pattern, 0, NULL, &g);
+	if (ret == 0) {
+		nr = g.gl_pathc;
+	} else if (ret != GLOB_NOMATCH) {
+		printf("failed to expand %s\n", pattern);
+		ret = -EINVAL;
+		goto free_glob;
+	}
+
+	if (nr) {
+		probes = calloc(nr, sizeof(*probes));
+		if (!probes) {
+			ret = -ENOMEM;
+			goto free_glob;
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		strncpy(probes[i].path, g.gl_pathv[i], sizeof(probes[i].path) - 1);
+
+	pcachedev_probe_all(probes, nr, PCACHE_ASSEMBLE_THREADS);
+	qsort(probes, nr, sizeof(*probes), probe_path_cmp);
+
+	if (!opt->co_dry_run) {
+		ret = pcachesys_lock_cache(&lock, PCACHESYS_LOCK_REGISTER, true, opt->co_lock_timeout * 1000);
+		if (ret)
+			goto free_probes;
+	}
+
+	/* under the registration lock, so the list cannot change under us */
+	snap.engine = opt->co_engine;
+	ret = pcachesnap_collect(&snap, PCACHESNAP_ALL_CACHES);
+	if (ret)
+		goto unlock;
+
+	for (i = 0; i < nr; i++) {
+		struct pcachedev_probe *probe = &probes[i];
+
+		obj = json_object();
+		json_object_set_new(obj, "path", json_string(probe->path));
+
+		idx = -1;
+		if (probe->status == PCACHEDEV_VALID) {
+			json_object_set_new(obj, "version", json_integer(probe->version));
+			json_object_set_new(obj, "segment_num", json_integer(probe->segment_num));
+			idx = pcachesnap_find_cache_path(&snap, probe->path);
+		}
+
+		if (probe->status != PCACHEDEV_VALID) {
+			status = "skipped";
+			json_object_set_new(obj, "reason", json_string(pcachedev_status_str(probe)));
+		} else if (idx >= 0) {
+			status = "already-registered";
+			json_object_set_new(obj, "cache_id", json_integer(snap.caches.cache_id[idx]));
+		} else if (opt->co_dry_run) {
+			status = "would-register";
+		} else {
+			err = pcache_cache_register(probe->path, false, false);
+			if (err) {
+				status = "failed";
+				ret = err;
+			} else {
+				status = "assembled";
+			}
+		}
+		json_object_set_new(obj, "status", json_string(status));
+		json_array_append_new(array, obj);
+	}
+
+	char *json_str = json_dumps(array, JSON_INDENT(4));
+	printf("%s\n", json_str);
+	free(json_str);
+unlock:
+	pcachesys_unlock(&lock);
+free_probes:
+	free(probes);
+free_glob:
+	globfree(&g);
+	json_decref(array);
+	pcachesnap_free(&snap);
+
+	return ret;
+}
+
 int pcache_cache_start(pcache_opt_t *opt)
 {
 	int ret = 0;
-	char tr_buff[PCACHE_PATH_LEN*3] = {0};
-	struct sysfs_attribute *sysattr = NULL;
+	struct pcachesys_lock lock;
+
+	if (opt->co_assemble)
+		return pcache_cache_assemble(opt);
 
 	if (strlen(opt->co_path) == 0) {
 		printf("path is null!\n");
 		return -EINVAL;
 	}
 
-	sprintf(tr_buff, "path=%s,force=%d,format=%d",
-		opt->co_path, opt->co_force, opt->co_format);
+	if (opt->co_bench) {
+		ret = pcache_pmem_qualify(opt);
+		if (ret)
+			return ret;
+	}
+
+	/* the new cache has no ID yet, serialise against other registrations */
+	ret = pcachesys_lock_cache(&lock, PCACHESYS_LOCK_REGISTER, true, opt->co_lock_timeout * 1000);
+	if (ret)
+		return ret;
+
+	ret = pcache_cache_register(opt->co_path, opt->co_force, opt->co_format);
+	pcachesys_unlock(&lock);
 
-	return pcachesys_write_value(SYSFS_PCACHE_CACHE_REGISTER, tr_buff);
+	return ret;
 }
 
-int pcache_cache_stop(pcache_opt_t *opt)
+int pcache_cache_unregister(unsigned int cache_id)
 {
-	int ret = 0;
 	char tr_buff[PCACHE_PATH_LEN*3] = {0};
+	char sysfs_path[PCACHE_PATH_LEN];
 
-	sprintf(tr_buff, "cache_dev_id=%u", opt->co_cache_id);
+	sprintf(tr_buff, "cache_dev_id=%u", cache_id);
 
-	return pcachesys_write_value(SYSFS_PCACHE_CACHE_UNREGISTER, tr_buff);
+	sysfs_pcache_path(SYSFS_PCACHE_CACHE_UNREGISTER, sysfs_path, sizeof(sysfs_path));
+	return pcachesys_write_value(sysfs_path, tr_buff);
 }
 
-static int cache_dev_list_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+int pcache_cache_stop(pcache_opt_t *opt)
 {
-	unsigned int cache_dev_id;
-	struct pcache_cache pcache_cache;
-	json_t *array = walk_ctx->data;
-	json_t *json_obj;
-	int ret;
+	int ret = 0;
+	struct pcachesys_lock lock;
 
-	cache_dev_id = strtoul(entry->d_name + strlen("cache_dev"), NULL, 10);
-	ret = pcachesys_cache_init(&pcache_cache, cache_dev_id);
+	ret = pcachesys_lock_cache(&lock, opt->co_cache_id, true, opt->co_lock_timeout * 1000);
 	if (ret)
 		return ret;
 
-	json_obj = pcache_cache_to_json(&pcache_cache);
-	json_array_append_new(array, json_obj);
+	ret = pcache_cache_unregister(opt->co_cache_id);
+	pcachesys_unlock(&lock);
 
-	return 0;
+	return ret;
 }
 
 int pcache_cache_list(pcache_opt_t *opt)
 {
-	char tr_buff[PCACHE_PATH_LEN * 3] = {0};
-	struct pcache_cache pcache_cache;
-	json_t *array = json_array();
-	int ret = 0;
-	struct pcachesys_walk_ctx walk_ctx = { 0 };
+	struct pcachesnap snap;
+	json_t *array;
+	unsigned int i;
+	int ret;
 
-	walk_ctx.cb = cache_dev_list_cb;
-	walk_ctx.data = array;
-	strcpy(walk_ctx.path, SYSFS_PCACHE_DEVICES_PATH);
-	ret = walk_cache_devs(&walk_ctx);
+	ret = pcachesnap_init(&snap);
+	if (ret)
+		return ret;
+
+	array = json_array();
+
+	snap.lock_timeout = opt->co_lock_timeout * 1000;
+	snap.engine = opt->co_engine;
+	ret = pcachesnap_collect(&snap, PCACHESNAP_ALL_CACHES);
 	if (ret)
 		goto err;
 
+	for (i = 0; i < snap.caches.nr; i++)
+		json_array_append_new(array, pcache_cache_to_json(&snap, i));
+
 	// Print the JSON array
 	char *json_str = json_dumps(array, JSON_INDENT(4));
 	printf("%s\n", json_str);
@@ -308,6 +715,7 @@ int pcache_cache_list(pcache_opt_t *opt)
 err:
 	// Clean up
 	json_decref(array);
+	pcachesnap_free(&snap);
 
 	return ret;
 }
@@ -341,48 +749,220 @@ static int find_backing_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk
 	return 0;
 }
 
-int pcache_backing_start(pcache_opt_t *options) {
+/*
+ * Feed the backing's sample, a trace file or a live blktrace window, to the
+ * working-set sketch. Without either the sketch stays empty; a sample that
+ * saw no I/O is an error rather than an empty sketch.
+ */
+static int backing_sample_wss(pcache_opt_t *options, struct pcachewss *wss)
+{
+	struct pcachetrace trace;
+	struct pcachetrace_io io;
+	int ret;
+
+	pcachewss_init(wss);
+
+	if (strlen(options->co_trace_path))
+		ret = pcachetrace_open(&trace, options->co_trace_path);
+	else if (options->co_sample)
+		ret = pcachetrace_blktrace(&trace, options->co_path, options->co_sample);
+	else
+		return 0;
+	if (ret)
+		return ret;
+
+	while ((ret = pcachetrace_next(&trace, &io)) > 0)
+		pcachewss_add(wss, io.offset, io.len);
+
+	if (pcachetrace_close(&trace) && !ret) {
+		printf("failed to sample %s with blktrace\n", options->co_path);
+		ret = -EIO;
+	}
+	if (ret)
+		return ret;
+
+	/* an empty sample would silently size the backing as if there were none */
+	if (!wss->accesses) {
+		if (strlen(options->co_trace_path))
+			printf("trace %s has no read or write I/O to size the cache from\n",
+			       options->co_trace_path);
+		else
+			printf("no I/O on %s during the %u second sample\n",
+			       options->co_path, options->co_sample);
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+/*
+ * cache_size for --cache-size auto. The ceiling is the requested fraction of
+ * the segments not yet assigned to the cache's other backings, so one backing
+ * cannot starve the next. With a sample the backing gets its working set at
+ * the knee of the curve, below that ceiling; without one, the whole ceiling.
+ * Called with the cache lock held.
+ */
+static int backing_auto_size(pcache_opt_t *options, struct pcachewss *wss, unsigned int *size)
+{
+	struct pcachesnap snap;
+	struct pcachewss_point knee;
+	unsigned int assigned = 0, free_segs, cap, segs;
+	double fraction, want;
+	int first, nr, idx, i;
+	bool has_knee;
+	int ret;
+
+	ret = pcachesnap_init(&snap);
+	if (ret)
+		return ret;
+
+	/* lock_timeout stays -1, the caller already holds the cache exclusively */
+	snap.engine = options->co_engine;
+	ret = pcachesnap_collect(&snap, options->co_cache_id);
+	if (ret)
+		goto out;
+
+	idx = pcachesnap_find_cache(&snap, options->co_cache_id);
+	if (idx < 0) {
+		printf("cache %u not found\n", options->co_cache_id);
+		ret = -ENOENT;
+		goto out;
+	}
+
+	nr = pcachesnap_cache_backings(&snap, options->co_cache_id, &first);
+	for (i = first; i < first + nr; i++)
+		assigned += snap.backings.cache_segs[i];
+
+	free_segs = snap.caches.segment_num[idx] > assigned ? snap.caches.segment_num[idx] - assigned : 0;
+	/* with a sample the knee sizes the backing, the ceiling defaults to all */
+	fraction = options->co_cache_fraction ? options->co_cache_fraction : 1.0;
+	cap = free_segs * fraction;
+	if (!free_segs) {
+		printf("cache %u has no free segments: %u of %u assigned\n", options->co_cache_id,
+		       assigned, snap.caches.segment_num[idx]);
+		ret = -ENOSPC;
+		goto out;
+	}
+	if (!cap) {
+		printf("%g of the %u free segments of cache %u is less than one segment\n",
+		       fraction, free_segs, options->co_cache_id);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	segs = cap;
+	if (wss->accesses) {
+		has_knee = pcachewss_knee(wss, &knee);
+		/* whole segments, and never nothing; clamp before converting, the estimate is unbounded */
+		want = ceil(knee.blocks / (PCACHE_SEG_SIZE_MB << (20 - PCACHEWSS_BLOCK_SHIFT)));
+		segs = want > cap ? cap : want < 1 ? 1 : want;
+
+		fprintf(stderr, "cache_size auto: %u free segments, cap %u; working set %.0f blocks %s %lu of %lu accesses: %u segments\n",
+			free_segs, cap, knee.blocks, has_knee ? "at knee" : "after",
+			(unsigned long)knee.accesses, (unsigned long)wss->accesses, segs);
+	} else {
+		fprintf(stderr, "cache_size auto: %u free segments, cap %u; no sample: %u segments\n",
+			free_segs, cap, segs);
+	}
+
+	*size = segs * PCACHE_SEG_SIZE_MB;
+out:
+	pcachesnap_free(&snap);
+	return ret;
+}
+
+/* Ask the cache to start a backing, cache_size 0 for the kernel's default */
+int pcache_backing_adm_start(unsigned int cache_id, const char *path, unsigned int queues,
+			     unsigned int cache_size, bool data_crc)
+{
 	char adm_path[PCACHE_PATH_LEN];
 	char cmd[PCACHE_PATH_LEN * 3] = { 0 };
+
+	snprintf(cmd, sizeof(cmd), "op=backing-start,path=%s,queues=%u", path, queues);
+
+	if (cache_size != 0)
+	    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",cache_size=%u", cache_size);
+
+	if (data_crc)
+		snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",data_crc=1");
+
+	cache_adm_path(cache_id, adm_path, sizeof(adm_path));
+	return pcachesys_write_value(adm_path, cmd);
+}
+
+int pcache_backing_adm_stop(unsigned int cache_id, unsigned int backing_id)
+{
+	char adm_path[PCACHE_PATH_LEN];
+	char cmd[PCACHE_PATH_LEN * 3] = { 0 };
+
+	snprintf(cmd, sizeof(cmd), "op=backing-stop,backing_id=%u", backing_id);
+
+	cache_adm_path(cache_id, adm_path, sizeof(adm_path));
+	return pcachesys_write_value(adm_path, cmd);
+}
+
+int pcache_backing_start(pcache_opt_t *options) {
 	struct pcache_cache pcache_cache;
 	struct pcachesys_walk_ctx walk_ctx = { 0 };
 	struct find_backing_ctx_data ctx_data = { 0 };
+	struct pcachesys_lock lock;
+	struct pcachewss *wss = NULL;
 	unsigned int backing_id;
 	int ret;
 
-	pcachesys_cache_init(&pcache_cache, options->co_cache_id);
+	/* sample before locking, a live window can take a while */
+	if (options->co_cache_size_auto) {
+		/* without a sample nothing bounds one backing but the fraction */
+		if (!options->co_cache_fraction && !strlen(options->co_trace_path) && !options->co_sample) {
+			printf("--cache-size auto without --trace or --sample needs a fraction, e.g. auto:0.25\n");
+			return -EINVAL;
+		}
 
-	snprintf(cmd, sizeof(cmd), "op=backing-start,path=%s,queues=%u", options->co_path, options->co_queues);
+		wss = malloc(sizeof(*wss));
+		if (!wss)
+			return -ENOMEM;
 
-	if (options->co_cache_size != 0)
-	    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",cache_size=%u", options->co_cache_size);
+		ret = backing_sample_wss(options, wss);
+		if (ret)
+			goto free_wss;
+	}
 
-	if (options->co_data_crc)
-		snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",data_crc=1");
+	/* hold the cache exclusively across the adm write and the lookup walk */
+	ret = pcachesys_lock_cache(&lock, options->co_cache_id, true, options->co_lock_timeout * 1000);
+	if (ret)
+		goto free_wss;
 
-	cache_adm_path(options->co_cache_id, adm_path, sizeof(adm_path));
-	ret = pcachesys_write_value(adm_path, cmd);
+	pcachesys_cache_init(&pcache_cache, options->co_cache_id);
+
+	if (options->co_cache_size_auto) {
+		ret = backing_auto_size(options, wss, &options->co_cache_size);
+		if (ret)
+			goto unlock;
+	}
+
+	ret = pcache_backing_adm_start(options->co_cache_id, options->co_path, options->co_queues,
+				       options->co_cache_size, options->co_data_crc);
 	if (ret)
-		return ret;
+		goto unlock;
 
 	ctx_data.path = options->co_path;
 	ctx_data.pcache_cache = &pcache_cache;
 
 	walk_ctx.data = &ctx_data;
 	walk_ctx.cb = find_backing_cb;
-	sprintf(walk_ctx.path, SYSFS_CACHE_BASE_PATH"%u", options->co_cache_id);
+	cache_dir_path(options->co_cache_id, walk_ctx.path, sizeof(walk_ctx.path));
 
 	ret = walk_backing_devs(&walk_ctx);
-	if (ret)
-		return ret;
-
-	return 0;
+unlock:
+	pcachesys_unlock(&lock);
+free_wss:
+	free(wss);
+	return ret;
 }
 
 int pcache_backing_stop(pcache_opt_t *options) {
 	struct pcache_cache pcache_cache;
-	char adm_path[PCACHE_PATH_LEN];
-	char cmd[PCACHE_PATH_LEN * 3] = { 0 };
+	struct pcachesys_lock lock;
 	int ret;
 
 	if (options->co_backing_id == UINT_MAX) {
@@ -390,86 +970,240 @@ int pcache_backing_stop(pcache_opt_t *options) {
 		return -EINVAL;
 	}
 
+	ret = pcachesys_lock_cache(&lock, options->co_cache_id, true, options->co_lock_timeout * 1000);
+	if (ret)
+		return ret;
+
 	ret = pcachesys_cache_init(&pcache_cache, options->co_cache_id);
 	if (ret) {
 		printf("tranposrt for id %u not found.", options->co_cache_id);
-		return ret;
+		goto unlock;
 	}
 
-	snprintf(cmd, sizeof(cmd), "op=backing-stop,backing_id=%u", options->co_backing_id);
-
-	cache_adm_path(options->co_cache_id, adm_path, sizeof(adm_path));
-	return pcachesys_write_value(adm_path, cmd);
+	ret = pcache_backing_adm_stop(options->co_cache_id, options->co_backing_id);
+unlock:
+	pcachesys_unlock(&lock);
+	return ret;
 }
 
-struct backing_list_ctx_data {
-	json_t *array;
-	struct pcache_cache *pcache_cache;
-};
-
-static int backing_dev_list_cb(struct dirent *entry, struct pcachesys_walk_ctx *walk_ctx)
+int pcache_backing_list(pcache_opt_t *options)
 {
-	unsigned int backing_dev_id;
-	struct backing_list_ctx_data *data = walk_ctx->data;
-	json_t *array = data->array;
-	struct pcache_cache *pcache_cache = data->pcache_cache;
-	struct pcache_backing backing;
-	json_t *json_obj;
+	struct pcachesnap snap;
+	int first, nr, i;
 	int ret;
 
-	backing_dev_id = strtoul(entry->d_name + strlen("backing_dev"), NULL, 10);
-	ret = pcachesys_backing_init(pcache_cache, &backing, backing_dev_id); // Initialize current backing
-	if (ret < 0) {
-		printf("failed to init backing: %s\n", strerror(ret));
+	ret = pcachesnap_init(&snap);
+	if (ret)
 		return ret;
+
+	json_t *array = json_array(); // Create JSON array for backings
+	if (array == NULL) {
+		fprintf(stderr, "Error creating JSON array\n");
+		pcachesnap_free(&snap);
+		return -1;
 	}
 
-	json_t *json_backing = json_object();
-	json_object_set_new(json_backing, "backing_id", json_integer(backing.backing_id));
-	json_object_set_new(json_backing, "backing_path", json_string(backing.backing_path));
-	json_object_set_new(json_backing, "cache_segs", json_integer(backing.cache_segs));
-	json_object_set_new(json_backing, "cache_gc_percent", json_integer(backing.cache_gc_percent));
-	json_object_set_new(json_backing, "cache_used_segs", json_integer(backing.cache_used_segs));
-	json_object_set_new(json_backing, "logic_dev", json_string(backing.logic_dev_path));
+	snap.lock_timeout = options->co_lock_timeout * 1000;
+	snap.engine = options->co_engine;
+	ret = pcachesnap_collect(&snap, options->co_cache_id);
+	if (ret)
+		goto err;
 
-	json_array_append_new(array, json_backing);
+	nr = pcachesnap_cache_backings(&snap, options->co_cache_id, &first);
+	for (i = first; i < first + nr; i++)
+		json_array_append_new(array, pcache_backing_to_json(&snap, i));
 
-	return 0;
+	// Convert JSON array to a formatted string and print to stdout
+	char *json_str = json_dumps(array, JSON_INDENT(4));
+	printf("%s\n", json_str);
+	free(json_str);
+err:
+	json_decref(array); // Free JSON array memory
+	pcachesnap_free(&snap);
+	return ret;
 }
 
-int pcache_backing_list(pcache_opt_t *options)
+static const char *plan_source_name(enum pcacheplan_source source)
 {
-	struct pcache_cache pcache_cache;
-	struct pcachesys_walk_ctx walk_ctx = { 0 };
-	struct backing_list_ctx_data ctx_data = { 0 };
+	switch (source) {
+	case PCACHEPLAN_SRC_TRACE:
+		return "trace";
+	case PCACHEPLAN_SRC_MRC:
+		return "mrc";
+	default:
+		return "usage";
+	}
+}
 
-	json_t *array = json_array(); // Create JSON array for backings
-	if (array == NULL) {
-		fprintf(stderr, "Error creating JSON array\n");
-		return -1;
+int pcache_plan(pcache_opt_t *options)
+{
+	struct pcachesnap snap;
+	struct pcacheplan plan;
+	double total_hits = 0, total_accesses = 0;
+	char size_str[32];
+	json_t *result, *array;
+	int first, nr, i, cache_idx;
+	int ret;
+
+	if (!options->co_nr_plan_traces && !strlen(options->co_mrc_path)) {
+		printf("--trace or --mrc required for plan command\n");
+		return -EINVAL;
 	}
 
-	int ret = pcachesys_cache_init(&pcache_cache, options->co_cache_id);
-	if (ret < 0)
-		goto err;
+	ret = pcachesnap_init(&snap);
+	if (ret)
+		return ret;
 
-	ctx_data.array = array;
-	ctx_data.pcache_cache = &pcache_cache;
+	pcacheplan_init(&plan, 1);
 
-	walk_ctx.data = &ctx_data;
-	walk_ctx.cb = backing_dev_list_cb;
-	sprintf(walk_ctx.path, SYSFS_CACHE_BASE_PATH"%u", options->co_cache_id);
+	snap.lock_timeout = options->co_lock_timeout * 1000;
+	snap.engine = options->co_engine;
+	ret = pcachesnap_collect(&snap, options->co_cache_id);
+	if (ret)
+		goto out;
 
+	cache_idx = pcachesnap_find_cache(&snap, options->co_cache_id);
+	if (cache_idx < 0) {
+		ret = -ENOENT;
+		goto out;
+	}
 
-	ret = walk_backing_devs(&walk_ctx);
+	/* backings without a trace or curve keep what they use today */
+	nr = pcachesnap_cache_backings(&snap, options->co_cache_id, &first);
+	for (i = first; i < first + nr; i++) {
+		/* a plan leaving backings out would hand their segments to the others */
+		if (!pcacheplan_add_backing(&plan, snap.backings.backing_id[i], snap.backings.cache_used_segs[i])) {
+			printf("cache %u has %d backings, plan handles at most %d, %d left out\n",
+			       options->co_cache_id, nr, PCACHE_BACKING_HANDLERS_MAX, first + nr - i);
+			ret = -E2BIG;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < (int)options->co_nr_plan_traces; i++) {
+		const char *arg = options->co_plan_traces[i];
+		unsigned long backing_id;
+		char *end;
+
+		backing_id = strtoul(arg, &end, 10);
+		if (end == arg || *end != '=' || !end[1]) {
+			printf("--trace %s is not <bid>=<file>\n", arg);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		ret = pcacheplan_load_trace(&plan, backing_id, end + 1);
+		if (ret)
+			goto out;
+	}
+
+	if (strlen(options->co_mrc_path)) {
+		ret = pcacheplan_load_mrc(&plan, options->co_mrc_path);
+		if (ret)
+			goto out;
+	}
+
+	ret = pcacheplan_solve(&plan, snap.caches.segment_num[cache_idx]);
 	if (ret)
-		goto err;
+		goto out;
+
+	array = json_array();
+	for (i = 0; i < (int)plan.nr_backings; i++) {
+		struct pcacheplan_backing *backing = &plan.backings[i];
+		int idx = first + i;
+		json_t *json_backing = json_object();
+
+		snprintf(size_str, sizeof(size_str), "%uM", backing->planned_segs * PCACHE_SEG_SIZE_MB);
+
+		json_object_set_new(json_backing, "backing_id", json_integer(backing->backing_id));
+		json_object_set_new(json_backing, "backing_path", json_string(pcachesnap_str(&snap, snap.backings.backing_path[idx])));
+		json_object_set_new(json_backing, "cache_segs", json_integer(snap.backings.cache_segs[idx]));
+		json_object_set_new(json_backing, "cache_used_segs", json_integer(snap.backings.cache_used_segs[idx]));
+		json_object_set_new(json_backing, "planned_segs", json_integer(backing->planned_segs));
+		json_object_set_new(json_backing, "cache_size", json_string(size_str));
+		json_object_set_new(json_backing, "source", json_string(plan_source_name(backing->source)));
+		if (backing->source != PCACHEPLAN_SRC_NONE && backing->accesses > 0) {
+			json_object_set_new(json_backing, "expected_hit_ratio",
+					    json_real(backing->planned_hits / backing->accesses));
+			total_hits += backing->planned_hits;
+			total_accesses += backing->accesses;
+		}
 
-	// Convert JSON array to a formatted string and print to stdout
-	char *json_str = json_dumps(array, JSON_INDENT(4));
+		json_array_append_new(array, json_backing);
+	}
+
+	result = json_object();
+	json_object_set_new(result, "cache_id", json_integer(options->co_cache_id));
+	json_object_set_new(result, "segment_num", json_integer(snap.caches.segment_num[cache_idx]));
+	json_object_set_new(result, "unassigned_segs", json_integer(plan.unassigned_segs));
+	if (total_accesses > 0)
+		json_object_set_new(result, "expected_hit_ratio", json_real(total_hits / total_accesses));
+	json_object_set_new(result, "backings", array);
+
+	char *json_str = json_dumps(result, JSON_INDENT(4));
 	printf("%s\n", json_str);
 	free(json_str);
-err:
-	json_decref(array); // Free JSON array memory
-	return 0;
+	json_decref(result);
+out:
+	pcacheplan_free(&plan);
+	pcachesnap_free(&snap);
+	return ret;
+}
+
+static volatile sig_atomic_t shm_publish_stop;
+
+static void shm_publish_signal(int sig)
+{
+	shm_publish_stop = 1;
+}
+
+int pcache_shm_publish(pcache_opt_t *options)
+{
+	const char *path = strlen(options->co_path) ? options->co_path : PCACHESHM_PATH_DEFAULT;
+	struct sigaction sa = { .sa_handler = shm_publish_signal };
+	struct timespec interval = { .tv_sec = options->co_interval };
+	struct pcachesnap_handles handles;
+	struct pcacheshm_writer writer;
+	struct pcachesnap snap;
+	int ret;
+
+	if (!options->co_interval) {
+		printf("--interval must be at least 1 second\n");
+		return -EINVAL;
+	}
+
+	ret = pcachesnap_init(&snap);
+	if (ret)
+		return ret;
+	pcachesnap_handles_init(&handles);
+
+	ret = pcachesnap_collect_cached(&snap, &handles, PCACHESNAP_ALL_CACHES);
+	if (ret)
+		goto out;
+
+	/* leave room to grow before the segment has to be replaced */
+	ret = pcacheshm_writer_open(&writer, path, snap.caches.nr * 2, snap.backings.nr * 2);
+	if (ret)
+		goto out;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	ret = pcacheshm_publish(&writer, &snap);
+	while (!ret && !shm_publish_stop) {
+		/* a signal cuts the sleep short and ends the loop */
+		nanosleep(&interval, NULL);
+		if (shm_publish_stop)
+			break;
+
+		if (pcachesnap_collect_cached(&snap, &handles, PCACHESNAP_ALL_CACHES))
+			continue;
+		ret = pcacheshm_publish(&writer, &snap);
+	}
+
+	pcacheshm_writer_close(&writer, true);
+out:
+	pcachesnap_handles_free(&handles);
+	pcachesnap_free(&snap);
+	return ret;
 }
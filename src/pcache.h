@@ -15,9 +15,22 @@
 #define PCACHE_BACKING_START "backing-start"
 #define PCACHE_BACKING_STOP "backing-stop"
 #define PCACHE_BACKING_LIST "backing-list"
+#define PCACHE_PLAN "plan"
+#define PCACHE_EXPORTER "exporter"
+#define PCACHE_SHM_PUBLISH "shm-publish"
+#define PCACHE_REPLAY "replay"
+#define PCACHE_PMEM_BENCH "pmem-bench"
+#define PCACHE_CACHE_MIGRATE "cache-migrate"
+#define PCACHE_SERVE "serve"
 
 #define PCACHE_BACKING_HANDLERS_MAX 128
 
+#define PCACHE_EXPORTER_LISTEN_DEFAULT "unix:/run/pcache/exporter.sock"
+#define PCACHE_EXPORTER_INTERVAL_DEFAULT 10	/* seconds */
+
+#define PCACHE_SERVE_LISTEN_DEFAULT "unix:/run/pcache/serve.sock"
+#define PCACHE_SERVE_WORKERS_DEFAULT 8
+
 enum PCACHE_CMD_TYPE {
 	CCT_CACHE_START	= 0,
 	CCT_CACHE_STOP,
@@ -25,6 +38,13 @@ enum PCACHE_CMD_TYPE {
 	CCT_BACKING_START,
 	CCT_BACKING_STOP,
 	CCT_BACKING_LIST,
+	CCT_PLAN,
+	CCT_EXPORTER,
+	CCT_SHM_PUBLISH,
+	CCT_REPLAY,
+	CCT_PMEM_BENCH,
+	CCT_CACHE_MIGRATE,
+	CCT_SERVE,
 	CCT_INVALID,
 };
 
@@ -37,11 +57,34 @@ struct pcache_options
 	bool			co_format;
 	bool			co_data_crc;
 	unsigned int		co_cache_size;
+	bool			co_cache_size_auto;
+	double			co_cache_fraction;	/* of the free segments, for auto */
+	unsigned int		co_sample;		/* seconds of live blktrace */
 	unsigned int		co_cache_id;
 	unsigned int		co_backing_id;
 	unsigned int		co_dev_id;
 	unsigned int		co_queues;
 	bool			co_all;
+	unsigned int		co_lock_timeout;	/* seconds */
+	char			co_trace_path[PCACHE_PATH_LEN];
+	const char		*co_plan_traces[PCACHE_BACKING_HANDLERS_MAX];	/* plan: "<bid>=<file>" */
+	unsigned int		co_nr_plan_traces;
+	char			co_mrc_path[PCACHE_PATH_LEN];
+	char			co_listen[PCACHE_PATH_LEN];
+	unsigned int		co_interval;		/* seconds */
+	int			co_engine;		/* enum pcachesnap_engine */
+	bool			co_assemble;
+	bool			co_dry_run;
+	double			co_speed;		/* 0 for as fast as possible */
+	unsigned int		co_depth;
+	char			co_output[PCACHE_PATH_LEN];
+	bool			co_bench;
+	bool			co_warn;
+	char			co_thresholds[PCACHE_PATH_LEN];
+	char			co_from[PCACHE_PATH_LEN];
+	char			co_to[PCACHE_PATH_LEN];
+	char			co_journal[PCACHE_PATH_LEN];
+	bool			co_stdio;
 };
 
 /* Exports options as a global type */
@@ -59,6 +102,13 @@ static pcache_cmd_t pcache_cmd_tables[] = {
 	{PCACHE_BACKING_START, CCT_BACKING_START},
 	{PCACHE_BACKING_STOP, CCT_BACKING_STOP},
 	{PCACHE_BACKING_LIST, CCT_BACKING_LIST},
+	{PCACHE_PLAN, CCT_PLAN},
+	{PCACHE_EXPORTER, CCT_EXPORTER},
+	{PCACHE_SHM_PUBLISH, CCT_SHM_PUBLISH},
+	{PCACHE_REPLAY, CCT_REPLAY},
+	{PCACHE_PMEM_BENCH, CCT_PMEM_BENCH},
+	{PCACHE_CACHE_MIGRATE, CCT_CACHE_MIGRATE},
+	{PCACHE_SERVE, CCT_SERVE},
 	{"", CCT_INVALID},
 };
 
@@ -75,8 +125,36 @@ int pcache_cache_list(pcache_opt_t *opt);
 int pcache_backing_start(pcache_opt_t *options);
 int pcache_backing_stop(pcache_opt_t *options);
 int pcache_backing_list(pcache_opt_t *options);
+int pcache_plan(pcache_opt_t *options);
+int pcache_exporter(pcache_opt_t *options);
+int pcache_shm_publish(pcache_opt_t *options);
+int pcache_replay(pcache_opt_t *options);
+int pcache_pmem_bench(pcache_opt_t *options);
+int pcache_pmem_qualify(pcache_opt_t *options);
+int pcache_cache_migrate(pcache_opt_t *options);
+int pcache_serve(pcache_opt_t *options);
+
+/* sysfs writes and JSON records shared by the commands and the server */
+struct json_t;
+struct pcachesnap;
+
+int pcache_cache_register(const char *path, bool force, bool format);
+int pcache_cache_unregister(unsigned int cache_id);
+int pcache_backing_adm_start(unsigned int cache_id, const char *path, unsigned int queues,
+			     unsigned int cache_size, bool data_crc);
+int pcache_backing_adm_stop(unsigned int cache_id, unsigned int backing_id);
+struct json_t *pcache_cache_to_json(const struct pcachesnap *snap, int idx);
+struct json_t *pcache_backing_to_json(const struct pcachesnap *snap, int idx);
 
 #define PCACHE_NAME_LEN            32
+#define PCACHE_ASSEMBLE_DEVICES "/dev/pmem*"
+#define PCACHE_ASSEMBLE_THREADS 16
+
+#define PCACHE_REPLAY_DEPTH_DEFAULT 32
+
+#define PCACHE_MIGRATE_JOURNAL_DIR "/var/lib/pcache"
+
+#define PCACHE_SEG_SIZE_MB         16                      /* Size of a cache segment */
 
 struct pcache_cache {
 	uint64_t magic;
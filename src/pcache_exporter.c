@@ -0,0 +1,484 @@
+/* accept4 */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcache.h"
+#include "libpcachesys.h"
+#include "libpcachesnap.h"
+
+/*
+ * pcache exporter: a small daemon serving pcache counters in the Prometheus
+ * text exposition format.
+ *
+ * sysfs is only touched on the refresh timer, through handles kept open in a
+ * struct pcachesnap_handles. Each refresh renders the whole page once; a
+ * scrape just writes out the last rendered page, so scrape latency does not
+ * depend on the inventory size and scrape storms never reach sysfs.
+ *
+ * Clients are non-blocking and served from the same poll loop as the refresh
+ * timer, so a slow scraper holds up neither the others nor the refresh. A
+ * client keeps a reference to the page it is sent, a refresh meanwhile
+ * renders into a new one.
+ */
+
+#define EXPORTER_BACKLOG	64
+#define EXPORTER_IO_TIMEOUT_MS	1000
+#define EXPORTER_CONN_MAX	64
+
+struct exporter_buf {
+	char	*data;
+	size_t	len;
+	size_t	cap;
+};
+
+struct exporter_page {
+	unsigned int		refs;
+	struct exporter_buf	buf;
+};
+
+struct exporter_conn {
+	int			fd;
+	double			deadline;
+	struct exporter_page	*page;		/* set once the request is read */
+	char			header[256];
+	size_t			header_len;
+	size_t			off;		/* of header and page, sent */
+};
+
+struct exporter {
+	int				listen_fd;
+	char				unix_path[PCACHE_PATH_LEN];
+	struct pcachesnap		snap;
+	struct pcachesnap_handles	handles;
+	struct exporter_page		*page;
+	struct exporter_conn		conns[EXPORTER_CONN_MAX];
+	unsigned int			nr_conns;
+	double				refresh_seconds;
+	time_t				refresh_time;
+	unsigned long			refresh_failures;
+};
+
+static volatile sig_atomic_t exporter_stop;
+
+static void exporter_signal(int sig)
+{
+	exporter_stop = 1;
+}
+
+static bool buf_reserve(struct exporter_buf *buf, size_t len)
+{
+	size_t cap = buf->cap ? buf->cap : 65536;
+	char *data;
+
+	if (buf->len + len < buf->cap)
+		return true;
+
+	while (cap <= buf->len + len)
+		cap *= 2;
+
+	data = realloc(buf->data, cap);
+	if (!data)
+		return false;
+
+	buf->data = data;
+	buf->cap = cap;
+	return true;
+}
+
+static void buf_printf(struct exporter_buf *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || !buf_reserve(buf, len))
+		return;
+
+	va_start(ap, fmt);
+	buf->len += vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+	va_end(ap);
+}
+
+/* Label values escape backslash, double quote and newline */
+static void buf_label(struct exporter_buf *buf, const char *name, const char *value, bool first)
+{
+	size_t name_len = strlen(name), value_len = strlen(value);
+	const char *p;
+	char *out;
+
+	/* worst case every value byte is escaped */
+	if (!buf_reserve(buf, name_len + value_len * 2 + 4))
+		return;
+
+	out = buf->data + buf->len;
+	if (!first)
+		*out++ = ',';
+	memcpy(out, name, name_len);
+	out += name_len;
+	*out++ = '=';
+	*out++ = '"';
+	for (p = value; *p; p++) {
+		if (*p == '\\' || *p == '"') {
+			*out++ = '\\';
+			*out++ = *p;
+		} else if (*p == '\n') {
+			*out++ = '\\';
+			*out++ = 'n';
+		} else {
+			*out++ = *p;
+		}
+	}
+	*out++ = '"';
+	*out = '\0';
+	buf->len = out - buf->data;
+}
+
+static void render_cache_labels(struct exporter_buf *buf, const struct pcachesnap *snap, int idx)
+{
+	char id[16];
+
+	snprintf(id, sizeof(id), "%u", snap->caches.cache_id[idx]);
+	buf_label(buf, "cache_id", id, true);
+	buf_label(buf, "path", pcachesnap_str(snap, snap->caches.path[idx]), false);
+}
+
+static void render_backing_labels(struct exporter_buf *buf, const struct pcachesnap *snap, int idx)
+{
+	char id[16], logic_dev[PCACHE_PATH_LEN];
+
+	snprintf(id, sizeof(id), "%u", snap->backings.cache_id[idx]);
+	buf_label(buf, "cache_id", id, true);
+	snprintf(id, sizeof(id), "%u", snap->backings.backing_id[idx]);
+	buf_label(buf, "backing_id", id, false);
+	buf_label(buf, "backing_path", pcachesnap_str(snap, snap->backings.backing_path[idx]), false);
+	pcachesnap_logic_dev_path(snap, idx, logic_dev, sizeof(logic_dev));
+	buf_label(buf, "logic_dev", logic_dev, false);
+}
+
+static void render_backing_metric(struct exporter_buf *buf, const struct pcachesnap *snap,
+				  const char *name, const char *help, const uint32_t *values)
+{
+	unsigned int i;
+
+	buf_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+	for (i = 0; i < snap->backings.nr; i++) {
+		buf_printf(buf, "%s{", name);
+		render_backing_labels(buf, snap, i);
+		buf_printf(buf, "} %u\n", values[i]);
+	}
+}
+
+static void page_put(struct exporter_page *page)
+{
+	if (page && !--page->refs) {
+		free(page->buf.data);
+		free(page);
+	}
+}
+
+static void exporter_render(struct exporter *exp)
+{
+	const struct pcachesnap *snap = &exp->snap;
+	struct exporter_page *page = exp->page;
+	struct exporter_buf *buf;
+	char str[32];
+	unsigned int i;
+
+	/* render in place unless a client is still being sent the page */
+	if (!page || page->refs > 1) {
+		page = calloc(1, sizeof(*page));
+		if (!page)
+			return;
+		page->refs = 1;
+		page_put(exp->page);
+		exp->page = page;
+	}
+	buf = &page->buf;
+	buf->len = 0;
+
+	buf_printf(buf, "# HELP pcache_cache_info Cache device information.\n");
+	buf_printf(buf, "# TYPE pcache_cache_info gauge\n");
+	for (i = 0; i < snap->caches.nr; i++) {
+		buf_printf(buf, "pcache_cache_info{");
+		render_cache_labels(buf, snap, i);
+		snprintf(str, sizeof(str), "0x%016lx", snap->caches.magic[i]);
+		buf_label(buf, "magic", str, false);
+		snprintf(str, sizeof(str), "%d", snap->caches.version[i]);
+		buf_label(buf, "version", str, false);
+		snprintf(str, sizeof(str), "0x%08x", snap->caches.flags[i]);
+		buf_label(buf, "flags", str, false);
+		buf_printf(buf, "} 1\n");
+	}
+
+	buf_printf(buf, "# HELP pcache_cache_segments Number of segments on the cache device.\n");
+	buf_printf(buf, "# TYPE pcache_cache_segments gauge\n");
+	for (i = 0; i < snap->caches.nr; i++) {
+		buf_printf(buf, "pcache_cache_segments{");
+		render_cache_labels(buf, snap, i);
+		buf_printf(buf, "} %u\n", snap->caches.segment_num[i]);
+	}
+
+	render_backing_metric(buf, snap, "pcache_backing_cache_segments",
+			      "Cache segments assigned to the backing.", snap->backings.cache_segs);
+	render_backing_metric(buf, snap, "pcache_backing_cache_used_segments",
+			      "Cache segments in use by the backing.", snap->backings.cache_used_segs);
+	render_backing_metric(buf, snap, "pcache_backing_cache_gc_percent",
+			      "Cache usage percentage that triggers garbage collection.",
+			      snap->backings.cache_gc_percent);
+
+	buf_printf(buf, "# HELP pcache_exporter_last_refresh_timestamp_seconds Time of the last sysfs refresh.\n");
+	buf_printf(buf, "# TYPE pcache_exporter_last_refresh_timestamp_seconds gauge\n");
+	buf_printf(buf, "pcache_exporter_last_refresh_timestamp_seconds %ld\n", (long)exp->refresh_time);
+	buf_printf(buf, "# HELP pcache_exporter_refresh_duration_seconds Time spent in the last sysfs refresh.\n");
+	buf_printf(buf, "# TYPE pcache_exporter_refresh_duration_seconds gauge\n");
+	buf_printf(buf, "pcache_exporter_refresh_duration_seconds %.6f\n", exp->refresh_seconds);
+	buf_printf(buf, "# HELP pcache_exporter_read_errors_total sysfs attributes that failed to open or read.\n");
+	buf_printf(buf, "# TYPE pcache_exporter_read_errors_total counter\n");
+	buf_printf(buf, "pcache_exporter_read_errors_total %lu\n", exp->handles.errors);
+	buf_printf(buf, "# HELP pcache_exporter_refresh_failures_total sysfs refreshes that failed.\n");
+	buf_printf(buf, "# TYPE pcache_exporter_refresh_failures_total counter\n");
+	buf_printf(buf, "pcache_exporter_refresh_failures_total %lu\n", exp->refresh_failures);
+}
+
+static double monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void exporter_refresh(struct exporter *exp)
+{
+	double start = monotonic_seconds();
+
+	if (pcachesnap_collect_cached(&exp->snap, &exp->handles, PCACHESNAP_ALL_CACHES))
+		exp->refresh_failures++;
+
+	exp->refresh_seconds = monotonic_seconds() - start;
+	exp->refresh_time = time(NULL);
+	exporter_render(exp);
+}
+
+/*
+ * Listen address is "unix:<path>", "<port>" or "<ipv4>:<port>". A bare port
+ * binds to 127.0.0.1; the counters are for the local host, so any other
+ * address must be in 127.0.0.0/8 too.
+ */
+static int exporter_listen(struct exporter *exp, const char *addr)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	const char *colon = strrchr(addr, ':');
+	char host[64] = "127.0.0.1";
+	int fd, one = 1, ret;
+
+	if (strncmp(addr, "unix:", strlen("unix:")) == 0) {
+		fd = pcachesys_listen_unix(addr + strlen("unix:"), SOCK_STREAM | SOCK_NONBLOCK, 0,
+					   EXPORTER_BACKLOG);
+		if (fd < 0)
+			return fd;
+
+		/* only a socket we bound is removed on exit */
+		snprintf(exp->unix_path, sizeof(exp->unix_path), "%s", addr + strlen("unix:"));
+		exp->listen_fd = fd;
+		return 0;
+	}
+
+	if (colon)
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+	sin.sin_port = htons(strtoul(colon ? colon + 1 : addr, NULL, 10));
+	if (!sin.sin_port || inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+		printf("invalid listen address: %s\n", addr);
+		return -EINVAL;
+	}
+	if ((ntohl(sin.sin_addr.s_addr) >> 24) != 127) {
+		printf("%s is not a loopback address\n", host);
+		return -EINVAL;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, EXPORTER_BACKLOG)) {
+		ret = -errno;
+		printf("failed to listen on %s: %s\n", addr, strerror(-ret));
+		close(fd);
+		return ret;
+	}
+
+	exp->listen_fd = fd;
+	return 0;
+}
+
+static void exporter_accept(struct exporter *exp)
+{
+	struct exporter_conn *conn;
+	int fd;
+
+	while (exp->nr_conns < EXPORTER_CONN_MAX) {
+		fd = accept4(exp->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		conn = &exp->conns[exp->nr_conns++];
+		memset(conn, 0, sizeof(*conn));
+		conn->fd = fd;
+		conn->deadline = monotonic_seconds() + EXPORTER_IO_TIMEOUT_MS / 1000.0;
+	}
+}
+
+static void exporter_conn_close(struct exporter *exp, unsigned int i)
+{
+	close(exp->conns[i].fd);
+	page_put(exp->conns[i].page);
+	exp->conns[i] = exp->conns[--exp->nr_conns];
+}
+
+/* Move @conn along as far as it goes without blocking, true once it is done */
+static bool exporter_conn_io(struct exporter *exp, struct exporter_conn *conn)
+{
+	char req[1024];
+	size_t total;
+	ssize_t len;
+
+	if (!conn->page) {
+		len = recv(conn->fd, req, sizeof(req), 0);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return false;
+		if (len <= 0 || !exp->page)
+			return true;
+
+		/* the request itself does not matter, every path serves the metrics page */
+		conn->page = exp->page;
+		conn->page->refs++;
+		conn->header_len = snprintf(conn->header, sizeof(conn->header),
+					    "HTTP/1.0 200 OK\r\n"
+					    "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+					    "Content-Length: %zu\r\n"
+					    "Connection: close\r\n\r\n", conn->page->buf.len);
+	}
+
+	total = conn->header_len + conn->page->buf.len;
+	while (conn->off < total) {
+		if (conn->off < conn->header_len)
+			len = send(conn->fd, conn->header + conn->off, conn->header_len - conn->off,
+				   MSG_NOSIGNAL);
+		else
+			len = send(conn->fd, conn->page->buf.data + conn->off - conn->header_len,
+				   total - conn->off, MSG_NOSIGNAL);
+		if (len < 0)
+			return errno != EAGAIN && errno != EINTR;
+		conn->off += len;
+	}
+
+	return true;
+}
+
+/* Serve the clients poll found ready and drop those past their deadline */
+static void exporter_serve(struct exporter *exp, const struct pollfd *pfds)
+{
+	double now = monotonic_seconds();
+	unsigned int i = exp->nr_conns;
+
+	/* backwards, closing one moves the last, already handled, into its place */
+	while (i--) {
+		struct exporter_conn *conn = &exp->conns[i];
+
+		if ((pfds[i].revents && exporter_conn_io(exp, conn)) || now >= conn->deadline)
+			exporter_conn_close(exp, i);
+	}
+}
+
+int pcache_exporter(pcache_opt_t *options)
+{
+	struct exporter exp = { .listen_fd = -1 };
+	struct sigaction sa = { .sa_handler = exporter_signal };
+	struct pollfd pfds[EXPORTER_CONN_MAX + 1];
+	double next_refresh, wait;
+	unsigned int i, nr;
+	int ret;
+
+	if (!options->co_interval) {
+		printf("--interval must be at least 1 second\n");
+		return -EINVAL;
+	}
+
+	ret = pcachesnap_init(&exp.snap);
+	if (ret)
+		return ret;
+	pcachesnap_handles_init(&exp.handles);
+
+	ret = exporter_listen(&exp, options->co_listen);
+	if (ret)
+		goto out;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	exporter_refresh(&exp);
+	next_refresh = monotonic_seconds() + options->co_interval;
+
+	while (!exporter_stop) {
+		wait = next_refresh - monotonic_seconds();
+		if (wait <= 0) {
+			exporter_refresh(&exp);
+			next_refresh += options->co_interval;
+			if (next_refresh < monotonic_seconds())
+				next_refresh = monotonic_seconds() + options->co_interval;
+			continue;
+		}
+
+		/* clients first, so pfds[i] is conns[i]; new ones wait while all slots are taken */
+		nr = exp.nr_conns;
+		for (i = 0; i < nr; i++) {
+			pfds[i].fd = exp.conns[i].fd;
+			pfds[i].events = exp.conns[i].page ? POLLOUT : POLLIN;
+			pfds[i].revents = 0;
+			if (exp.conns[i].deadline - monotonic_seconds() < wait)
+				wait = exp.conns[i].deadline - monotonic_seconds();
+		}
+		pfds[nr].fd = exp.listen_fd;
+		pfds[nr].events = nr < EXPORTER_CONN_MAX ? POLLIN : 0;
+		pfds[nr].revents = 0;
+
+		ret = poll(pfds, nr + 1, wait > 0 ? (int)(wait * 1000) + 1 : 0);
+		if (ret < 0 && errno != EINTR) {
+			ret = -errno;
+			break;
+		}
+		ret = 0;
+
+		exporter_serve(&exp, pfds);
+		if (pfds[nr].revents & POLLIN)
+			exporter_accept(&exp);
+	}
+
+	while (exp.nr_conns)
+		exporter_conn_close(&exp, exp.nr_conns - 1);
+	close(exp.listen_fd);
+	if (exp.unix_path[0])
+		unlink(exp.unix_path);
+out:
+	page_put(exp.page);
+	pcachesnap_handles_free(&exp.handles);
+	pcachesnap_free(&exp.snap);
+	return ret;
+}
@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <jansson.h>
+
+#include "pcache.h"
+#include "libpcachesys.h"
+#include "libpcachesnap.h"
+#include "libpcachedev.h"
+#include "libpcachepmem.h"
+#include "libpcachecrc.h"
+
+/*
+ * pcache cache-migrate: move an unregistered cache to another device with
+ * its contents, so it comes back warm on new hardware.
+ *
+ * Only segments in use are copied, by --queues threads taking segments in
+ * turn, with streaming stores into the destination mapping. Free segments
+ * only get their info block zeroed on the destination. Every segment's
+ * CRC32C is taken from the source on the way and recorded in a journal
+ * file once the stores are drained, so an interrupted migration resumes
+ * where it stopped. That is only durable on a DAX mapping: through the
+ * page cache the destination is synced once at the end, and a crash can
+ * leave journaled segments that never reached it. When every segment is
+ * done the destination is read back and checked against the journal, and
+ * after a resume the source too, as it may have changed in between. Only
+ * then is the source superblock written, which makes the destination a
+ * cache that cache-start registers without --format. Until then the
+ * destination has no valid superblock.
+ */
+
+#define MIGRATE_CHUNK		(1024 * 1024)
+#define MIGRATE_JOURNAL_MAGIC	"PCMIGJNL"
+#define MIGRATE_JOURNAL_VERSION	1
+
+#define NSEC_PER_SEC		1000000000ULL
+
+enum migrate_state {
+	MIGRATE_PENDING		= 0,
+	MIGRATE_COPIED,
+	MIGRATE_SKIPPED,	/* not in use, info block zeroed */
+};
+
+/* Journal: this header, then one struct migrate_seg per segment */
+struct migrate_journal_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	segment_num;
+	uint64_t	src_size;
+	uint64_t	dst_size;
+	uint32_t	sb_crc;		/* of the source superblock */
+	uint32_t	reserved;
+};
+
+struct migrate_seg {
+	uint32_t	crc;		/* of the source segment, superblock excluded */
+	uint32_t	state;
+};
+
+struct migrate_ctx;
+typedef int (*migrate_fn_t)(struct migrate_ctx *ctx, unsigned int seg_id);
+
+struct migrate_ctx {
+	struct pcachepmem_map	src;
+	struct pcachepmem_map	dst;
+	unsigned int		segment_num;
+	struct migrate_seg	*segs;
+	int			journal_fd;
+
+	migrate_fn_t		fn;
+	unsigned int		next;
+	int			err;
+
+	bool			resumed;	/* journal CRCs may predate the source */
+
+	uint64_t		bytes;
+	unsigned int		copied;
+	unsigned int		skipped;
+	unsigned int		mismatched;
+};
+
+static volatile sig_atomic_t migrate_stop;
+
+static void migrate_signal(int sig)
+{
+	migrate_stop = 1;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline char *seg_addr(const struct pcachepmem_map *map, unsigned int seg_id)
+{
+	return (char *)map->addr + seg_id * PCACHE_SEG_SIZE;
+}
+
+/*
+ * CRC of a segment of @src, copying it to @dst with streaming stores on the
+ * way when @dst is set. The superblock is left out of both, it goes last.
+ */
+static uint32_t migrate_seg_pass(char *dst, const char *src, unsigned int seg_id)
+{
+	uint64_t off, len;
+	uint32_t crc = 0;
+
+	for (off = 0; off < PCACHE_SEG_SIZE; off += len) {
+		len = MIGRATE_CHUNK;
+		if (!seg_id && off < PCACHE_SB_OFF + PCACHE_SB_SIZE) {
+			if (off >= PCACHE_SB_OFF) {
+				len = PCACHE_SB_OFF + PCACHE_SB_SIZE - off;
+				continue;
+			}
+			len = PCACHE_SB_OFF - off;
+		}
+		if (len > PCACHE_SEG_SIZE - off)
+			len = PCACHE_SEG_SIZE - off;
+
+		crc = pcache_crc32c(crc, src + off, len);
+		if (dst)
+			pcachepmem_memcpy_nt(dst + off, src + off, len);
+	}
+
+	return crc;
+}
+
+static int journal_write_seg(struct migrate_ctx *ctx, unsigned int seg_id)
+{
+	off_t off = sizeof(struct migrate_journal_hdr) + (off_t)seg_id * sizeof(struct migrate_seg);
+
+	if (pwrite(ctx->journal_fd, &ctx->segs[seg_id], sizeof(struct migrate_seg), off) !=
+	    sizeof(struct migrate_seg))
+		return errno ? -errno : -EIO;
+
+	return 0;
+}
+
+static int migrate_copy_seg(struct migrate_ctx *ctx, unsigned int seg_id)
+{
+	const char *src = seg_addr(&ctx->src, seg_id);
+	char *dst = seg_addr(&ctx->dst, seg_id);
+	struct migrate_seg *seg = &ctx->segs[seg_id];
+
+	if (seg->state != MIGRATE_PENDING)
+		return 0;
+
+	if (pcachedev_seg_in_use(src, seg_id)) {
+		seg->crc = migrate_seg_pass(dst, src, seg_id);
+		pcachepmem_drain();
+		seg->state = MIGRATE_COPIED;
+		__atomic_fetch_add(&ctx->bytes, PCACHE_SEG_SIZE, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ctx->copied, 1, __ATOMIC_RELAXED);
+	} else {
+		/* the destination only has to agree that the segment is free */
+		memset(dst, 0, PCACHE_SEG_INFO_SIZE);
+		pcachepmem_persist(dst, PCACHE_SEG_INFO_SIZE);
+		seg->crc = 0;
+		seg->state = MIGRATE_SKIPPED;
+		__atomic_fetch_add(&ctx->skipped, 1, __ATOMIC_RELAXED);
+	}
+
+	return journal_write_seg(ctx, seg_id);
+}
+
+static int migrate_verify_seg(struct migrate_ctx *ctx, unsigned int seg_id)
+{
+	const char *src = seg_addr(&ctx->src, seg_id);
+	const char *dst = seg_addr(&ctx->dst, seg_id);
+	struct migrate_seg *seg = &ctx->segs[seg_id];
+	bool ok;
+
+	if (seg->state == MIGRATE_COPIED) {
+		ok = migrate_seg_pass(NULL, dst, seg_id) == seg->crc;
+		if (ok && ctx->resumed)
+			ok = migrate_seg_pass(NULL, src, seg_id) == seg->crc;
+		__atomic_fetch_add(&ctx->bytes, PCACHE_SEG_SIZE, __ATOMIC_RELAXED);
+	} else {
+		ok = !pcachedev_seg_in_use(dst, seg_id);
+		if (ok && ctx->resumed)
+			ok = !pcachedev_seg_in_use(src, seg_id);
+	}
+
+	if (ok)
+		return 0;
+
+	/* copied again on the next run */
+	__atomic_fetch_add(&ctx->mismatched, 1, __ATOMIC_RELAXED);
+	seg->state = MIGRATE_PENDING;
+	return journal_write_seg(ctx, seg_id);
+}
+
+static void *migrate_worker_fn(void *data)
+{
+	struct migrate_ctx *ctx = data;
+	unsigned int seg_id;
+	int ret;
+
+	while (!migrate_stop && !__atomic_load_n(&ctx->err, __ATOMIC_RELAXED)) {
+		seg_id = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+		if (seg_id >= ctx->segment_num)
+			break;
+
+		ret = ctx->fn(ctx, seg_id);
+		if (ret)
+			__atomic_store_n(&ctx->err, ret, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Run @fn on every segment with @nr_threads threads, the caller included */
+static int migrate_run(struct migrate_ctx *ctx, migrate_fn_t fn, unsigned int nr_threads)
+{
+	pthread_t *threads;
+	unsigned int i, started = 0;
+
+	ctx->fn = fn;
+	ctx->next = 0;
+	ctx->err = 0;
+	ctx->bytes = 0;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, migrate_worker_fn, ctx))
+			break;
+		started++;
+	}
+
+	migrate_worker_fn(ctx);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return ctx->err;
+}
+
+/*
+ * Open the journal of an interrupted migration, or start a new one. A
+ * journal left by a different migration is never reused, and a destination
+ * that already holds a cache needs --force.
+ */
+static int migrate_journal_open(struct migrate_ctx *ctx, const char *path, const char *to,
+				bool force, unsigned int *resumed)
+{
+	struct migrate_journal_hdr hdr, want = { 0 };
+	struct pcachedev_probe probe = { 0 };
+	size_t segs_len = sizeof(struct migrate_seg) * ctx->segment_num;
+	unsigned int i;
+	ssize_t len;
+	int ret;
+
+	memcpy(want.magic, MIGRATE_JOURNAL_MAGIC, sizeof(want.magic));
+	want.version = MIGRATE_JOURNAL_VERSION;
+	want.segment_num = ctx->segment_num;
+	want.src_size = ctx->src.size;
+	want.dst_size = ctx->dst.size;
+	want.sb_crc = pcache_crc32c(0, (char *)ctx->src.addr + PCACHE_SB_OFF, PCACHE_SB_SIZE);
+
+	*resumed = 0;
+	ctx->journal_fd = open(path, O_RDWR | O_CLOEXEC);
+	if (ctx->journal_fd >= 0) {
+		len = pread(ctx->journal_fd, &hdr, sizeof(hdr), 0);
+		if (len != sizeof(hdr) || memcmp(&hdr, &want, sizeof(hdr))) {
+			printf("journal %s belongs to another migration, remove it to start over\n", path);
+			return -EEXIST;
+		}
+		if (pread(ctx->journal_fd, ctx->segs, segs_len, sizeof(hdr)) != (ssize_t)segs_len) {
+			printf("journal %s is truncated, remove it to start over\n", path);
+			return -EINVAL;
+		}
+		for (i = 0; i < ctx->segment_num; i++) {
+			if (ctx->segs[i].state != MIGRATE_PENDING)
+				(*resumed)++;
+		}
+		ctx->resumed = *resumed;
+		return 0;
+	}
+	if (errno != ENOENT) {
+		ret = -errno;
+		printf("failed to open journal %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	snprintf(probe.path, sizeof(probe.path), "%s", to);
+	pcachedev_probe(&probe);
+	if ((probe.status == PCACHEDEV_VALID || probe.status == PCACHEDEV_CORRUPT) && !force) {
+		printf("%s already holds a cache, pass --force to overwrite it\n", to);
+		return -EPERM;
+	}
+
+	ctx->journal_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (ctx->journal_fd < 0) {
+		ret = -errno;
+		printf("failed to create journal %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	memset(ctx->segs, 0, segs_len);
+	if (pwrite(ctx->journal_fd, &want, sizeof(want), 0) != sizeof(want) ||
+	    pwrite(ctx->journal_fd, ctx->segs, segs_len, sizeof(want)) != (ssize_t)segs_len ||
+	    fdatasync(ctx->journal_fd)) {
+		printf("failed to write journal %s: %s\n", path, strerror(errno));
+		return errno ? -errno : -EIO;
+	}
+
+	return 0;
+}
+
+static void migrate_journal_path(pcache_opt_t *options, char *buf, size_t len)
+{
+	char to[PCACHE_PATH_LEN];
+
+	if (strlen(options->co_journal)) {
+		snprintf(buf, len, "%s", options->co_journal);
+		return;
+	}
+
+	snprintf(to, sizeof(to), "%s", options->co_to);
+	mkdir(PCACHE_MIGRATE_JOURNAL_DIR, 0755);
+	snprintf(buf, len, "%s/migrate-%s.journal", PCACHE_MIGRATE_JOURNAL_DIR, basename(to));
+}
+
+/* Only a device can be registered as a cache, not a regular file */
+static bool migrate_is_file(const char *path)
+{
+	struct stat sb;
+
+	return !stat(path, &sb) && S_ISREG(sb.st_mode);
+}
+
+/* Neither side may be a registered cache, and the register lock keeps it so while both are opened */
+static int migrate_open(struct migrate_ctx *ctx, pcache_opt_t *options)
+{
+	struct pcachesys_lock lock = { .fd = -1 };
+	struct pcachesnap snap;
+	const char *busy = NULL;
+	int ret;
+
+	/* nothing to check, and no /run/pcache needed, without the module or between files */
+	if (!pcachesys_present() ||
+	    (migrate_is_file(options->co_from) && migrate_is_file(options->co_to)))
+		goto map;
+
+	ret = pcachesys_lock_cache(&lock, PCACHESYS_LOCK_REGISTER, true, options->co_lock_timeout * 1000);
+	if (ret)
+		return ret;
+
+	ret = pcachesnap_init(&snap);
+	if (ret)
+		goto unlock;
+
+	snap.engine = options->co_engine;
+	ret = pcachesnap_collect(&snap, PCACHESNAP_ALL_CACHES);
+	if (!ret) {
+		if (pcachesnap_find_cache_path(&snap, options->co_from) >= 0)
+			busy = options->co_from;
+		else if (pcachesnap_find_cache_path(&snap, options->co_to) >= 0)
+			busy = options->co_to;
+	}
+	pcachesnap_free(&snap);
+	if (ret)
+		goto unlock;
+	if (busy) {
+		printf("%s is a registered cache, stop it first\n", busy);
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+map:
+	/* block devices are opened exclusively, so they cannot be registered meanwhile */
+	ret = pcachepmem_map(&ctx->src, options->co_from, false);
+	if (ret)
+		goto unlock;
+
+	ret = pcachepmem_map(&ctx->dst, options->co_to, true);
+	if (ret)
+		pcachepmem_unmap(&ctx->src);
+unlock:
+	pcachesys_unlock(&lock);
+	return ret;
+}
+
+static void migrate_report(struct migrate_ctx *ctx, pcache_opt_t *options, const char *result,
+			   unsigned int resumed, double copy_s, uint64_t copy_bytes,
+			   double verify_s, uint64_t verify_bytes, const char *journal)
+{
+	json_t *obj = json_object();
+	double mb = 1024 * 1024;
+
+	json_object_set_new(obj, "from", json_string(options->co_from));
+	json_object_set_new(obj, "to", json_string(options->co_to));
+	json_object_set_new(obj, "segment_num", json_integer(ctx->segment_num));
+	json_object_set_new(obj, "copied", json_integer(ctx->copied));
+	json_object_set_new(obj, "skipped", json_integer(ctx->skipped));
+	json_object_set_new(obj, "resumed", json_integer(resumed));
+	json_object_set_new(obj, "copy_MB", json_integer(copy_bytes / (1024 * 1024)));
+	json_object_set_new(obj, "copy_seconds", json_real(copy_s));
+	json_object_set_new(obj, "copy_MBps", json_real(copy_s > 0 ? copy_bytes / mb / copy_s : 0));
+	json_object_set_new(obj, "verify_seconds", json_real(verify_s));
+	json_object_set_new(obj, "verify_MBps", json_real(verify_s > 0 ? verify_bytes / mb / verify_s : 0));
+	if (ctx->mismatched)
+		json_object_set_new(obj, "mismatched", json_integer(ctx->mismatched));
+	if (journal)
+		json_object_set_new(obj, "journal", json_string(journal));
+	json_object_set_new(obj, "result", json_string(result));
+
+	char *json_str = json_dumps(obj, JSON_INDENT(4));
+	printf("%s\n", json_str);
+	free(json_str);
+	json_decref(obj);
+}
+
+/* Make the destination a valid cache, or take that away with @valid false */
+static int migrate_write_sb(struct migrate_ctx *ctx, bool valid)
+{
+	char *dst = (char *)ctx->dst.addr + PCACHE_SB_OFF;
+	const char *src = (const char *)ctx->src.addr + PCACHE_SB_OFF;
+
+	if (valid)
+		pcachepmem_memcpy_nt(dst, src, PCACHE_SB_SIZE);
+	else
+		memset(dst, 0, PCACHE_SB_SIZE);
+	pcachepmem_persist(dst, PCACHE_SB_SIZE);
+
+	return pcachepmem_sync(&ctx->dst);
+}
+
+int pcache_cache_migrate(pcache_opt_t *options)
+{
+	struct sigaction sa = { .sa_handler = migrate_signal };
+	struct migrate_ctx ctx = { .journal_fd = -1 };
+	struct pcachedev_probe probe = { 0 };
+	struct stat src_st, dst_st;
+	char journal[PATH_MAX];
+	uint64_t start, copy_ns, verify_ns, copy_bytes;
+	unsigned int resumed;
+	int ret;
+
+	if (!strlen(options->co_from) || !strlen(options->co_to)) {
+		printf("--from and --to are required\n");
+		return -EINVAL;
+	}
+	if (!options->co_queues) {
+		printf("--queues must be at least 1\n");
+		return -EINVAL;
+	}
+
+	snprintf(probe.path, sizeof(probe.path), "%s", options->co_from);
+	pcachedev_probe(&probe);
+	if (probe.status != PCACHEDEV_VALID) {
+		printf("%s: %s\n", options->co_from, pcachedev_status_str(&probe));
+		return probe.err ? probe.err : -EINVAL;
+	}
+	ctx.segment_num = probe.segment_num;
+
+	if (!stat(options->co_from, &src_st) && !stat(options->co_to, &dst_st) &&
+	    (S_ISBLK(src_st.st_mode) ? src_st.st_rdev == dst_st.st_rdev :
+	     src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino)) {
+		printf("--from and --to are the same device\n");
+		return -EINVAL;
+	}
+
+	ret = migrate_open(&ctx, options);
+	if (ret)
+		return ret;
+
+	if (ctx.dst.size < ctx.segment_num * PCACHE_SEG_SIZE) {
+		printf("%s is too small for %u segments\n", options->co_to, ctx.segment_num);
+		ret = -ENOSPC;
+		goto unmap;
+	}
+
+	ctx.segs = malloc(sizeof(*ctx.segs) * ctx.segment_num);
+	if (!ctx.segs) {
+		ret = -ENOMEM;
+		goto unmap;
+	}
+
+	migrate_journal_path(options, journal, sizeof(journal));
+	ret = migrate_journal_open(&ctx, journal, options->co_to, options->co_force, &resumed);
+	if (ret)
+		goto close;
+
+	/* a half-copied destination must never look like a cache */
+	ret = migrate_write_sb(&ctx, false);
+	if (ret)
+		goto close;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	start = now_ns();
+	ret = migrate_run(&ctx, migrate_copy_seg, options->co_queues);
+	if (!ret)
+		ret = pcachepmem_sync(&ctx.dst);
+	copy_ns = now_ns() - start;
+	copy_bytes = ctx.bytes;
+	fdatasync(ctx.journal_fd);
+
+	if (migrate_stop) {
+		migrate_report(&ctx, options, "interrupted", resumed, (double)copy_ns / NSEC_PER_SEC,
+			       copy_bytes, 0, 0, journal);
+		ret = -EINTR;
+		goto close;
+	}
+	if (ret) {
+		printf("failed to copy %s to %s: %s\n", options->co_from, options->co_to, strerror(-ret));
+		goto close;
+	}
+
+	start = now_ns();
+	ret = migrate_run(&ctx, migrate_verify_seg, options->co_queues);
+	verify_ns = now_ns() - start;
+	fdatasync(ctx.journal_fd);
+	if (migrate_stop) {
+		migrate_report(&ctx, options, "interrupted", resumed, (double)copy_ns / NSEC_PER_SEC,
+			       copy_bytes, (double)verify_ns / NSEC_PER_SEC, ctx.bytes, journal);
+		ret = -EINTR;
+		goto close;
+	}
+	if (!ret && ctx.mismatched)
+		ret = -EIO;
+	if (!ret)
+		ret = migrate_write_sb(&ctx, true);
+	if (!ret && memcmp((char *)ctx.dst.addr + PCACHE_SB_OFF, (char *)ctx.src.addr + PCACHE_SB_OFF,
+			   PCACHE_SB_SIZE)) {
+		migrate_write_sb(&ctx, false);
+		ret = -EIO;
+	}
+
+	migrate_report(&ctx, options, ret ? "failed" : "done", resumed, (double)copy_ns / NSEC_PER_SEC,
+		       copy_bytes, (double)verify_ns / NSEC_PER_SEC, ctx.bytes, ret ? journal : NULL);
+	if (ret) {
+		printf("verification of %s failed, run cache-migrate again to recopy\n", options->co_to);
+		goto close;
+	}
+
+	close(ctx.journal_fd);
+	ctx.journal_fd = -1;
+	unlink(journal);
+close:
+	if (ctx.journal_fd >= 0)
+		close(ctx.journal_fd);
+	free(ctx.segs);
+unmap:
+	pcachepmem_unmap(&ctx.dst);
+	pcachepmem_unmap(&ctx.src);
+	return ret;
+}
@@ -0,0 +1,675 @@
+/* CPU_SET and pthread_setaffinity_np */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <jansson.h>
+
+#include "pcache.h"
+#include "libpcachedev.h"
+#include "libpcachepmem.h"
+#include "libpcachesnap.h"
+#include "libpcachesys.h"
+
+/*
+ * pcache pmem-bench: qualify a PMem namespace, or a DAX or regular file
+ * standing in for one, before it is formatted as a cache. A namespace is
+ * measured through its device-DAX character device; a block device only
+ * gets a page cache mapping, so it is refused rather than measured.
+ *
+ * The device is mapped and every test runs once per NUMA node, with
+ * --queues threads pinned to that node's CPUs working on disjoint slices:
+ * sequential and random 4 KiB read bandwidth, write bandwidth with
+ * non-temporal stores and with regular stores plus cache line flushes, and
+ * the latency of making 64 bytes and 4 KiB durable. Bandwidth tests run for
+ * a fixed time, latency tests for a fixed number of operations per thread.
+ *
+ * Each metric's best node, normally the one the namespace is attached to,
+ * is checked against a threshold: bandwidth must reach it, p99 latency must
+ * stay below it. Degraded DIMMs and interleave sets missing a DIMM show up
+ * as a local node that falls short.
+ */
+
+#define BENCH_SIZE_MAX		(1ULL << 30)	/* bytes of the device exercised */
+#define BENCH_CHUNK		(64 * 1024)
+#define BENCH_BLOCK		4096
+#define BENCH_TEST_NS		1000000000ULL	/* per bandwidth test */
+#define BENCH_LAT_OPS		20000		/* per thread and latency test */
+#define BENCH_NODE_DIR		"/sys/devices/system/node"
+#define BENCH_CPULIST_LEN	256
+
+#define NSEC_PER_SEC		1000000000ULL
+
+enum bench_test {
+	BENCH_SEQ_READ		= 0,
+	BENCH_RAND_READ,
+	BENCH_NT_WRITE,
+	BENCH_FLUSH_WRITE,
+	BENCH_PERSIST_64B,
+	BENCH_PERSIST_4K,
+	BENCH_NR_TESTS,
+};
+
+struct bench_metric {
+	const char	*name;
+	bool		latency;	/* p99 in us, at most; else MB/s, at least */
+	double		threshold;
+};
+
+static const struct bench_metric bench_metrics[BENCH_NR_TESTS] = {
+	[BENCH_SEQ_READ]	= { "seq_read",		false,	2000 },
+	[BENCH_RAND_READ]	= { "rand_read",	false,	1000 },
+	[BENCH_NT_WRITE]	= { "nt_write",		false,	500 },
+	[BENCH_FLUSH_WRITE]	= { "flush_write",	false,	300 },
+	[BENCH_PERSIST_64B]	= { "persist_64b",	true,	5 },
+	[BENCH_PERSIST_4K]	= { "persist_4k",	true,	20 },
+};
+
+struct bench_lat {
+	double		avg;
+	double		p50;
+	double		p99;
+};
+
+struct bench_node {
+	int		id;		/* -1 without NUMA information, unpinned */
+	char		cpulist[BENCH_CPULIST_LEN];
+	cpu_set_t	cpus;
+	double		result[BENCH_NR_TESTS];	/* MB/s, or p99 us */
+	struct bench_lat lat[BENCH_NR_TESTS];
+};
+
+struct bench_ctx {
+	struct pcachepmem_map	map;
+	uint64_t		size;		/* bytes exercised */
+	unsigned int		nr_threads;	/* per node */
+	unsigned int		nr_nodes;
+	struct bench_node	*nodes;
+	double			threshold[BENCH_NR_TESTS];
+	int			go;		/* 1 to start the threads of a test, -1 to abort */
+};
+
+struct bench_thread {
+	struct bench_ctx	*ctx;
+	struct bench_node	*node;
+	enum bench_test		test;
+	pthread_t		thread;
+	char			*base;		/* this thread's slice */
+	uint64_t		len;
+	uint64_t		seed;
+	uint64_t		bytes;
+	uint64_t		elapsed_ns;
+	uint32_t		*lat;		/* ns per operation */
+	int			err;
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* "0-3,8-11" */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*p && *p != '\n') {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -EINVAL;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return CPU_COUNT(set) ? 0 : -ENOENT;
+}
+
+static int node_cmp(const void *a, const void *b)
+{
+	const struct bench_node *na = a, *nb = b;
+
+	return na->id - nb->id;
+}
+
+/* Every node with CPUs, or one unpinned pseudo node without NUMA in sysfs */
+static int bench_find_nodes(struct bench_ctx *ctx)
+{
+	char path[PATH_MAX];
+	struct bench_node *node, *nodes;
+	struct dirent *entry;
+	FILE *file;
+	DIR *dir;
+
+	dir = opendir(BENCH_NODE_DIR);
+	while (dir && (entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "node", 4) || !isdigit((unsigned char)entry->d_name[4]))
+			continue;
+
+		nodes = realloc(ctx->nodes, sizeof(*nodes) * (ctx->nr_nodes + 1));
+		if (!nodes) {
+			closedir(dir);
+			return -ENOMEM;
+		}
+		ctx->nodes = nodes;
+		node = &ctx->nodes[ctx->nr_nodes];
+		memset(node, 0, sizeof(*node));
+		node->id = atoi(entry->d_name + 4);
+
+		snprintf(path, sizeof(path), "%s/%s/cpulist", BENCH_NODE_DIR, entry->d_name);
+		file = fopen(path, "r");
+		if (!file)
+			continue;
+		if (fgets(node->cpulist, sizeof(node->cpulist), file)) {
+			node->cpulist[strcspn(node->cpulist, "\n")] = '\0';
+			/* memory-only nodes have no CPUs to pin to */
+			if (!parse_cpulist(node->cpulist, &node->cpus))
+				ctx->nr_nodes++;
+		}
+		fclose(file);
+	}
+	if (dir)
+		closedir(dir);
+
+	if (!ctx->nr_nodes) {
+		ctx->nodes = calloc(1, sizeof(*ctx->nodes));
+		if (!ctx->nodes)
+			return -ENOMEM;
+		ctx->nodes[0].id = -1;
+		ctx->nr_nodes = 1;
+		return 0;
+	}
+
+	qsort(ctx->nodes, ctx->nr_nodes, sizeof(*ctx->nodes), node_cmp);
+	return 0;
+}
+
+static void bench_bandwidth(struct bench_thread *t, char *buf)
+{
+	uint64_t start = now_ns(), off = 0, nr_blocks = t->len / BENCH_BLOCK;
+	char *dst;
+	int i;
+
+	do {
+		switch (t->test) {
+		case BENCH_SEQ_READ:
+			memcpy(buf, t->base + off, BENCH_CHUNK);
+			break;
+		case BENCH_RAND_READ:
+			for (i = 0; i < BENCH_CHUNK / BENCH_BLOCK; i++)
+				memcpy(buf + i * BENCH_BLOCK,
+				       t->base + (xorshift64(&t->seed) % nr_blocks) * BENCH_BLOCK,
+				       BENCH_BLOCK);
+			break;
+		case BENCH_NT_WRITE:
+			pcachepmem_memcpy_nt(t->base + off, buf, BENCH_CHUNK);
+			pcachepmem_drain();
+			break;
+		case BENCH_FLUSH_WRITE:
+			dst = t->base + off;
+			memcpy(dst, buf, BENCH_CHUNK);
+			pcachepmem_persist(dst, BENCH_CHUNK);
+			break;
+		default:
+			break;
+		}
+
+		t->bytes += BENCH_CHUNK;
+		off += BENCH_CHUNK;
+		if (off + BENCH_CHUNK > t->len)
+			off = 0;
+	} while ((t->elapsed_ns = now_ns() - start) < BENCH_TEST_NS);
+}
+
+static void bench_latency(struct bench_thread *t, char *buf)
+{
+	uint64_t start, nr;
+	unsigned int i;
+	char *dst;
+
+	if (t->test == BENCH_PERSIST_64B)
+		nr = t->len / PCACHEPMEM_LINE;
+	else
+		nr = t->len / BENCH_BLOCK;
+
+	for (i = 0; i < BENCH_LAT_OPS; i++) {
+		if (t->test == BENCH_PERSIST_64B) {
+			dst = t->base + (xorshift64(&t->seed) % nr) * PCACHEPMEM_LINE;
+			start = now_ns();
+			memcpy(dst, buf, PCACHEPMEM_LINE);
+			pcachepmem_persist(dst, PCACHEPMEM_LINE);
+		} else {
+			dst = t->base + (xorshift64(&t->seed) % nr) * BENCH_BLOCK;
+			start = now_ns();
+			pcachepmem_memcpy_nt(dst, buf, BENCH_BLOCK);
+			pcachepmem_drain();
+		}
+		t->lat[i] = now_ns() - start;
+	}
+}
+
+static void *bench_thread_fn(void *data)
+{
+	struct bench_thread *t = data;
+	char *buf;
+	int go;
+
+	/* pin first, so the DRAM buffer is allocated on this node */
+	if (t->node->id >= 0)
+		t->err = -pthread_setaffinity_np(pthread_self(), sizeof(t->node->cpus), &t->node->cpus);
+
+	buf = aligned_alloc(BENCH_BLOCK, BENCH_CHUNK);
+	if (!buf && !t->err)
+		t->err = -ENOMEM;
+	if (buf)
+		memset(buf, 0x5a, BENCH_CHUNK);
+
+	/* start together, so bandwidth is measured with every thread running */
+	while (!(go = __atomic_load_n(&t->ctx->go, __ATOMIC_ACQUIRE)))
+		sched_yield();
+	if (go < 0 || t->err)
+		goto out;
+
+	if (bench_metrics[t->test].latency)
+		bench_latency(t, buf);
+	else
+		bench_bandwidth(t, buf);
+out:
+	free(buf);
+	return NULL;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static void bench_lat_summary(struct bench_lat *lat, uint32_t *samples, size_t nr)
+{
+	double sum = 0;
+	size_t i;
+
+	qsort(samples, nr, sizeof(*samples), lat_cmp);
+	for (i = 0; i < nr; i++)
+		sum += samples[i];
+
+	lat->avg = sum / nr / 1000;
+	lat->p50 = samples[nr / 2] / 1000.0;
+	lat->p99 = samples[nr * 99 / 100] / 1000.0;
+}
+
+static int bench_run_test(struct bench_ctx *ctx, struct bench_node *node, enum bench_test test)
+{
+	struct bench_thread *threads;
+	uint32_t *lat = NULL;
+	uint64_t slice = ctx->size / ctx->nr_threads / BENCH_CHUNK * BENCH_CHUNK;
+	uint64_t bytes = 0, elapsed = 0;
+	unsigned int i, started = 0;
+	int ret;
+
+	threads = calloc(ctx->nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	if (bench_metrics[test].latency) {
+		lat = malloc(sizeof(*lat) * BENCH_LAT_OPS * ctx->nr_threads);
+		if (!lat) {
+			free(threads);
+			return -ENOMEM;
+		}
+	}
+
+	ctx->go = 0;
+	for (i = 0; i < ctx->nr_threads; i++) {
+		struct bench_thread *t = &threads[i];
+
+		t->ctx = ctx;
+		t->node = node;
+		t->test = test;
+		t->base = (char *)ctx->map.addr + slice * i;
+		t->len = slice;
+		t->seed = 0x9e3779b97f4a7c15ULL * (i + 1) + test;
+		t->lat = lat ? lat + (size_t)BENCH_LAT_OPS * i : NULL;
+
+		ret = -pthread_create(&t->thread, NULL, bench_thread_fn, t);
+		if (ret)
+			break;
+		started++;
+	}
+
+	__atomic_store_n(&ctx->go, ret ? -1 : 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (!ret)
+			ret = threads[i].err;
+		bytes += threads[i].bytes;
+		if (threads[i].elapsed_ns > elapsed)
+			elapsed = threads[i].elapsed_ns;
+	}
+	if (ret) {
+		printf("benchmark thread on node %d failed: %s\n", node->id, strerror(-ret));
+		goto out;
+	}
+
+	if (lat) {
+		bench_lat_summary(&node->lat[test], lat, (size_t)BENCH_LAT_OPS * ctx->nr_threads);
+		node->result[test] = node->lat[test].p99;
+	} else {
+		node->result[test] = elapsed ? (double)bytes / (1024 * 1024) / ((double)elapsed / NSEC_PER_SEC) : 0;
+	}
+out:
+	free(lat);
+	free(threads);
+	return ret;
+}
+
+/* "seq_read=3000,persist_64b=2" over the defaults */
+static int bench_parse_thresholds(struct bench_ctx *ctx, const char *spec)
+{
+	char buf[PCACHE_PATH_LEN], *item, *save = NULL, *value, *end;
+	unsigned int i;
+
+	for (i = 0; i < BENCH_NR_TESTS; i++)
+		ctx->threshold[i] = bench_metrics[i].threshold;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		value = strchr(item, '=');
+		if (!value)
+			goto invalid;
+		*value++ = '\0';
+
+		for (i = 0; i < BENCH_NR_TESTS; i++) {
+			if (strcmp(item, bench_metrics[i].name) == 0)
+				break;
+		}
+		if (i == BENCH_NR_TESTS)
+			goto invalid;
+
+		ctx->threshold[i] = strtod(value, &end);
+		if (end == value || *end || ctx->threshold[i] < 0)
+			goto invalid;
+	}
+
+	return 0;
+invalid:
+	printf("invalid threshold: %s\n", item);
+	return -EINVAL;
+}
+
+static bool bench_metric_best(const struct bench_ctx *ctx, enum bench_test test, double *best)
+{
+	unsigned int i;
+
+	*best = ctx->nodes[0].result[test];
+	for (i = 1; i < ctx->nr_nodes; i++) {
+		double v = ctx->nodes[i].result[test];
+
+		if (bench_metrics[test].latency ? v < *best : v > *best)
+			*best = v;
+	}
+
+	if (bench_metrics[test].latency)
+		return *best <= ctx->threshold[test];
+	return *best >= ctx->threshold[test];
+}
+
+static json_t *bench_report(struct bench_ctx *ctx, const char *path, bool *passed)
+{
+	json_t *report = json_object(), *nodes = json_array(), *checks = json_array();
+	json_t *obj, *lat;
+	char key[32];
+	unsigned int i, t;
+	double best;
+	bool pass;
+
+	json_object_set_new(report, "path", json_string(path));
+	json_object_set_new(report, "size", json_integer(ctx->size));
+	json_object_set_new(report, "map_sync", json_boolean(ctx->map.sync));
+	json_object_set_new(report, "dax", json_boolean(ctx->map.dax));
+	json_object_set_new(report, "flush", json_string(pcachepmem_flush_name()));
+	json_object_set_new(report, "threads_per_node", json_integer(ctx->nr_threads));
+
+	for (i = 0; i < ctx->nr_nodes; i++) {
+		struct bench_node *node = &ctx->nodes[i];
+
+		obj = json_object();
+		json_object_set_new(obj, "node", json_integer(node->id));
+		if (node->id >= 0)
+			json_object_set_new(obj, "cpus", json_string(node->cpulist));
+
+		for (t = 0; t < BENCH_NR_TESTS; t++) {
+			if (bench_metrics[t].latency) {
+				snprintf(key, sizeof(key), "%s_us", bench_metrics[t].name);
+				lat = json_object();
+				json_object_set_new(lat, "avg", json_real(node->lat[t].avg));
+				json_object_set_new(lat, "p50", json_real(node->lat[t].p50));
+				json_object_set_new(lat, "p99", json_real(node->lat[t].p99));
+				json_object_set_new(obj, key, lat);
+			} else {
+				snprintf(key, sizeof(key), "%s_MBps", bench_metrics[t].name);
+				json_object_set_new(obj, key, json_real(node->result[t]));
+			}
+		}
+		json_array_append_new(nodes, obj);
+	}
+	json_object_set_new(report, "nodes", nodes);
+
+	*passed = true;
+	for (t = 0; t < BENCH_NR_TESTS; t++) {
+		pass = bench_metric_best(ctx, t, &best);
+		*passed &= pass;
+
+		obj = json_object();
+		json_object_set_new(obj, "metric", json_string(bench_metrics[t].name));
+		json_object_set_new(obj, "value", json_real(best));
+		json_object_set_new(obj, bench_metrics[t].latency ? "max" : "min",
+				    json_real(ctx->threshold[t]));
+		json_object_set_new(obj, "pass", json_boolean(pass));
+		json_array_append_new(checks, obj);
+	}
+	json_object_set_new(report, "checks", checks);
+
+	return report;
+}
+
+/*
+ * The tests overwrite what they touch. Registered caches are never
+ * benchmarked; devices and anything carrying a pcache superblock need
+ * --force, unless the caller is about to format the device anyway.
+ */
+static int bench_check_target(pcache_opt_t *options, const char *path, bool formatting)
+{
+	struct pcachedev_probe probe = { 0 };
+	struct pcachesnap snap;
+	struct stat sb;
+	int ret;
+
+	if (stat(path, &sb)) {
+		ret = -errno;
+		printf("failed to stat %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	/* without the module nothing can be registered */
+	if (pcachesys_present()) {
+		ret = pcachesnap_init(&snap);
+		if (ret)
+			return ret;
+		snap.engine = options->co_engine;
+		ret = pcachesnap_collect(&snap, PCACHESNAP_ALL_CACHES);
+		if (!ret && pcachesnap_find_cache_path(&snap, path) >= 0) {
+			printf("%s is a registered cache, stop it first\n", path);
+			ret = -EBUSY;
+		}
+		pcachesnap_free(&snap);
+		if (ret)
+			return ret;
+	}
+
+	if (options->co_force)
+		return 0;
+
+	if ((S_ISBLK(sb.st_mode) || S_ISCHR(sb.st_mode)) && !formatting) {
+		printf("%s is a device, the write tests overwrite its data; pass --force\n", path);
+		return -EPERM;
+	}
+
+	snprintf(probe.path, sizeof(probe.path), "%s", path);
+	pcachedev_probe(&probe);
+	if (probe.status == PCACHEDEV_VALID || probe.status == PCACHEDEV_UNSUPPORTED ||
+	    probe.status == PCACHEDEV_CORRUPT || probe.status == PCACHEDEV_TRUNCATED) {
+		printf("%s holds a pcache cache, the write tests destroy it; pass --force\n", path);
+		return -EPERM;
+	}
+
+	return 0;
+}
+
+static int bench_run(pcache_opt_t *options, bool formatting, bool *passed)
+{
+	struct bench_ctx ctx = { 0 };
+	const char *path = options->co_path;
+	json_t *report;
+	struct stat sb;
+	unsigned int i, t;
+	int ret;
+
+	if (!strlen(path)) {
+		printf("path is null!\n");
+		return -EINVAL;
+	}
+	if (!options->co_queues) {
+		printf("--queues must be at least 1\n");
+		return -EINVAL;
+	}
+	ctx.nr_threads = options->co_queues;
+
+	ret = bench_parse_thresholds(&ctx, options->co_thresholds);
+	if (ret)
+		return ret;
+
+	ret = bench_check_target(options, path, formatting);
+	if (ret)
+		return ret;
+
+	ret = pcachepmem_map(&ctx.map, path, true);
+	if (ret)
+		return ret;
+
+	/* a device the page cache sits in front of would be measured as DRAM */
+	if (!ctx.map.dax && !fstat(ctx.map.fd, &sb) && S_ISBLK(sb.st_mode)) {
+		printf("%s has no DAX mapping, only the page cache would be measured: not qualified\n"
+		       "benchmark the namespace in devdax mode (/dev/daxX.Y) or a file on a DAX filesystem\n",
+		       path);
+		ret = -EOPNOTSUPP;
+		goto unmap;
+	}
+
+	ctx.size = ctx.map.size < BENCH_SIZE_MAX ? ctx.map.size : BENCH_SIZE_MAX;
+	if (ctx.size < (uint64_t)ctx.nr_threads * BENCH_CHUNK) {
+		printf("%s is too small for %u threads per node\n", path, ctx.nr_threads);
+		ret = -EINVAL;
+		goto unmap;
+	}
+
+	ret = bench_find_nodes(&ctx);
+	if (ret)
+		goto unmap;
+
+	for (i = 0; i < ctx.nr_nodes; i++) {
+		for (t = 0; t < BENCH_NR_TESTS; t++) {
+			ret = bench_run_test(&ctx, &ctx.nodes[i], t);
+			if (ret)
+				goto free;
+		}
+	}
+
+	report = bench_report(&ctx, path, passed);
+	json_object_set_new(report, "result",
+			    json_string(*passed ? "pass" : options->co_warn ? "warn" : "fail"));
+
+	char *json_str = json_dumps(report, JSON_INDENT(4));
+	printf("%s\n", json_str);
+	free(json_str);
+	json_decref(report);
+free:
+	free(ctx.nodes);
+unmap:
+	pcachepmem_unmap(&ctx.map);
+	return ret;
+}
+
+int pcache_pmem_bench(pcache_opt_t *options)
+{
+	bool passed;
+	int ret;
+
+	ret = bench_run(options, false, &passed);
+	if (ret)
+		return ret;
+
+	return passed || options->co_warn ? 0 : -EIO;
+}
+
+/* cache-start --bench: benchmark the device and refuse to format a slow one */
+int pcache_pmem_qualify(pcache_opt_t *options)
+{
+	bool passed;
+	int ret;
+
+	if (!options->co_format) {
+		printf("--bench overwrites the device, it is only allowed with --format\n");
+		return -EINVAL;
+	}
+
+	ret = bench_run(options, true, &passed);
+	if (ret)
+		return ret;
+
+	if (!passed && !options->co_warn) {
+		printf("%s failed qualification, not formatting it (--warn to format anyway)\n",
+		       options->co_path);
+		return -EIO;
+	}
+
+	return 0;
+}
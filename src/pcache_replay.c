@@ -0,0 +1,758 @@
+/* O_DIRECT */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <jansson.h>
+
+#include "pcache.h"
+#include "libpcachedev.h"
+#include "libpcacheuring.h"
+#include "libpcachetrace.h"
+
+/*
+ * pcache replay: re-issue a captured block trace against a pcache logical
+ * device or a stand-in file.
+ *
+ * One reader thread streams the trace and hands each I/O to a submission
+ * thread chosen by its LBA stripe, through a bounded per-thread queue, so the
+ * trace never has to fit in memory and I/Os to the same stripe keep their
+ * order. Every submission thread owns an io_uring and issues its I/Os at
+ * their scheduled time (the trace timestamp divided by --speed), or as soon
+ * as queue depth allows with --speed max. The main thread prints one
+ * NDJSON report per --interval with latency percentiles and achieved versus
+ * scheduled rate, then a summary.
+ *
+ * Traces are blkparse text output or the compact binary format of
+ * libpcachetrace, which "replay -o" converts text traces into.
+ */
+
+#define REPLAY_QUEUE		4096	/* I/Os queued per submission thread, power of 2 */
+#define REPLAY_STRIPE_SHIFT	20	/* 1 MiB LBA stripes per shard */
+#define REPLAY_MAX_IO		(1024 * 1024)
+#define REPLAY_ALIGN		4096
+#define REPLAY_TARGET_SLOTS	8
+#define REPLAY_IDLE_NS		100000ULL
+#define REPLAY_SLICE_NS		(NSEC_PER_SEC / 10)	/* longest wait before checking replay_stop */
+
+#define NSEC_PER_SEC		1000000000ULL
+
+/* Log-linear latency histogram: 32 sub-buckets per power of two, in ns */
+#define HIST_SUB_BITS		5
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* queued I/Os carry their issue deadline in time_ns */
+#define replay_io pcachetrace_io
+
+struct replay_ctx;
+
+struct replay_worker {
+	struct replay_ctx	*ctx;
+	pthread_t		thread;
+	struct pcache_uring	ring;
+	void			*buf;
+
+	/* single producer (reader), single consumer (this worker) */
+	struct replay_io	*queue;
+	unsigned int		head;
+	unsigned int		tail;
+
+	uint64_t		*submit_ns;
+	unsigned int		*free_slots;
+	unsigned int		nr_free;
+	int			err;
+
+	/* counters, swapped out by the reporter */
+	uint64_t		hist[HIST_BUCKETS];
+	uint64_t		ios;
+	uint64_t		bytes;
+	uint64_t		errors;
+	uint64_t		lag_ns;
+	bool			done;
+};
+
+struct replay_ctx {
+	int			fd;
+	uint64_t		size;
+	double			speed;		/* 0 for as fast as possible */
+	unsigned int		depth;
+	uint64_t		interval_ns;
+	unsigned int		nr_workers;
+	struct replay_worker	*workers;
+
+	uint64_t		start_ns;	/* set by the reader at the first I/O */
+	uint64_t		trace_start_ns;
+	uint64_t		trace_last_ns;
+	bool			eof;
+	int			reader_err;
+
+	unsigned long		nr_ios;
+	unsigned long		wrapped;	/* offsets folded into the target size */
+	unsigned long		clamped;	/* I/Os larger than REPLAY_MAX_IO */
+	unsigned long		skipped;
+
+	/* scheduled I/Os per interval, ring indexed by interval number */
+	uint64_t		target[REPLAY_TARGET_SLOTS];
+};
+
+struct replay_stats {
+	uint64_t	hist[HIST_BUCKETS];
+	uint64_t	ios;
+	uint64_t	bytes;
+	uint64_t	errors;
+	uint64_t	lag_ns;
+};
+
+static volatile sig_atomic_t replay_stop;
+
+static void replay_signal(int sig)
+{
+	replay_stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / NSEC_PER_SEC,
+		.tv_nsec = deadline % NSEC_PER_SEC,
+	};
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts = { .tv_sec = ns / NSEC_PER_SEC, .tv_nsec = ns % NSEC_PER_SEC };
+
+	nanosleep(&ts, NULL);
+}
+
+/* Sleep in short slices so an interrupt is noticed during long trace gaps */
+static void sleep_until_stop(uint64_t deadline)
+{
+	uint64_t now;
+
+	while (!replay_stop && (now = now_ns()) < deadline)
+		sleep_ns(deadline - now < REPLAY_SLICE_NS ? deadline - now : REPLAY_SLICE_NS);
+}
+
+static unsigned int hist_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < 2 * HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* midpoint of a bucket, in ns */
+static double hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < 2 * HIST_SUB)
+		return idx;
+
+	shift = idx / HIST_SUB - 1;
+	return (double)((uint64_t)(HIST_SUB + idx % HIST_SUB) << shift) + ((1ULL << shift) - 1) / 2.0;
+}
+
+static json_t *hist_to_json(const uint64_t *hist)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	static const char *names[] = { "p50", "p90", "p99", "p99.9" };
+	uint64_t total = 0, cum = 0;
+	json_t *obj = json_object();
+	unsigned int i, p = 0;
+	int last = -1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += hist[i];
+		if (hist[i])
+			last = i;
+	}
+	if (!total)
+		return obj;
+
+	for (i = 0; i < HIST_BUCKETS && p < 4; i++) {
+		cum += hist[i];
+		while (p < 4 && cum * 100.0 >= pcts[p] * total) {
+			json_object_set_new(obj, names[p], json_real(hist_value(i) / 1000.0));
+			p++;
+		}
+	}
+	json_object_set_new(obj, "max", json_real(hist_value(last) / 1000.0));
+
+	return obj;
+}
+
+static int replay_convert(const char *trace_path, const char *out_path)
+{
+	struct pcachetrace trace;
+	struct pcachetrace_io io;
+	unsigned long nr = 0;
+	FILE *out;
+	int ret;
+
+	ret = pcachetrace_open(&trace, trace_path);
+	if (ret)
+		return ret;
+
+	out = fopen(out_path, "w");
+	if (!out) {
+		ret = -errno;
+		printf("failed to create %s: %s\n", out_path, strerror(-ret));
+		pcachetrace_close(&trace);
+		return ret;
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+	ret = pcachetrace_write_header(out);
+	while (!ret && (ret = pcachetrace_next(&trace, &io)) > 0) {
+		ret = pcachetrace_write(out, &io);
+		nr++;
+	}
+
+	if (fclose(out) && !ret)
+		ret = -errno;
+	pcachetrace_close(&trace);
+
+	if (!ret)
+		printf("{ \"ios\": %lu, \"skipped\": %lu }\n", nr, trace.skipped);
+	return ret;
+}
+
+/* Submission threads */
+
+static void worker_reap(struct replay_worker *w, unsigned int *inflight)
+{
+	struct io_uring_cqe *cqe;
+	uint64_t now = 0;
+	unsigned int slot;
+
+	while (pcache_uring_peek_cqe(&w->ring, &cqe) == 0) {
+		if (!now)
+			now = now_ns();
+
+		slot = cqe->user_data;
+		__atomic_fetch_add(&w->hist[hist_bucket(now - w->submit_ns[slot])], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&w->ios, 1, __ATOMIC_RELAXED);
+		if (cqe->res < 0)
+			__atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&w->bytes, cqe->res, __ATOMIC_RELAXED);
+
+		w->free_slots[w->nr_free++] = slot;
+		(*inflight)--;
+		pcache_uring_cqe_seen(&w->ring);
+	}
+}
+
+static void worker_wait(struct replay_worker *w, unsigned int *inflight, uint64_t timeout_ns)
+{
+	struct io_uring_cqe *cqe;
+
+	if (*inflight)
+		pcache_uring_wait_cqe_timeout(&w->ring, &cqe, timeout_ns);
+	else
+		sleep_ns(timeout_ns);
+
+	worker_reap(w, inflight);
+}
+
+static void *worker_fn(void *data)
+{
+	struct replay_worker *w = data;
+	struct replay_ctx *ctx = w->ctx;
+	struct io_uring_sqe *sqe;
+	struct replay_io *io;
+	unsigned int inflight = 0, tail, slot;
+	uint64_t now, lag = 0;
+	int ret;
+
+	for (;;) {
+		worker_reap(w, &inflight);
+
+		/* interrupted: let what is in flight complete, drop the rest */
+		if (replay_stop) {
+			if (!inflight)
+				break;
+			worker_wait(w, &inflight, NSEC_PER_SEC);
+			continue;
+		}
+
+		tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+		if (w->head == tail) {
+			if (__atomic_load_n(&ctx->eof, __ATOMIC_ACQUIRE) &&
+			    w->head == __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+				if (!inflight)
+					break;
+				worker_wait(w, &inflight, NSEC_PER_SEC);
+				continue;
+			}
+			worker_wait(w, &inflight, REPLAY_IDLE_NS);
+			continue;
+		}
+
+		io = &w->queue[w->head & (REPLAY_QUEUE - 1)];
+		now = now_ns();
+		if (io->time_ns > now) {
+			/* bounded so an interrupt during a long trace gap is noticed */
+			if (inflight)
+				worker_wait(w, &inflight, io->time_ns - now < REPLAY_SLICE_NS ?
+							  io->time_ns - now : REPLAY_SLICE_NS);
+			else
+				sleep_until_ns(io->time_ns < now + REPLAY_SLICE_NS ?
+					       io->time_ns : now + REPLAY_SLICE_NS);
+			continue;
+		}
+
+		if (inflight == ctx->depth) {
+			worker_wait(w, &inflight, NSEC_PER_SEC);
+			continue;
+		}
+
+		/* issue everything that is due, up to the queue depth */
+		while (w->head != tail && inflight < ctx->depth) {
+			io = &w->queue[w->head & (REPLAY_QUEUE - 1)];
+			if (io->time_ns > now)
+				break;
+
+			sqe = pcache_uring_get_sqe(&w->ring);
+			if (!sqe)
+				break;
+
+			slot = w->free_slots[--w->nr_free];
+			pcache_uring_prep_rw(sqe, io->flags & PCACHETRACE_F_WRITE ? IORING_OP_WRITE : IORING_OP_READ,
+					     ctx->fd, w->buf, io->len, io->offset);
+			sqe->user_data = slot;
+			w->submit_ns[slot] = now;
+			if (ctx->speed > 0)
+				lag += now - io->time_ns;
+
+			w->head++;
+			inflight++;
+		}
+		__atomic_store_n(&w->head, w->head, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&w->lag_ns, lag, __ATOMIC_RELAXED);
+		lag = 0;
+
+		ret = pcache_uring_submit(&w->ring, 0);
+		if (ret < 0) {
+			w->err = ret;
+			break;
+		}
+	}
+
+	__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int worker_init(struct replay_ctx *ctx, struct replay_worker *w)
+{
+	unsigned int i;
+	int ret;
+
+	w->ring.fd = -1;
+	w->queue = malloc(sizeof(*w->queue) * REPLAY_QUEUE);
+	w->submit_ns = calloc(ctx->depth, sizeof(*w->submit_ns));
+	w->free_slots = malloc(sizeof(*w->free_slots) * ctx->depth);
+	if (!w->queue || !w->submit_ns || !w->free_slots)
+		return -ENOMEM;
+
+	if (posix_memalign(&w->buf, REPLAY_ALIGN, REPLAY_MAX_IO))
+		return -ENOMEM;
+	memset(w->buf, 0xa5, REPLAY_MAX_IO);
+
+	for (i = 0; i < ctx->depth; i++)
+		w->free_slots[i] = i;
+	w->nr_free = ctx->depth;
+
+	ret = pcache_uring_init(&w->ring, ctx->depth, 0);
+	if (ret) {
+		printf("failed to set up io_uring: %s\n", strerror(-ret));
+	}
+	return ret;
+}
+
+static void worker_free(struct replay_worker *w)
+{
+	if (w->ctx)
+		pcache_uring_exit(&w->ring);
+	w->ctx = NULL;
+	free(w->queue);
+	free(w->submit_ns);
+	free(w->free_slots);
+	free(w->buf);
+}
+
+/* Reader */
+
+struct replay_reader {
+	struct replay_ctx	*ctx;
+	struct pcachetrace	*trace;
+	pthread_t		thread;
+};
+
+static void reader_push(struct replay_ctx *ctx, const struct replay_io *io)
+{
+	struct replay_worker *w = &ctx->workers[(io->offset >> REPLAY_STRIPE_SHIFT) % ctx->nr_workers];
+
+	while (w->tail - __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) >= REPLAY_QUEUE) {
+		if (replay_stop || __atomic_load_n(&w->done, __ATOMIC_ACQUIRE))
+			return;
+		sleep_ns(REPLAY_IDLE_NS);
+	}
+
+	w->queue[w->tail & (REPLAY_QUEUE - 1)] = *io;
+	__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *reader_fn(void *data)
+{
+	struct replay_reader *reader = data;
+	struct replay_ctx *ctx = reader->ctx;
+	uint64_t deadline, slot;
+	struct replay_io io;
+	int ret = 0;
+
+	while (!replay_stop && (ret = pcachetrace_next(reader->trace, &io)) > 0) {
+		if (!ctx->nr_ios) {
+			ctx->trace_start_ns = io.time_ns;
+			__atomic_store_n(&ctx->start_ns, now_ns(), __ATOMIC_RELEASE);
+		}
+		ctx->nr_ios++;
+		if (io.time_ns > ctx->trace_last_ns)
+			ctx->trace_last_ns = io.time_ns;
+
+		if (io.len > REPLAY_MAX_IO) {
+			io.len = REPLAY_MAX_IO;
+			ctx->clamped++;
+		}
+		if (io.offset + io.len > ctx->size) {
+			io.offset = (io.offset % (ctx->size - io.len + 1)) & ~(uint64_t)(REPLAY_ALIGN - 1);
+			ctx->wrapped++;
+		}
+
+		if (ctx->speed > 0) {
+			/* blkparse timestamps can step back slightly across CPUs */
+			if (io.time_ns < ctx->trace_start_ns)
+				io.time_ns = ctx->trace_start_ns;
+			deadline = ctx->start_ns + (uint64_t)((io.time_ns - ctx->trace_start_ns) / ctx->speed);
+			io.time_ns = deadline;
+
+			/* stay at most two intervals ahead, which also bounds lookahead */
+			if (deadline > now_ns() + 2 * ctx->interval_ns)
+				sleep_until_stop(deadline - ctx->interval_ns);
+
+			slot = (deadline - ctx->start_ns) / ctx->interval_ns;
+			__atomic_fetch_add(&ctx->target[slot % REPLAY_TARGET_SLOTS], 1, __ATOMIC_RELAXED);
+		} else {
+			io.time_ns = 0;
+		}
+
+		reader_push(ctx, &io);
+	}
+
+	if (ret < 0)
+		ctx->reader_err = ret;
+	ctx->skipped = reader->trace->skipped;
+	__atomic_store_n(&ctx->eof, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Reporting */
+
+static void stats_swap(struct replay_ctx *ctx, struct replay_stats *stats)
+{
+	struct replay_worker *w;
+	unsigned int i, b;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ctx->nr_workers; i++) {
+		w = &ctx->workers[i];
+		for (b = 0; b < HIST_BUCKETS; b++)
+			stats->hist[b] += __atomic_exchange_n(&w->hist[b], 0, __ATOMIC_RELAXED);
+		stats->ios += __atomic_exchange_n(&w->ios, 0, __ATOMIC_RELAXED);
+		stats->bytes += __atomic_exchange_n(&w->bytes, 0, __ATOMIC_RELAXED);
+		stats->errors += __atomic_exchange_n(&w->errors, 0, __ATOMIC_RELAXED);
+		stats->lag_ns += __atomic_exchange_n(&w->lag_ns, 0, __ATOMIC_RELAXED);
+	}
+}
+
+static void stats_add(struct replay_stats *total, const struct replay_stats *stats)
+{
+	unsigned int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		total->hist[b] += stats->hist[b];
+	total->ios += stats->ios;
+	total->bytes += stats->bytes;
+	total->errors += stats->errors;
+	total->lag_ns += stats->lag_ns;
+}
+
+static void report_print(json_t *obj)
+{
+	char *json_str = json_dumps(obj, JSON_COMPACT | JSON_REAL_PRECISION(6));
+
+	printf("%s\n", json_str);
+	fflush(stdout);
+	free(json_str);
+	json_decref(obj);
+}
+
+static void report_interval(struct replay_ctx *ctx, const struct replay_stats *stats,
+			    uint64_t interval, double elapsed, double seconds)
+{
+	json_t *obj = json_object();
+	uint64_t target;
+
+	json_object_set_new(obj, "time", json_real(elapsed));
+	json_object_set_new(obj, "ios", json_integer(stats->ios));
+	json_object_set_new(obj, "iops", json_real(stats->ios / seconds));
+	if (ctx->speed > 0) {
+		target = __atomic_exchange_n(&ctx->target[interval % REPLAY_TARGET_SLOTS], 0, __ATOMIC_RELAXED);
+		json_object_set_new(obj, "target_iops", json_real(target / seconds));
+		json_object_set_new(obj, "lag_ms", json_real(stats->ios ? stats->lag_ns / 1e6 / stats->ios : 0));
+	}
+	json_object_set_new(obj, "MBps", json_real(stats->bytes / seconds / 1e6));
+	json_object_set_new(obj, "errors", json_integer(stats->errors));
+	json_object_set_new(obj, "lat_us", hist_to_json(stats->hist));
+
+	report_print(obj);
+}
+
+static void report_summary(struct replay_ctx *ctx, const struct replay_stats *total, double elapsed)
+{
+	json_t *summary = json_object();
+	json_t *obj = json_object();
+	double trace_seconds;
+
+	json_object_set_new(summary, "runtime", json_real(elapsed));
+	json_object_set_new(summary, "ios", json_integer(total->ios));
+	json_object_set_new(summary, "iops", json_real(elapsed > 0 ? total->ios / elapsed : 0));
+	if (ctx->speed > 0) {
+		trace_seconds = (ctx->trace_last_ns - ctx->trace_start_ns) / 1e9 / ctx->speed;
+		json_object_set_new(summary, "target_iops",
+				    json_real(trace_seconds > 0 ? ctx->nr_ios / trace_seconds : 0));
+		json_object_set_new(summary, "lag_ms",
+				    json_real(total->ios ? total->lag_ns / 1e6 / total->ios : 0));
+	}
+	json_object_set_new(summary, "MBps", json_real(elapsed > 0 ? total->bytes / elapsed / 1e6 : 0));
+	json_object_set_new(summary, "errors", json_integer(total->errors));
+	json_object_set_new(summary, "wrapped", json_integer(ctx->wrapped));
+	json_object_set_new(summary, "clamped", json_integer(ctx->clamped));
+	json_object_set_new(summary, "skipped_lines", json_integer(ctx->skipped));
+	json_object_set_new(summary, "lat_us", hist_to_json(total->hist));
+	json_object_set_new(obj, "summary", summary);
+
+	report_print(obj);
+}
+
+static bool workers_done(struct replay_ctx *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr_workers; i++) {
+		if (!__atomic_load_n(&ctx->workers[i].done, __ATOMIC_ACQUIRE))
+			return false;
+	}
+	return true;
+}
+
+static int replay_open_target(struct replay_ctx *ctx, const char *path, bool force)
+{
+	struct stat sb;
+	int ret;
+
+	if (stat(path, &sb)) {
+		ret = -errno;
+		printf("failed to stat %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (S_ISBLK(sb.st_mode) && !force) {
+		printf("%s is a block device, replayed writes overwrite its data; pass --force\n", path);
+		return -EPERM;
+	}
+
+	/* page cache would hide the device, but tmpfs and friends refuse O_DIRECT */
+	ctx->fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+	if (ctx->fd < 0 && errno == EINVAL)
+		ctx->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (ctx->fd < 0) {
+		ret = -errno;
+		printf("failed to open %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	ret = pcachedev_size(ctx->fd, &ctx->size);
+	if (ret) {
+		printf("failed to get the size of %s: %s\n", path, strerror(-ret));
+	} else if (ctx->size < REPLAY_MAX_IO) {
+		printf("%s is smaller than %u bytes\n", path, REPLAY_MAX_IO);
+		ret = -EINVAL;
+	}
+	if (ret) {
+		close(ctx->fd);
+		return ret;
+	}
+
+	return 0;
+}
+
+int pcache_replay(pcache_opt_t *options)
+{
+	struct sigaction sa = { .sa_handler = replay_signal };
+	struct replay_stats *stats = NULL, *total = NULL;
+	struct replay_ctx ctx = { .fd = -1 };
+	struct replay_reader reader = { 0 };
+	struct pcachetrace trace;
+	char path[PCACHE_PATH_LEN];
+	uint64_t next, now, interval = 0;
+	double elapsed, seconds;
+	unsigned int i, started = 0;
+	bool done = false;
+	int ret;
+
+	if (!strlen(options->co_trace_path)) {
+		printf("--trace is required\n");
+		return -EINVAL;
+	}
+
+	if (strlen(options->co_output))
+		return replay_convert(options->co_trace_path, options->co_output);
+
+	if (options->co_dev_id != UINT_MAX)
+		snprintf(path, sizeof(path), "/dev/pcache%u", options->co_dev_id);
+	else if (strlen(options->co_path))
+		strcpy(path, options->co_path);
+	else {
+		printf("specify the target with --path or --dev\n");
+		return -EINVAL;
+	}
+
+	if (!options->co_interval || !options->co_queues || !options->co_depth) {
+		printf("--interval, --queues and --depth must be at least 1\n");
+		return -EINVAL;
+	}
+
+	ctx.speed = options->co_speed;
+	ctx.depth = options->co_depth;
+	ctx.nr_workers = options->co_queues;
+	ctx.interval_ns = options->co_interval * NSEC_PER_SEC;
+
+	ret = replay_open_target(&ctx, path, options->co_force);
+	if (ret)
+		return ret;
+
+	ret = pcachetrace_open(&trace, options->co_trace_path);
+	if (ret)
+		goto close_target;
+
+	stats = malloc(sizeof(*stats));
+	total = calloc(1, sizeof(*total));
+	ctx.workers = calloc(ctx.nr_workers, sizeof(*ctx.workers));
+	if (!stats || !total || !ctx.workers) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 0; i < ctx.nr_workers; i++) {
+		ctx.workers[i].ctx = &ctx;
+		ret = worker_init(&ctx, &ctx.workers[i]);
+		if (ret)
+			goto free;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < ctx.nr_workers; i++) {
+		ret = -pthread_create(&ctx.workers[i].thread, NULL, worker_fn, &ctx.workers[i]);
+		if (ret)
+			goto stop;
+		started++;
+	}
+
+	reader.ctx = &ctx;
+	reader.trace = &trace;
+	ret = -pthread_create(&reader.thread, NULL, reader_fn, &reader);
+	if (ret)
+		goto stop;
+
+	/* the clock starts with the first I/O */
+	while (!(now = __atomic_load_n(&ctx.start_ns, __ATOMIC_ACQUIRE)) &&
+	       !__atomic_load_n(&ctx.eof, __ATOMIC_ACQUIRE))
+		sleep_ns(REPLAY_IDLE_NS);
+
+	next = now + ctx.interval_ns;
+	while (now && !done) {
+		while (!(done = workers_done(&ctx)) && now_ns() < next)
+			sleep_ns(REPLAY_IDLE_NS * 10);
+
+		now = now_ns();
+		seconds = (double)(now - (next - ctx.interval_ns)) / 1e9;
+		elapsed = (double)(now - ctx.start_ns) / 1e9;
+
+		stats_swap(&ctx, stats);
+		stats_add(total, stats);
+		if (stats->ios || !done)
+			report_interval(&ctx, stats, interval, elapsed, seconds);
+
+		interval++;
+		next += ctx.interval_ns;
+	}
+
+	pthread_join(reader.thread, NULL);
+	ret = ctx.reader_err;
+stop:
+	/* on a setup failure the workers are told the trace is over */
+	__atomic_store_n(&ctx.eof, true, __ATOMIC_RELEASE);
+	for (i = 0; i < started; i++) {
+		pthread_join(ctx.workers[i].thread, NULL);
+		if (!ret)
+			ret = ctx.workers[i].err;
+	}
+
+	if (!ctx.nr_ios && !ret)
+		printf("no replayable I/O in %s\n", options->co_trace_path);
+
+	if (ctx.start_ns) {
+		stats_swap(&ctx, stats);
+		stats_add(total, stats);
+		report_summary(&ctx, total, (double)(now_ns() - ctx.start_ns) / 1e9);
+	}
+free:
+	for (i = 0; ctx.workers && i < ctx.nr_workers; i++)
+		worker_free(&ctx.workers[i]);
+	free(ctx.workers);
+	free(stats);
+	free(total);
+	pcachetrace_close(&trace);
+close_target:
+	close(ctx.fd);
+	return ret;
+}
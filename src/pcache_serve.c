@@ -0,0 +1,1041 @@
+/* accept4 */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <jansson.h>
+
+#include "pcache.h"
+#include "libpcachesys.h"
+#include "libpcachesnap.h"
+
+/*
+ * pcache serve: a long-lived command server for orchestration agents, so a
+ * reconcile loop does not pay process start-up and a fresh sysfs walk for
+ * every operation.
+ *
+ * Requests and replies are newline-delimited JSON objects, on stdin/stdout
+ * with --stdio or on a unix socket. Each request names an "op" (start, stop,
+ * list or find) and may carry an "id" that is echoed in its reply:
+ *
+ *   {"id": 1, "op": "start", "cache": 0, "path": "/dev/sdb", "cache_size": 1024}
+ *   {"id": 1, "ok": true, "result": {"backing_id": 2, ..., "cache_id": 0}}
+ *   {"id": 2, "ok": false, "errno": 110, "error": "Connection timed out"}
+ *
+ * stop names its "target", "cache" or "backing", and a member an op does not
+ * take is refused, so a misspelt one cannot fall back to a default.
+ *
+ * --queues workers run the requests. Requests of one client that touch the
+ * same cache run in the order they arrived, a request for all caches waits
+ * for the client's earlier requests and holds back its later ones, and
+ * everything else runs concurrently, so replies may come out of order.
+ * Mutations take the usual per-cache flock(2) locks and so serialise with
+ * other pcache commands and other clients.
+ *
+ * list and find are answered from an inventory read through kept-open sysfs
+ * handles. It is re-read after each of the server's own mutations, when it
+ * is older than --interval seconds, or when a request asks for "refresh".
+ * The inventory is read without taking cache locks, as workers may hold
+ * them.
+ */
+
+#define SERVE_LINE_MAX		65536
+#define SERVE_QUEUE_MAX		1024
+#define SERVE_CONN_MAX		64
+#define SERVE_BACKLOG		16
+#define SERVE_IO_TIMEOUT_MS	5000
+
+/* Key of requests that look at every cache */
+#define SERVE_KEY_ALL		UINT64_MAX
+
+enum serve_op {
+	SERVE_OP_START	= 0,
+	SERVE_OP_STOP,
+	SERVE_OP_LIST,
+	SERVE_OP_FIND,
+	SERVE_OP_MAX,
+};
+
+static const char *serve_op_names[SERVE_OP_MAX] = {
+	[SERVE_OP_START]	= "start",
+	[SERVE_OP_STOP]		= "stop",
+	[SERVE_OP_LIST]		= "list",
+	[SERVE_OP_FIND]		= "find",
+};
+
+/* Members each op accepts besides "id" and "op", NULL terminated */
+static const char *const serve_op_members[SERVE_OP_MAX][8] = {
+	[SERVE_OP_START]	= { "cache", "path", "force", "format", "queues", "cache_size", "data_crc" },
+	[SERVE_OP_STOP]		= { "cache", "target", "backing" },
+	[SERVE_OP_LIST]		= { "cache", "refresh" },
+	[SERVE_OP_FIND]		= { "path", "refresh" },
+};
+
+struct serve_conn {
+	int		in_fd;
+	int		out_fd;
+	pthread_mutex_t	write_lock;
+	unsigned int	refs;		/* the reader's plus one per pending request, under serve->lock */
+	bool		broken;		/* a reply failed to go out, drop the rest */
+	bool		discard;	/* skipping the rest of an overlong line */
+	size_t		len;
+	char		*buf;
+};
+
+struct serve_req {
+	struct serve_req	*next;
+	struct serve_conn	*conn;
+	json_t			*msg;
+	enum serve_op		op;
+	uint64_t		key;	/* cache ID, PCACHESYS_LOCK_REGISTER or SERVE_KEY_ALL */
+};
+
+struct serve_inventory {
+	pthread_mutex_t			lock;
+	struct pcachesnap		snap;
+	struct pcachesnap_handles	handles;
+	bool				valid;
+	double				refreshed;
+};
+
+struct serve;
+
+struct serve_worker {
+	struct serve		*srv;
+	pthread_t		thread;
+	struct serve_req	*running;	/* under serve->lock */
+};
+
+struct serve {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* a request may have become runnable */
+	pthread_cond_t		idle;		/* a request finished */
+	struct serve_req	*head;
+	struct serve_req	**tail;
+	unsigned int		queued;
+	bool			exiting;
+
+	struct serve_worker	*workers;
+	unsigned int		nr_workers;
+
+	struct serve_inventory	inv;
+	double			max_age;
+	int			lock_timeout_ms;
+
+	int			listen_fd;
+	char			unix_path[PCACHE_PATH_LEN];
+	struct serve_conn	*conns[SERVE_CONN_MAX];
+	unsigned int		nr_conns;
+};
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+	serve_stop = 1;
+}
+
+static double serve_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct serve_conn *serve_conn_new(int in_fd, int out_fd)
+{
+	struct serve_conn *conn = calloc(1, sizeof(*conn));
+
+	if (!conn)
+		return NULL;
+
+	conn->buf = malloc(SERVE_LINE_MAX);
+	if (!conn->buf) {
+		free(conn);
+		return NULL;
+	}
+
+	conn->in_fd = in_fd;
+	conn->out_fd = out_fd;
+	conn->refs = 1;
+	pthread_mutex_init(&conn->write_lock, NULL);
+
+	return conn;
+}
+
+/* Called with serve->lock held */
+static void serve_conn_put(struct serve_conn *conn)
+{
+	if (--conn->refs)
+		return;
+
+	if (conn->in_fd != conn->out_fd && conn->in_fd != STDIN_FILENO)
+		close(conn->in_fd);
+	close(conn->out_fd);
+	pthread_mutex_destroy(&conn->write_lock);
+	free(conn->buf);
+	free(conn);
+}
+
+static void serve_reply(struct serve_conn *conn, json_t *id, int ret, json_t *result, const char *msg)
+{
+	json_t *reply = json_object();
+	char *str;
+	size_t off, len;
+	ssize_t n;
+
+	json_object_set_new(reply, "id", id ? json_incref(id) : json_null());
+	json_object_set_new(reply, "ok", json_boolean(!ret));
+	if (ret) {
+		json_object_set_new(reply, "errno", json_integer(-ret));
+		json_object_set_new(reply, "error", json_string(msg && msg[0] ? msg : strerror(-ret)));
+		json_decref(result);
+	} else {
+		json_object_set_new(reply, "result", result ? result : json_null());
+	}
+
+	str = json_dumps(reply, JSON_COMPACT);
+	json_decref(reply);
+	if (!str)
+		return;
+
+	/* one write per reply keeps replies whole on the stream */
+	len = strlen(str);
+	str[len++] = '\n';
+
+	pthread_mutex_lock(&conn->write_lock);
+	for (off = 0; off < len && !conn->broken; off += n) {
+		n = send(conn->out_fd, str + off, len - off, MSG_NOSIGNAL);
+		if (n < 0 && errno == ENOTSOCK)
+			n = write(conn->out_fd, str + off, len - off);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			conn->broken = true;
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+
+	free(str);
+}
+
+/* Request members */
+
+static int req_cache_id(json_t *msg, bool required, unsigned int *cache_id, char *err, size_t err_len)
+{
+	json_t *val = json_object_get(msg, "cache");
+
+	if (!val) {
+		if (required)
+			snprintf(err, err_len, "\"cache\" is required");
+		return required ? -EINVAL : -ENOENT;
+	}
+
+	if (!json_is_integer(val) || json_integer_value(val) < 0 ||
+	    json_integer_value(val) >= PCACHE_CACHE_MAX) {
+		snprintf(err, err_len, "\"cache\" must be a cache ID");
+		return -EINVAL;
+	}
+
+	*cache_id = json_integer_value(val);
+	return 0;
+}
+
+static int req_uint(json_t *msg, const char *name, unsigned int def, unsigned int *out,
+		    char *err, size_t err_len)
+{
+	json_t *val = json_object_get(msg, name);
+
+	*out = def;
+	if (!val)
+		return 0;
+
+	if (!json_is_integer(val) || json_integer_value(val) < 0 ||
+	    json_integer_value(val) > UINT_MAX) {
+		snprintf(err, err_len, "\"%s\" must be an unsigned integer", name);
+		return -EINVAL;
+	}
+
+	*out = json_integer_value(val);
+	return 0;
+}
+
+static int req_bool(json_t *msg, const char *name, bool *out, char *err, size_t err_len)
+{
+	json_t *val = json_object_get(msg, name);
+
+	*out = false;
+	if (!val)
+		return 0;
+
+	if (!json_is_boolean(val)) {
+		snprintf(err, err_len, "\"%s\" must be true or false", name);
+		return -EINVAL;
+	}
+
+	*out = json_is_true(val);
+	return 0;
+}
+
+/* A misspelt member must not silently fall back to a default, refuse it */
+static int req_check_members(json_t *msg, enum serve_op op, char *err, size_t err_len)
+{
+	const char *const *names = serve_op_members[op];
+	const char *key;
+	json_t *val;
+	unsigned int i;
+
+	json_object_foreach(msg, key, val) {
+		if (!strcmp(key, "id") || !strcmp(key, "op"))
+			continue;
+		for (i = 0; names[i]; i++) {
+			if (!strcmp(key, names[i]))
+				break;
+		}
+		if (!names[i]) {
+			snprintf(err, err_len, "unknown member \"%.64s\" for %s", key, serve_op_names[op]);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static const char *req_path(json_t *msg, char *err, size_t err_len)
+{
+	json_t *val = json_object_get(msg, "path");
+
+	if (!json_is_string(val) || !json_string_value(val)[0] ||
+	    strlen(json_string_value(val)) >= PCACHE_PATH_LEN) {
+		snprintf(err, err_len, "\"path\" must be a path");
+		return NULL;
+	}
+
+	return json_string_value(val);
+}
+
+/* Inventory */
+
+/* Called with inv->lock held */
+static int serve_inventory_get(struct serve *srv, bool refresh)
+{
+	struct serve_inventory *inv = &srv->inv;
+	double now = serve_now();
+	int ret;
+
+	if (inv->valid && !refresh && now - inv->refreshed < srv->max_age)
+		return 0;
+
+	ret = pcachesnap_collect_cached(&inv->snap, &inv->handles, PCACHESNAP_ALL_CACHES);
+	inv->valid = !ret;
+	inv->refreshed = now;
+
+	return ret;
+}
+
+static void serve_inventory_invalidate(struct serve *srv)
+{
+	pthread_mutex_lock(&srv->inv.lock);
+	srv->inv.valid = false;
+	pthread_mutex_unlock(&srv->inv.lock);
+}
+
+/* Newest backing on @path, of @cache_id or of any cache, or -1 */
+static int serve_find_backing(const struct pcachesnap *snap, unsigned int cache_id, const char *path)
+{
+	int first = 0, nr = snap->backings.nr, i;
+
+	if (cache_id != PCACHESNAP_ALL_CACHES)
+		nr = pcachesnap_cache_backings(snap, cache_id, &first);
+
+	for (i = first + nr - 1; i >= first; i--) {
+		if (strcmp(pcachesnap_str(snap, snap->backings.backing_path[i]), path) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static json_t *serve_backing_to_json(const struct pcachesnap *snap, int idx)
+{
+	json_t *obj = pcache_backing_to_json(snap, idx);
+
+	json_object_set_new(obj, "cache_id", json_integer(snap->backings.cache_id[idx]));
+	return obj;
+}
+
+/*
+ * The record a mutation created, looked up in a fresh inventory. NULL when it
+ * does not show up, the reply then only says the write succeeded.
+ */
+static json_t *serve_lookup_new(struct serve *srv, unsigned int cache_id, const char *path)
+{
+	struct pcachesnap *snap = &srv->inv.snap;
+	struct pcachesnap one;
+	json_t *result = NULL;
+	int idx;
+
+	pthread_mutex_lock(&srv->inv.lock);
+
+	/* a new cache has no ID to scan by yet */
+	if (cache_id == PCACHESYS_LOCK_REGISTER) {
+		if (serve_inventory_get(srv, true))
+			goto out;
+		idx = pcachesnap_find_cache_path(snap, path);
+		if (idx >= 0)
+			result = pcache_cache_to_json(snap, idx);
+		goto out;
+	}
+
+	/* a new backing only needs its cache, the inventory stays invalid */
+	if (pcachesnap_init(&one))
+		goto out;
+	if (!pcachesnap_collect_cached(&one, &srv->inv.handles, cache_id)) {
+		idx = serve_find_backing(&one, cache_id, path);
+		if (idx >= 0)
+			result = serve_backing_to_json(&one, idx);
+	}
+	pcachesnap_free(&one);
+out:
+	pthread_mutex_unlock(&srv->inv.lock);
+	return result;
+}
+
+/* Operations, each returning 0 or -errno with an optional message in @err */
+
+static int serve_start(struct serve *srv, struct serve_req *req, json_t **result, char *err, size_t err_len)
+{
+	unsigned int cache_id = req->key, queues, cache_size;
+	struct pcachesys_lock lock;
+	bool force, format, data_crc;
+	const char *path;
+	int ret;
+
+	path = req_path(req->msg, err, err_len);
+	if (!path)
+		return -EINVAL;
+
+	if (cache_id == PCACHESYS_LOCK_REGISTER) {
+		if (json_object_get(req->msg, "queues") || json_object_get(req->msg, "cache_size") ||
+		    json_object_get(req->msg, "data_crc")) {
+			snprintf(err, err_len, "\"queues\", \"cache_size\" and \"data_crc\" need \"cache\"");
+			return -EINVAL;
+		}
+		if ((ret = req_bool(req->msg, "force", &force, err, err_len)) ||
+		    (ret = req_bool(req->msg, "format", &format, err, err_len)))
+			return ret;
+	} else {
+		if (json_object_get(req->msg, "force") || json_object_get(req->msg, "format")) {
+			snprintf(err, err_len, "\"force\" and \"format\" only apply without \"cache\"");
+			return -EINVAL;
+		}
+		if ((ret = req_uint(req->msg, "queues", 1, &queues, err, err_len)) ||
+		    (ret = req_uint(req->msg, "cache_size", 0, &cache_size, err, err_len)) ||
+		    (ret = req_bool(req->msg, "data_crc", &data_crc, err, err_len)))
+			return ret;
+	}
+
+	ret = pcachesys_lock_cache(&lock, cache_id, true, srv->lock_timeout_ms);
+	if (ret)
+		return ret;
+
+	if (cache_id == PCACHESYS_LOCK_REGISTER)
+		ret = pcache_cache_register(path, force, format);
+	else
+		ret = pcache_backing_adm_start(cache_id, path, queues, cache_size, data_crc);
+	serve_inventory_invalidate(srv);
+
+	/* still under the lock, so the record found is the one just created */
+	if (!ret)
+		*result = serve_lookup_new(srv, cache_id, path);
+
+	pcachesys_unlock(&lock);
+	return ret;
+}
+
+/*
+ * "target" names what goes away, "cache" or "backing", so a request that
+ * lost its "backing" member cannot tear down the whole cache instead.
+ */
+static int serve_stop_op(struct serve *srv, struct serve_req *req, json_t **result, char *err, size_t err_len)
+{
+	json_t *target = json_object_get(req->msg, "target");
+	json_t *backing = json_object_get(req->msg, "backing");
+	unsigned int cache_id = req->key, backing_id = 0;
+	struct pcachesys_lock lock;
+	bool whole_cache;
+	int ret;
+
+	if (!json_is_string(target) || (strcmp(json_string_value(target), "cache") &&
+					strcmp(json_string_value(target), "backing"))) {
+		snprintf(err, err_len, "\"target\" must be \"cache\" or \"backing\"");
+		return -EINVAL;
+	}
+	whole_cache = !strcmp(json_string_value(target), "cache");
+
+	if (whole_cache && backing) {
+		snprintf(err, err_len, "\"backing\" does not go with \"target\": \"cache\"");
+		return -EINVAL;
+	}
+	if (!whole_cache) {
+		if (!backing) {
+			snprintf(err, err_len, "\"backing\" is required");
+			return -EINVAL;
+		}
+		ret = req_uint(req->msg, "backing", 0, &backing_id, err, err_len);
+		if (ret)
+			return ret;
+	}
+
+	ret = pcachesys_lock_cache(&lock, cache_id, true, srv->lock_timeout_ms);
+	if (ret)
+		return ret;
+
+	if (whole_cache)
+		ret = pcache_cache_unregister(cache_id);
+	else
+		ret = pcache_backing_adm_stop(cache_id, backing_id);
+	serve_inventory_invalidate(srv);
+
+	pcachesys_unlock(&lock);
+	return ret;
+}
+
+static int serve_list(struct serve *srv, struct serve_req *req, json_t **result, char *err, size_t err_len)
+{
+	struct pcachesnap *snap = &srv->inv.snap;
+	unsigned int i;
+	int first, nr, j;
+	bool refresh;
+	int ret;
+
+	ret = req_bool(req->msg, "refresh", &refresh, err, err_len);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&srv->inv.lock);
+	ret = serve_inventory_get(srv, refresh);
+	if (ret)
+		goto out;
+
+	*result = json_array();
+	if (req->key == SERVE_KEY_ALL) {
+		for (i = 0; i < snap->caches.nr; i++)
+			json_array_append_new(*result, pcache_cache_to_json(snap, i));
+		goto out;
+	}
+
+	if (pcachesnap_find_cache(snap, req->key) < 0) {
+		snprintf(err, err_len, "cache %u not found", (unsigned int)req->key);
+		ret = -ENOENT;
+		goto out;
+	}
+
+	nr = pcachesnap_cache_backings(snap, req->key, &first);
+	for (j = first; j < first + nr; j++)
+		json_array_append_new(*result, pcache_backing_to_json(snap, j));
+out:
+	pthread_mutex_unlock(&srv->inv.lock);
+	return ret;
+}
+
+static int serve_find(struct serve *srv, struct serve_req *req, json_t **result, char *err, size_t err_len)
+{
+	struct pcachesnap *snap = &srv->inv.snap;
+	const char *path;
+	bool refresh;
+	int idx, ret;
+
+	path = req_path(req->msg, err, err_len);
+	if (!path)
+		return -EINVAL;
+
+	ret = req_bool(req->msg, "refresh", &refresh, err, err_len);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&srv->inv.lock);
+	ret = serve_inventory_get(srv, refresh);
+	if (ret)
+		goto out;
+
+	idx = serve_find_backing(snap, PCACHESNAP_ALL_CACHES, path);
+	if (idx >= 0) {
+		*result = serve_backing_to_json(snap, idx);
+		goto out;
+	}
+
+	idx = pcachesnap_find_cache_path(snap, path);
+	if (idx >= 0) {
+		*result = pcache_cache_to_json(snap, idx);
+		goto out;
+	}
+
+	snprintf(err, err_len, "no cache or backing on %s", path);
+	ret = -ENOENT;
+out:
+	pthread_mutex_unlock(&srv->inv.lock);
+	return ret;
+}
+
+static void serve_handle(struct serve *srv, struct serve_req *req)
+{
+	char err[PCACHE_PATH_LEN + 64] = { 0 };
+	json_t *result = NULL;
+	int ret;
+
+	switch (req->op) {
+	case SERVE_OP_START:
+		ret = serve_start(srv, req, &result, err, sizeof(err));
+		break;
+	case SERVE_OP_STOP:
+		ret = serve_stop_op(srv, req, &result, err, sizeof(err));
+		break;
+	case SERVE_OP_LIST:
+		ret = serve_list(srv, req, &result, err, sizeof(err));
+		break;
+	case SERVE_OP_FIND:
+		ret = serve_find(srv, req, &result, err, sizeof(err));
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	serve_reply(req->conn, json_object_get(req->msg, "id"), ret, result, err);
+}
+
+/* Scheduling */
+
+static bool serve_conflict(const struct serve_req *a, const struct serve_req *b)
+{
+	return a->conn == b->conn &&
+		(a->key == b->key || a->key == SERVE_KEY_ALL || b->key == SERVE_KEY_ALL);
+}
+
+/* First queued request not held back by an earlier one, called with serve->lock held */
+static struct serve_req *serve_pick(struct serve *srv)
+{
+	struct serve_req **pp, *req, *prev;
+	bool blocked;
+	unsigned int i;
+
+	for (pp = &srv->head; (req = *pp); pp = &req->next) {
+		blocked = false;
+		for (i = 0; i < srv->nr_workers && !blocked; i++)
+			blocked = srv->workers[i].running && serve_conflict(srv->workers[i].running, req);
+		for (prev = srv->head; prev != req && !blocked; prev = prev->next)
+			blocked = serve_conflict(prev, req);
+		if (blocked)
+			continue;
+
+		*pp = req->next;
+		if (srv->tail == &req->next)
+			srv->tail = pp;
+		srv->queued--;
+		return req;
+	}
+
+	return NULL;
+}
+
+static void *serve_worker_fn(void *arg)
+{
+	struct serve_worker *worker = arg;
+	struct serve *srv = worker->srv;
+	struct serve_req *req;
+
+	pthread_mutex_lock(&srv->lock);
+	while (true) {
+		while (!(req = serve_pick(srv)) && !srv->exiting)
+			pthread_cond_wait(&srv->work, &srv->lock);
+		if (!req)
+			break;
+
+		worker->running = req;
+		pthread_mutex_unlock(&srv->lock);
+
+		serve_handle(srv, req);
+		json_decref(req->msg);
+
+		pthread_mutex_lock(&srv->lock);
+		worker->running = NULL;
+		serve_conn_put(req->conn);
+		free(req);
+
+		/* requests held back by this one may run now */
+		pthread_cond_broadcast(&srv->work);
+		pthread_cond_broadcast(&srv->idle);
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	return NULL;
+}
+
+/* Called with serve->lock held */
+static bool serve_busy(struct serve *srv)
+{
+	unsigned int i;
+
+	if (srv->queued)
+		return true;
+
+	for (i = 0; i < srv->nr_workers; i++) {
+		if (srv->workers[i].running)
+			return true;
+	}
+
+	return false;
+}
+
+/* Parse one request line and queue it, or answer it right away if it is malformed */
+static void serve_line(struct serve *srv, struct serve_conn *conn, char *line, size_t len)
+{
+	char err[JSON_ERROR_TEXT_LENGTH + 64] = { 0 };
+	struct serve_req *req;
+	json_error_t jerr;
+	unsigned int cache_id = 0;
+	json_t *msg, *op;
+	int ret, i;
+
+	while (len && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+		len--;
+	if (!len)
+		return;
+
+	msg = json_loadb(line, len, 0, &jerr);
+	if (!json_is_object(msg)) {
+		if (msg)
+			snprintf(err, sizeof(err), "request must be a JSON object");
+		else
+			snprintf(err, sizeof(err), "invalid JSON: %s", jerr.text);
+		serve_reply(conn, NULL, -EINVAL, NULL, err);
+		json_decref(msg);
+		return;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		serve_reply(conn, json_object_get(msg, "id"), -ENOMEM, NULL, NULL);
+		json_decref(msg);
+		return;
+	}
+	req->msg = msg;
+	req->conn = conn;
+
+	op = json_object_get(msg, "op");
+	for (i = 0; i < SERVE_OP_MAX; i++) {
+		if (json_is_string(op) && strcmp(json_string_value(op), serve_op_names[i]) == 0)
+			break;
+	}
+	req->op = i;
+
+	ret = req->op < SERVE_OP_MAX ? req_check_members(msg, req->op, err, sizeof(err)) : 0;
+	if (ret) {
+		serve_reply(conn, json_object_get(msg, "id"), ret, NULL, err);
+		json_decref(msg);
+		free(req);
+		return;
+	}
+
+	ret = req_cache_id(msg, req->op == SERVE_OP_STOP, &cache_id, err, sizeof(err));
+	switch (req->op) {
+	case SERVE_OP_START:
+		req->key = ret ? PCACHESYS_LOCK_REGISTER : cache_id;
+		break;
+	case SERVE_OP_STOP:
+		req->key = cache_id;
+		break;
+	case SERVE_OP_LIST:
+		req->key = ret ? SERVE_KEY_ALL : cache_id;
+		break;
+	case SERVE_OP_FIND:
+		req->key = SERVE_KEY_ALL;
+		ret = 0;
+		break;
+	default:
+		snprintf(err, sizeof(err), "\"op\" must be start, stop, list or find");
+		ret = -EINVAL;
+		break;
+	}
+	if (ret == -ENOENT)
+		ret = 0;
+
+	if (ret) {
+		serve_reply(conn, json_object_get(msg, "id"), ret, NULL, err);
+		json_decref(msg);
+		free(req);
+		return;
+	}
+
+	pthread_mutex_lock(&srv->lock);
+	while (srv->queued >= SERVE_QUEUE_MAX)
+		pthread_cond_wait(&srv->idle, &srv->lock);
+
+	conn->refs++;
+	*srv->tail = req;
+	srv->tail = &req->next;
+	srv->queued++;
+	pthread_cond_signal(&srv->work);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/* Read what is there on @conn and queue every complete line, -errno or 0 on EOF */
+static int serve_read(struct serve *srv, struct serve_conn *conn)
+{
+	char *line, *nl;
+	ssize_t n;
+	size_t left;
+
+	n = read(conn->in_fd, conn->buf + conn->len, SERVE_LINE_MAX - conn->len);
+	if (n < 0)
+		return errno == EINTR || errno == EAGAIN ? 1 : -errno;
+	if (n == 0)
+		return 0;
+	conn->len += n;
+
+	line = conn->buf;
+	left = conn->len;
+	while ((nl = memchr(line, '\n', left))) {
+		if (!conn->discard)
+			serve_line(srv, conn, line, nl - line);
+		conn->discard = false;
+		left -= nl + 1 - line;
+		line = nl + 1;
+	}
+
+	if (left == SERVE_LINE_MAX) {
+		if (!conn->discard)
+			serve_reply(conn, NULL, -E2BIG, NULL, "request line too long");
+		conn->discard = true;
+		left = 0;
+	}
+
+	memmove(conn->buf, line, left);
+	conn->len = left;
+
+	return 1;
+}
+
+static int serve_listen(struct serve *srv, const char *addr)
+{
+	int fd;
+
+	if (strncmp(addr, "unix:", strlen("unix:")) != 0) {
+		printf("serve only listens on unix sockets: %s\n", addr);
+		return -EINVAL;
+	}
+
+	/* requests change the cache setup, only the owner may connect */
+	fd = pcachesys_listen_unix(addr + strlen("unix:"), SOCK_STREAM, 0177, SERVE_BACKLOG);
+	if (fd < 0)
+		return fd;
+
+	/* only a socket we bound is removed on exit */
+	snprintf(srv->unix_path, sizeof(srv->unix_path), "%s", addr + strlen("unix:"));
+	srv->listen_fd = fd;
+	return 0;
+}
+
+static void serve_accept(struct serve *srv)
+{
+	struct timeval tv = { SERVE_IO_TIMEOUT_MS / 1000, (SERVE_IO_TIMEOUT_MS % 1000) * 1000 };
+	struct serve_conn *conn;
+	int fd;
+
+	fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (srv->nr_conns == SERVE_CONN_MAX) {
+		close(fd);
+		return;
+	}
+
+	/* a client that stops reading must not hold a worker for long */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	conn = serve_conn_new(fd, fd);
+	if (!conn) {
+		close(fd);
+		return;
+	}
+	srv->conns[srv->nr_conns++] = conn;
+}
+
+static void serve_drop_conn(struct serve *srv, unsigned int i)
+{
+	pthread_mutex_lock(&srv->lock);
+	serve_conn_put(srv->conns[i]);
+	pthread_mutex_unlock(&srv->lock);
+
+	srv->conns[i] = srv->conns[--srv->nr_conns];
+}
+
+/* Read requests until stdin closes or a signal arrives */
+static int serve_loop(struct serve *srv, bool stdio)
+{
+	struct pollfd pfds[SERVE_CONN_MAX + 1];
+	unsigned int i, nr;
+	int ret;
+
+	while (!serve_stop) {
+		nr = 0;
+		if (srv->listen_fd >= 0) {
+			pfds[nr].fd = srv->listen_fd;
+			pfds[nr++].events = POLLIN;
+		}
+		for (i = 0; i < srv->nr_conns; i++) {
+			pfds[nr].fd = srv->conns[i]->in_fd;
+			pfds[nr++].events = POLLIN;
+		}
+
+		ret = poll(pfds, nr, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* connections first, accepting shifts the indexes */
+		for (i = srv->nr_conns; i-- > 0;) {
+			if (!(pfds[i + (srv->listen_fd >= 0)].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			ret = serve_read(srv, srv->conns[i]);
+			if (ret > 0)
+				continue;
+
+			if (stdio)
+				return ret;
+			serve_drop_conn(srv, i);
+		}
+
+		if (srv->listen_fd >= 0 && (pfds[0].revents & POLLIN))
+			serve_accept(srv);
+	}
+
+	return 0;
+}
+
+int pcache_serve(pcache_opt_t *options)
+{
+	struct serve srv = { .listen_fd = -1 };
+	struct sigaction sa = { .sa_handler = serve_signal };
+	sigset_t mask, old_mask;
+	struct serve_conn *conn;
+	unsigned int i;
+	int out_fd, ret;
+
+	if (!options->co_queues) {
+		printf("--queues must be at least 1\n");
+		return -EINVAL;
+	}
+
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.work, NULL);
+	pthread_cond_init(&srv.idle, NULL);
+	srv.tail = &srv.head;
+	srv.max_age = options->co_interval;
+	srv.lock_timeout_ms = options->co_lock_timeout * 1000;
+
+	pthread_mutex_init(&srv.inv.lock, NULL);
+	ret = pcachesnap_init(&srv.inv.snap);
+	if (ret)
+		return ret;
+	/* workers may hold cache locks while they look up what they created */
+	srv.inv.snap.lock_timeout = -1;
+	srv.inv.snap.engine = options->co_engine;
+	pcachesnap_handles_init(&srv.inv.handles);
+
+	if (options->co_stdio) {
+		/* replies own stdout, messages from the sysfs helpers go to stderr */
+		fflush(stdout);
+		out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			ret = -errno;
+			goto free_inv;
+		}
+
+		conn = serve_conn_new(STDIN_FILENO, out_fd);
+		if (!conn) {
+			close(out_fd);
+			ret = -ENOMEM;
+			goto free_inv;
+		}
+		srv.conns[srv.nr_conns++] = conn;
+	} else {
+		ret = serve_listen(&srv, options->co_listen);
+		if (ret)
+			goto free_inv;
+	}
+
+	/* shared by every thread from here on */
+	json_object_seed(0);
+
+	srv.workers = calloc(options->co_queues, sizeof(*srv.workers));
+	if (!srv.workers) {
+		ret = -ENOMEM;
+		goto close;
+	}
+
+	/* signals are for the reading thread, its poll() returns on them */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	for (i = 0; i < options->co_queues; i++) {
+		srv.workers[i].srv = &srv;
+		ret = -pthread_create(&srv.workers[i].thread, NULL, serve_worker_fn, &srv.workers[i]);
+		if (ret)
+			break;
+		srv.nr_workers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (!ret) {
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		/* a client going away shows up as a failed write, not a signal */
+		signal(SIGPIPE, SIG_IGN);
+		ret = serve_loop(&srv, options->co_stdio);
+	}
+
+	/* answer everything already read before going away */
+	pthread_mutex_lock(&srv.lock);
+	while (serve_busy(&srv) && srv.nr_workers)
+		pthread_cond_wait(&srv.idle, &srv.lock);
+	srv.exiting = true;
+	pthread_cond_broadcast(&srv.work);
+	pthread_mutex_unlock(&srv.lock);
+
+	for (i = 0; i < srv.nr_workers; i++)
+		pthread_join(srv.workers[i].thread, NULL);
+	free(srv.workers);
+close:
+	while (srv.nr_conns)
+		serve_drop_conn(&srv, srv.nr_conns - 1);
+	if (srv.listen_fd >= 0)
+		close(srv.listen_fd);
+	if (srv.unix_path[0])
+		unlink(srv.unix_path);
+free_inv:
+	pcachesnap_handles_free(&srv.inv.handles);
+	pcachesnap_free(&srv.inv.snap);
+	return ret;
+}
@@ -0,0 +1,39 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include "test.h"
+
+char *test_tmpfile(const void *buf, size_t len)
+{
+	char *path = strdup("/tmp/pcache_test.XXXXXX");
+	int fd;
+
+	assert_non_null(path);
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, buf, len), len);
+	close(fd);
+
+	return path;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	failed += test_plan();
+	failed += test_shm();
+	failed += test_dev();
+	failed += test_trace();
+	failed += test_wss();
+	failed += test_crc();
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
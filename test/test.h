@@ -0,0 +1,16 @@
+#ifndef PCACHE_TEST_H
+#define PCACHE_TEST_H
+
+#include <stddef.h>
+
+/* Write @len bytes to a new temporary file, returns its path to unlink and free */
+char *test_tmpfile(const void *buf, size_t len);
+
+int test_plan(void);
+int test_shm(void);
+int test_dev(void);
+int test_trace(void);
+int test_wss(void);
+int test_crc(void);
+
+#endif // PCACHE_TEST_H
@@ -0,0 +1,64 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include "libpcachecrc.h"
+#include "test.h"
+
+/* Check value and the iSCSI test patterns of RFC 3720, B.4 */
+static void test_crc_vectors(void **state)
+{
+	unsigned char buf[32];
+	int i;
+
+	assert_int_equal(pcache_crc32c(0, "", 0), 0);
+	assert_int_equal(pcache_crc32c(0, "123456789", 9), 0xE3069283);
+
+	memset(buf, 0, sizeof(buf));
+	assert_int_equal(pcache_crc32c(0, buf, sizeof(buf)), 0x8A9136AA);
+	memset(buf, 0xff, sizeof(buf));
+	assert_int_equal(pcache_crc32c(0, buf, sizeof(buf)), 0x62A8AB43);
+	for (i = 0; i < 32; i++)
+		buf[i] = i;
+	assert_int_equal(pcache_crc32c(0, buf, sizeof(buf)), 0x46DD794E);
+	for (i = 0; i < 32; i++)
+		buf[i] = 31 - i;
+	assert_int_equal(pcache_crc32c(0, buf, sizeof(buf)), 0x113FDB5C);
+}
+
+/* Any split and any alignment give the same result as one pass */
+static void test_crc_continue(void **state)
+{
+	unsigned char buf[1024 + 8];
+	uint32_t whole, crc;
+	size_t split, off;
+
+	for (off = 0; off < sizeof(buf); off++)
+		buf[off] = off * 131 + 7;
+	whole = pcache_crc32c(0, buf, 1024);
+
+	for (split = 0; split <= 1024; split++) {
+		crc = pcache_crc32c(0, buf, split);
+		assert_int_equal(pcache_crc32c(crc, buf + split, 1024 - split), whole);
+	}
+
+	for (off = 1; off < 8; off++) {
+		memmove(buf + off, buf + off - 1, 1024);
+		assert_int_equal(pcache_crc32c(0, buf + off, 1024), whole);
+	}
+}
+
+int test_crc(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_crc_vectors),
+		cmocka_unit_test(test_crc_continue),
+	};
+
+	return cmocka_run_group_tests_name("crc", tests, NULL, NULL);
+}
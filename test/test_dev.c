@@ -0,0 +1,150 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include "libpcachedev.h"
+#include "test.h"
+
+/* Superblock CRCs of a version 1 header with 4 and 8 segments, from an independent crc32c */
+#define SB_CRC_4SEGS	0xbb861f40
+#define SB_CRC_8SEGS	0x36e04d55
+
+/* A sparse image of @file_segs segments with a superblock, or none when @magic is 0 */
+static char *dev_image(unsigned int file_segs, uint64_t magic, uint16_t version,
+		       uint32_t seg_num, uint32_t crc)
+{
+	struct pcache_sb sb = {
+		.crc = htole32(crc),
+		.version = htole16(version),
+		.magic = htole64(magic),
+		.seg_num = htole32(seg_num),
+	};
+	char *path = test_tmpfile("", 0);
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	assert_true(fd >= 0);
+	assert_int_equal(ftruncate(fd, file_segs * PCACHE_SEG_SIZE), 0);
+	if (magic)
+		assert_int_equal(pwrite(fd, &sb, sizeof(sb), PCACHE_SB_OFF), sizeof(sb));
+	close(fd);
+
+	return path;
+}
+
+static void dev_probe(struct pcachedev_probe *probe, char *path)
+{
+	memset(probe, 0, sizeof(*probe));
+	snprintf(probe->path, sizeof(probe->path), "%s", path);
+	pcachedev_probe(probe);
+	unlink(path);
+	free(path);
+}
+
+static void test_dev_sb_crc(void **state)
+{
+	struct pcache_sb sb = {
+		.crc = 0,
+		.version = htole16(PCACHE_SB_VERSION),
+		.magic = htole64(PCACHE_MAGIC),
+		.seg_num = htole32(4),
+	};
+
+	assert_int_equal(pcachedev_sb_crc(&sb), SB_CRC_4SEGS);
+	/* the crc field itself is not covered */
+	sb.crc = 0xffffffff;
+	assert_int_equal(pcachedev_sb_crc(&sb), SB_CRC_4SEGS);
+}
+
+static void test_dev_probe_valid(void **state)
+{
+	struct pcachedev_probe probe;
+
+	dev_probe(&probe, dev_image(4, PCACHE_MAGIC, PCACHE_SB_VERSION, 4, SB_CRC_4SEGS));
+	assert_int_equal(probe.status, PCACHEDEV_VALID);
+	assert_int_equal(probe.segment_num, 4);
+	assert_int_equal(probe.size, 4 * PCACHE_SEG_SIZE);
+	assert_int_equal(probe.magic, PCACHE_MAGIC);
+	assert_string_equal(pcachedev_status_str(&probe), "valid");
+}
+
+static void test_dev_probe_invalid(void **state)
+{
+	struct pcachedev_probe probe;
+
+	dev_probe(&probe, dev_image(4, PCACHE_MAGIC, PCACHE_SB_VERSION, 4, SB_CRC_4SEGS ^ 1));
+	assert_int_equal(probe.status, PCACHEDEV_CORRUPT);
+	assert_string_equal(pcachedev_status_str(&probe), "superblock crc mismatch");
+
+	/* a version we do not know may checksum differently */
+	dev_probe(&probe, dev_image(4, PCACHE_MAGIC, PCACHE_SB_VERSION + 1, 4, 0));
+	assert_int_equal(probe.status, PCACHEDEV_UNSUPPORTED);
+
+	dev_probe(&probe, dev_image(4, PCACHE_MAGIC, PCACHE_SB_VERSION, 8, SB_CRC_8SEGS));
+	assert_int_equal(probe.status, PCACHEDEV_TRUNCATED);
+
+	dev_probe(&probe, dev_image(4, 0, 0, 0, 0));
+	assert_int_equal(probe.status, PCACHEDEV_FOREIGN);
+
+	dev_probe(&probe, test_tmpfile("short", 5));
+	assert_int_equal(probe.status, PCACHEDEV_FOREIGN);
+
+	memset(&probe, 0, sizeof(probe));
+	snprintf(probe.path, sizeof(probe.path), "/nonexistent/pcache");
+	pcachedev_probe(&probe);
+	assert_int_equal(probe.status, PCACHEDEV_ERROR);
+	assert_int_equal(probe.err, -ENOENT);
+}
+
+static void test_dev_probe_all(void **state)
+{
+	struct pcachedev_probe probes[8];
+	char *paths[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		paths[i] = dev_image(4, PCACHE_MAGIC, PCACHE_SB_VERSION, 4, i & 1 ? 0 : SB_CRC_4SEGS);
+		memset(&probes[i], 0, sizeof(probes[i]));
+		snprintf(probes[i].path, sizeof(probes[i].path), "%s", paths[i]);
+	}
+
+	pcachedev_probe_all(probes, 8, 3);
+
+	for (i = 0; i < 8; i++) {
+		assert_int_equal(probes[i].status, i & 1 ? PCACHEDEV_CORRUPT : PCACHEDEV_VALID);
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+}
+
+static void test_dev_seg_in_use(void **state)
+{
+	static uint64_t info[PCACHE_SEG_INFO_SIZE / sizeof(uint64_t)];
+
+	assert_true(pcachedev_seg_in_use(info, 0));
+	assert_false(pcachedev_seg_in_use(info, 1));
+	info[PCACHE_SEG_INFO_SIZE / sizeof(uint64_t) - 1] = 1;
+	assert_true(pcachedev_seg_in_use(info, 1));
+}
+
+int test_dev(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_dev_sb_crc),
+		cmocka_unit_test(test_dev_probe_valid),
+		cmocka_unit_test(test_dev_probe_invalid),
+		cmocka_unit_test(test_dev_probe_all),
+		cmocka_unit_test(test_dev_seg_in_use),
+	};
+
+	return cmocka_run_group_tests_name("dev", tests, NULL, NULL);
+}
@@ -0,0 +1,166 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include "libpcacheplan.h"
+#include "libpcachetrace.h"
+#include "test.h"
+
+#define SEG_SECTORS	(PCACHE_SEG_SIZE_MB << 11)
+
+static void plan_load_mrc(struct pcacheplan *plan, const char *mrc)
+{
+	char *path = test_tmpfile(mrc, strlen(mrc));
+
+	assert_int_equal(pcacheplan_load_mrc(plan, path), 0);
+	unlink(path);
+	free(path);
+}
+
+/* A curve that only pays off past a dip must win over a shallower one */
+static void test_plan_hull(void **state)
+{
+	struct pcacheplan plan;
+
+	pcacheplan_init(&plan, 0);
+	assert_non_null(pcacheplan_add_backing(&plan, 0, 0));
+	assert_non_null(pcacheplan_add_backing(&plan, 1, 0));
+	plan_load_mrc(&plan,
+		      "# backing segs miss_ratio accesses\n"
+		      "0 5 1.0 100\n"
+		      "0 10 0.0\n"
+		      "1 10 0.5 100\n");
+
+	assert_int_equal(pcacheplan_solve(&plan, 10), 0);
+	assert_int_equal(plan.backings[0].planned_segs, 10);
+	assert_int_equal(plan.backings[1].planned_segs, 0);
+	assert_true(plan.backings[0].planned_hits == 100);
+	assert_int_equal(plan.unassigned_segs, 0);
+
+	pcacheplan_free(&plan);
+}
+
+static void test_plan_mrc_eval(void **state)
+{
+	struct pcacheplan plan;
+
+	pcacheplan_init(&plan, 0);
+	assert_non_null(pcacheplan_add_backing(&plan, 0, 0));
+	/* out of order, sorted on load */
+	plan_load_mrc(&plan, "0 10 0.0 100\n0 5 1.0\n");
+
+	assert_int_equal(plan.backings[0].source, PCACHEPLAN_SRC_MRC);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 0) == 0);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 7) == 40);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 20) == 100);
+
+	pcacheplan_free(&plan);
+}
+
+static void test_plan_fixed_and_min(void **state)
+{
+	struct pcacheplan plan;
+
+	pcacheplan_init(&plan, 2);
+	assert_non_null(pcacheplan_add_backing(&plan, 0, 6));
+	assert_non_null(pcacheplan_add_backing(&plan, 1, 0));
+	plan_load_mrc(&plan, "1 4 0.0 10\n");
+
+	/* no curve: pinned; saturated curve: the rest stays unassigned */
+	assert_int_equal(pcacheplan_solve(&plan, 20), 0);
+	assert_int_equal(plan.backings[0].planned_segs, 6);
+	assert_int_equal(plan.backings[1].planned_segs, 4);
+	assert_int_equal(plan.unassigned_segs, 10);
+
+	assert_int_equal(pcacheplan_solve(&plan, 7), -ENOSPC);
+
+	pcacheplan_free(&plan);
+}
+
+/* Segments 0, 1, 0, 1, ...: nothing hits in one segment, all but two in two */
+static void test_plan_trace_blkparse(void **state)
+{
+	struct pcacheplan plan;
+	char trace[4096] = "";
+	char *path;
+	int i, len = 0;
+
+	for (i = 0; i < 6; i++)
+		len += snprintf(trace + len, sizeof(trace) - len,
+				"  8,0    3  %4d     0.%09d   697  Q   %s %u + 8 [fio]\n",
+				i + 1, i, i & 2 ? "W" : "R", (i & 1) * SEG_SECTORS);
+	/* not queue events, skipped */
+	len += snprintf(trace + len, sizeof(trace) - len,
+			"  8,0    3        7     0.000000007   697  C   R 0 + 8 [0]\n");
+
+	pcacheplan_init(&plan, 0);
+	assert_non_null(pcacheplan_add_backing(&plan, 0, 0));
+	path = test_tmpfile(trace, len);
+	assert_int_equal(pcacheplan_load_trace(&plan, 0, path), 0);
+	unlink(path);
+	free(path);
+
+	assert_int_equal(plan.backings[0].source, PCACHEPLAN_SRC_TRACE);
+	assert_true(plan.backings[0].accesses == 6);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 1) == 0);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 2) == 4);
+
+	assert_int_equal(pcacheplan_load_trace(&plan, 1, "/nonexistent"), -ENOENT);
+
+	pcacheplan_free(&plan);
+}
+
+/* Long enough that the access times get renumbered on the way */
+static void test_plan_trace_binary(void **state)
+{
+	struct pcachetrace_io io = { .len = 4096 };
+	struct pcacheplan plan;
+	char *buf = NULL, *path;
+	size_t len = 0;
+	FILE *out;
+	int i;
+
+	out = open_memstream(&buf, &len);
+	assert_non_null(out);
+	assert_int_equal(pcachetrace_write_header(out), 0);
+	for (i = 0; i < 15000; i++) {
+		io.time_ns = i;
+		io.offset = (uint64_t)(i % 3) * PCACHE_SEG_SIZE_MB * 1024 * 1024;
+		assert_int_equal(pcachetrace_write(out, &io), 0);
+	}
+	fclose(out);
+
+	pcacheplan_init(&plan, 0);
+	assert_non_null(pcacheplan_add_backing(&plan, 0, 0));
+	path = test_tmpfile(buf, len);
+	assert_int_equal(pcacheplan_load_trace(&plan, 0, path), 0);
+	unlink(path);
+	free(path);
+	free(buf);
+
+	assert_true(plan.backings[0].accesses == 15000);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 2) == 0);
+	assert_true(pcacheplan_curve_eval(&plan.backings[0], 3) == 14997);
+
+	pcacheplan_free(&plan);
+}
+
+int test_plan(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_plan_hull),
+		cmocka_unit_test(test_plan_mrc_eval),
+		cmocka_unit_test(test_plan_fixed_and_min),
+		cmocka_unit_test(test_plan_trace_blkparse),
+		cmocka_unit_test(test_plan_trace_binary),
+	};
+
+	return cmocka_run_group_tests_name("plan", tests, NULL, NULL);
+}
@@ -0,0 +1,212 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cmocka.h>
+
+#include "libpcacheshm.h"
+#include "test.h"
+
+#define SHM_TEST_BACKINGS	8
+
+/* One cache with @nr backings, every counter of every backing set to @v */
+static void shm_fill(struct pcachesnap *snap, unsigned int nr, unsigned int v)
+{
+	struct pcache_cache cache = { .magic = 1, .version = 1, .segment_num = 100 };
+	struct pcache_backing backing = { 0 };
+	unsigned int i;
+
+	pcachesnap_reset(snap);
+	snprintf(cache.path, sizeof(cache.path), "/dev/pmem0");
+	assert_int_equal(pcachesnap_add_cache(snap, &cache), 0);
+
+	for (i = 0; i < nr; i++) {
+		backing.backing_id = i;
+		backing.cache_segs = v;
+		backing.cache_used_segs = v;
+		backing.cache_gc_percent = v;
+		backing.logic_dev_id = i;
+		snprintf(backing.backing_path, sizeof(backing.backing_path), "/dev/sd%u", i);
+		assert_int_equal(pcachesnap_add_backing(snap, 0, &backing), 0);
+	}
+}
+
+static char *shm_tmpname(void)
+{
+	char *path = test_tmpfile("", 0);
+
+	unlink(path);
+	return path;
+}
+
+static void test_shm_read(void **state)
+{
+	struct pcacheshm_writer writer;
+	struct pcacheshm_reader reader;
+	struct pcacheshm_backing backing;
+	struct pcacheshm_cache cache;
+	struct pcachesnap snap;
+	char path[PCACHESHM_PATH_MAX];
+	char *name = shm_tmpname();
+
+	assert_int_equal(pcachesnap_init(&snap), 0);
+	shm_fill(&snap, SHM_TEST_BACKINGS, 7);
+
+	assert_int_equal(pcacheshm_writer_open(&writer, name, 0, 0), 0);
+	assert_int_equal(pcacheshm_publish(&writer, &snap), 0);
+	assert_int_equal(pcacheshm_open(&reader, name), 0);
+
+	assert_int_equal(pcacheshm_read_cache(&reader, 0, &cache, path), 0);
+	assert_int_equal(cache.nr_backings, SHM_TEST_BACKINGS);
+	assert_string_equal(path, "/dev/pmem0");
+	assert_int_equal(pcacheshm_read_backing(&reader, 0, 3, &backing, path), 0);
+	assert_int_equal(backing.cache_segs, 7);
+	assert_string_equal(path, "/dev/sd3");
+	assert_int_equal(pcacheshm_read_logic_dev(&reader, 5, &backing, NULL), 0);
+	assert_int_equal(backing.backing_id, 5);
+
+	assert_int_equal(pcacheshm_read_cache(&reader, 1, &cache, NULL), -ENOENT);
+	assert_int_equal(pcacheshm_read_backing(&reader, 0, SHM_TEST_BACKINGS, &backing, NULL), -ENOENT);
+
+	pcacheshm_close(&reader);
+	pcacheshm_writer_close(&writer, true);
+	pcachesnap_free(&snap);
+	free(name);
+}
+
+/* A publisher that died mid-update, and one that moved to a bigger segment */
+static void test_shm_odd_and_stale(void **state)
+{
+	struct pcacheshm_writer writer;
+	struct pcacheshm_reader reader;
+	struct pcacheshm_backing backing;
+	struct pcachesnap snap;
+	uint64_t seq;
+	char *name = shm_tmpname();
+
+	assert_int_equal(pcachesnap_init(&snap), 0);
+	shm_fill(&snap, 1, 1);
+	assert_int_equal(pcacheshm_writer_open(&writer, name, 0, 0), 0);
+	assert_int_equal(pcacheshm_publish(&writer, &snap), 0);
+	assert_int_equal(pcacheshm_open(&reader, name), 0);
+
+	seq = writer.hdr->seq;
+	__atomic_store_n(&writer.hdr->seq, seq + 1, __ATOMIC_RELEASE);
+	assert_int_equal(pcacheshm_read_backing(&reader, 0, 0, &backing, NULL), -EAGAIN);
+	__atomic_store_n(&writer.hdr->seq, seq + 2, __ATOMIC_RELEASE);
+	assert_int_equal(pcacheshm_read_backing(&reader, 0, 0, &backing, NULL), 0);
+
+	/* more backings than the segment holds */
+	shm_fill(&snap, writer.hdr->backing_cap + 1, 2);
+	assert_int_equal(pcacheshm_publish(&writer, &snap), 0);
+	assert_int_equal(pcacheshm_read_backing(&reader, 0, 0, &backing, NULL), -ESTALE);
+
+	pcacheshm_close(&reader);
+	assert_int_equal(pcacheshm_open(&reader, name), 0);
+	assert_int_equal(pcacheshm_read_backing(&reader, 0, writer.hdr->backing_cap / 2, &backing, NULL), 0);
+	assert_int_equal(backing.cache_segs, 2);
+
+	pcacheshm_close(&reader);
+	pcacheshm_writer_close(&writer, true);
+	pcachesnap_free(&snap);
+	free(name);
+}
+
+struct shm_publisher {
+	struct pcacheshm_writer	writer;
+	struct pcachesnap	snap;
+	volatile bool		stop;
+	unsigned int		updates;
+};
+
+static void *shm_publisher_fn(void *data)
+{
+	struct shm_publisher *pub = data;
+	struct pcache_backing backing = { 0 };
+	unsigned int i;
+
+	while (!pub->stop) {
+		pub->updates++;
+		pcachesnap_reset(&pub->snap);
+		for (i = 0; i < SHM_TEST_BACKINGS; i++) {
+			backing.backing_id = i;
+			backing.cache_segs = pub->updates;
+			backing.cache_used_segs = pub->updates;
+			backing.cache_gc_percent = pub->updates;
+			if (pcachesnap_add_backing(&pub->snap, 0, &backing))
+				return NULL;
+		}
+		pcacheshm_publish(&pub->writer, &pub->snap);
+	}
+
+	return NULL;
+}
+
+/* Every snapshot a reader gets comes from a single update, never a mix */
+static void test_shm_no_torn_reads(void **state)
+{
+	struct pcacheshm_backing backings[SHM_TEST_BACKINGS];
+	struct pcacheshm_cache caches[1];
+	struct pcacheshm_reader reader;
+	struct shm_publisher pub = { 0 };
+	unsigned int nr_caches, nr_backings, i, reads, changes = 0, last = 0;
+	char *name = shm_tmpname();
+	bool torn = false;
+	pthread_t thread;
+	int ret = 0;
+
+	assert_int_equal(pcachesnap_init(&pub.snap), 0);
+	shm_fill(&pub.snap, SHM_TEST_BACKINGS, 0);
+	assert_int_equal(pcacheshm_writer_open(&pub.writer, name, 0, 0), 0);
+	assert_int_equal(pcacheshm_publish(&pub.writer, &pub.snap), 0);
+	assert_int_equal(pcacheshm_open(&reader, name), 0);
+	assert_int_equal(pthread_create(&thread, NULL, shm_publisher_fn, &pub), 0);
+
+	for (reads = 0; reads < 200000 && !torn; reads++) {
+		nr_caches = 1;
+		nr_backings = SHM_TEST_BACKINGS;
+		ret = pcacheshm_read_all(&reader, caches, &nr_caches, backings, &nr_backings, NULL);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret)
+			break;
+		for (i = 0; i < nr_backings; i++) {
+			if (backings[i].cache_segs != backings[0].cache_segs ||
+			    backings[i].cache_used_segs != backings[0].cache_segs ||
+			    backings[i].cache_gc_percent != backings[0].cache_segs)
+				torn = true;
+		}
+		if (backings[0].cache_segs != last)
+			changes++;
+		last = backings[0].cache_segs;
+	}
+
+	pub.stop = true;
+	pthread_join(thread, NULL);
+
+	assert_false(torn);
+	assert_true(ret == 0 || ret == -EAGAIN);
+	assert_true(changes > 0);
+
+	pcacheshm_close(&reader);
+	pcacheshm_writer_close(&pub.writer, true);
+	pcachesnap_free(&pub.snap);
+	free(name);
+}
+
+int test_shm(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_shm_read),
+		cmocka_unit_test(test_shm_odd_and_stale),
+		cmocka_unit_test(test_shm_no_torn_reads),
+	};
+
+	return cmocka_run_group_tests_name("shm", tests, NULL, NULL);
+}
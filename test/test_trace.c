@@ -0,0 +1,133 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include "libpcachetrace.h"
+#include "test.h"
+
+static void trace_open_buf(struct pcachetrace *trace, const void *buf, size_t len, int expect)
+{
+	char *path = test_tmpfile(buf, len);
+
+	assert_int_equal(pcachetrace_open(trace, path), expect);
+	unlink(path);
+	free(path);
+}
+
+static void test_trace_blkparse(void **state)
+{
+	const char *text =
+		"  8,0    3        1     0.000000000   697  Q   W 223490 + 8 [kjournald]\n"
+		"  8,0    3        2     0.000001000   697  G   W 223490 + 8 [kjournald]\n"
+		"  8,0    3        3     1.500000000   697  Q  RA 16 + 256 [cat]\n"
+		"  8,0    3        4     1.600000000   697  Q  DS 0 + 2048 [fstrim]\n"
+		"  8,0    3        5     1.700000000   697  Q  FN 0 + 0 [sync]\n"
+		"  8,0    3        6     2.000000000   697  Q  WS 8 + 1 [fsync]\n"
+		"  8,0    3        7     2.100000000   697  Q   N 0 + 8 [x]\n"
+		"CPU3 (8,0):\n"
+		" Reads Queued:           1,      128KiB\n";
+	struct pcachetrace trace;
+	struct pcachetrace_io io;
+
+	trace_open_buf(&trace, text, strlen(text), 0);
+	assert_false(trace.binary);
+
+	assert_int_equal(pcachetrace_next(&trace, &io), 1);
+	assert_int_equal(io.time_ns, 0);
+	assert_int_equal(io.offset, 223490ULL * 512);
+	assert_int_equal(io.len, 8 * 512);
+	assert_int_equal(io.flags, PCACHETRACE_F_WRITE);
+
+	/* readahead is a read, only queue events count */
+	assert_int_equal(pcachetrace_next(&trace, &io), 1);
+	assert_int_equal(io.time_ns, 1500000000ULL);
+	assert_int_equal(io.offset, 16 * 512);
+	assert_int_equal(io.len, 256 * 512);
+	assert_int_equal(io.flags, 0);
+
+	/* discards, flushes without data and N events are not replayed */
+	assert_int_equal(pcachetrace_next(&trace, &io), 1);
+	assert_int_equal(io.time_ns, 2000000000ULL);
+	assert_int_equal(io.offset, 8 * 512);
+	assert_int_equal(io.len, 512);
+	assert_int_equal(io.flags, PCACHETRACE_F_WRITE);
+
+	assert_int_equal(pcachetrace_next(&trace, &io), 0);
+	assert_int_equal(trace.skipped, 6);
+	assert_int_equal(pcachetrace_close(&trace), 0);
+}
+
+static void test_trace_binary(void **state)
+{
+	struct pcachetrace_io in[3] = {
+		{ .time_ns = 1, .offset = 0, .len = 4096, .flags = 0 },
+		{ .time_ns = 2, .offset = 1ULL << 40, .len = 1 << 20, .flags = PCACHETRACE_F_WRITE },
+		{ .time_ns = UINT64_MAX, .offset = 512, .len = 512, .flags = 0 },
+	};
+	struct pcachetrace trace;
+	struct pcachetrace_io io;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+	int i;
+
+	out = open_memstream(&buf, &len);
+	assert_non_null(out);
+	assert_int_equal(pcachetrace_write_header(out), 0);
+	for (i = 0; i < 3; i++)
+		assert_int_equal(pcachetrace_write(out, &in[i]), 0);
+	fclose(out);
+
+	assert_int_equal(len, sizeof(struct pcachetrace_header) + 3 * sizeof(io));
+	trace_open_buf(&trace, buf, len, 0);
+	assert_true(trace.binary);
+	for (i = 0; i < 3; i++) {
+		assert_int_equal(pcachetrace_next(&trace, &io), 1);
+		assert_memory_equal(&io, &in[i], sizeof(io));
+	}
+	assert_int_equal(pcachetrace_next(&trace, &io), 0);
+	pcachetrace_close(&trace);
+
+	/* a header only is an empty trace */
+	trace_open_buf(&trace, buf, sizeof(struct pcachetrace_header), 0);
+	assert_int_equal(pcachetrace_next(&trace, &io), 0);
+	pcachetrace_close(&trace);
+
+	free(buf);
+}
+
+static void test_trace_bad_header(void **state)
+{
+	struct pcachetrace_header hdr;
+	struct pcachetrace trace;
+
+	memcpy(hdr.magic, PCACHETRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(PCACHETRACE_VERSION + 1);
+	hdr.record_size = htole32(sizeof(struct pcachetrace_io));
+	trace_open_buf(&trace, &hdr, sizeof(hdr), -EINVAL);
+
+	hdr.version = htole32(PCACHETRACE_VERSION);
+	hdr.record_size = htole32(sizeof(struct pcachetrace_io) / 2);
+	trace_open_buf(&trace, &hdr, sizeof(hdr), -EINVAL);
+
+	assert_int_equal(pcachetrace_open(&trace, "/nonexistent/trace"), -ENOENT);
+}
+
+int test_trace(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_trace_blkparse),
+		cmocka_unit_test(test_trace_binary),
+		cmocka_unit_test(test_trace_bad_header),
+	};
+
+	return cmocka_run_group_tests_name("trace", tests, NULL, NULL);
+}
@@ -0,0 +1,119 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <cmocka.h>
+
+#include "libpcachewss.h"
+#include "test.h"
+
+#define BLOCK	(1U << PCACHEWSS_BLOCK_SHIFT)
+
+static void wss_add_blocks(struct pcachewss *wss, uint64_t first, uint64_t nr)
+{
+	uint64_t i;
+
+	for (i = 0; i < nr; i++)
+		pcachewss_add(wss, (first + i) * BLOCK, BLOCK);
+}
+
+static void assert_near(double value, double want, double tolerance)
+{
+	if (fabs(value - want) > want * tolerance)
+		fail_msg("%.0f is not within %.1f%% of %.0f", value, tolerance * 100, want);
+}
+
+static void test_wss_ranges(void **state)
+{
+	struct pcachewss *wss = malloc(sizeof(*wss));
+
+	assert_non_null(wss);
+	pcachewss_init(wss);
+	assert_true(pcachewss_estimate(wss) == 0);
+
+	pcachewss_add(wss, 0, 4 * BLOCK);
+	assert_int_equal(wss->accesses, 4);
+	/* an empty I/O still touches its block, a straddling one both */
+	pcachewss_add(wss, 100 * BLOCK, 0);
+	assert_int_equal(wss->accesses, 5);
+	pcachewss_add(wss, 200 * BLOCK - 1, 2);
+	assert_int_equal(wss->accesses, 7);
+
+	free(wss);
+}
+
+static void test_wss_estimate(void **state)
+{
+	struct pcachewss *wss = malloc(sizeof(*wss));
+	int i;
+
+	assert_non_null(wss);
+
+	/* small range, linear counting */
+	pcachewss_init(wss);
+	for (i = 0; i < 10; i++)
+		wss_add_blocks(wss, 0, 1000);
+	assert_int_equal(wss->accesses, 10000);
+	assert_near(pcachewss_estimate(wss), 1000, 0.02);
+
+	/* large range, ~0.8% standard error */
+	pcachewss_init(wss);
+	wss_add_blocks(wss, 1ULL << 30, 1000000);
+	assert_near(pcachewss_estimate(wss), 1000000, 0.03);
+	assert_true(wss->nr_points <= PCACHEWSS_POINTS_MAX);
+
+	free(wss);
+}
+
+/* 50000 blocks, then the same ones over and over: the knee is at the first pass */
+static void test_wss_knee(void **state)
+{
+	struct pcachewss *wss = malloc(sizeof(*wss));
+	struct pcachewss_point knee;
+	int i;
+
+	assert_non_null(wss);
+	pcachewss_init(wss);
+	assert_false(pcachewss_knee(wss, &knee));
+
+	for (i = 0; i < 10; i++)
+		wss_add_blocks(wss, 0, 50000);
+	assert_true(pcachewss_knee(wss, &knee));
+	assert_near(knee.blocks, 50000, 0.03);
+	assert_in_range(knee.accesses, 45000, 55000);
+
+	free(wss);
+}
+
+static void test_wss_no_knee(void **state)
+{
+	struct pcachewss *wss = malloc(sizeof(*wss));
+	struct pcachewss_point knee;
+
+	assert_non_null(wss);
+	pcachewss_init(wss);
+
+	/* every access a new block: a straight line, the whole sample is the working set */
+	wss_add_blocks(wss, 0, 200000);
+	assert_false(pcachewss_knee(wss, &knee));
+	assert_int_equal(knee.accesses, 200000);
+	assert_near(knee.blocks, 200000, 0.03);
+
+	free(wss);
+}
+
+int test_wss(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_wss_ranges),
+		cmocka_unit_test(test_wss_estimate),
+		cmocka_unit_test(test_wss_knee),
+		cmocka_unit_test(test_wss_no_knee),
+	};
+
+	return cmocka_run_group_tests_name("wss", tests, NULL, NULL);
+}